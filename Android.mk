@@ -15,6 +15,9 @@ LOCAL_SRC_FILES := \
     mounts.c \
     extendedcommands.c \
     nandroid.c \
+    nandroid_tar.c \
+    nandroid_lz4.c \
+    nandroid_md5.c \
     reboot.c \
     ../../system/core/toolbox/dynarray.c \
     ../../system/core/toolbox/newfs_msdos.c \
@@ -100,9 +103,17 @@ LOCAL_STATIC_LIBRARIES :=
 LOCAL_CFLAGS += -DUSE_EXT4 -DMINIVOLD
 LOCAL_C_INCLUDES += system/extras/ext4_utils system/core/fs_mgr/include external/fsck_msdos
 LOCAL_C_INCLUDES += system/vold
+LOCAL_C_INCLUDES += external/openssl/include
 
 LOCAL_STATIC_LIBRARIES += libext4_utils_static libz libsparse_static
 
+# zstd backups are only offered when the tree carries libzstd
+ifneq ($(wildcard external/zstd/lib/zstd.h),)
+  LOCAL_CFLAGS += -DHAVE_LIBZSTD
+  LOCAL_C_INCLUDES += external/zstd/lib
+  LOCAL_STATIC_LIBRARIES += libzstd
+endif
+
 ifeq ($(ENABLE_LOKI_RECOVERY),true)
   LOCAL_CFLAGS += -DENABLE_LOKI
   LOCAL_STATIC_LIBRARIES += libloki_recovery
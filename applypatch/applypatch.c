@@ -16,21 +16,28 @@
 
 #include <errno.h>
 #include <libgen.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <linux/fs.h>
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -44,21 +51,23 @@ static int GenerateTarget(FileContents* source_file,
 
 static int mtd_partitions_scanned = 0;
 
-// Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
-// the retouched entries back to their original value (such that SHA-1 checks
-// don't fail due to randomization); store the file contents and associated
-// metadata in *file.
+// Read a file into memory, or map it if 'map' is set; optionally
+// (retouch_flag == RETOUCH_DO_MASK) mask the retouched entries back to
+// their original value (such that SHA-1 checks don't fail due to
+// randomization); store the file contents and associated metadata in
+// *file.
 //
 // Return 0 on success.
-int LoadFileContents(const char* filename, FileContents* file,
-                     int retouch_flag) {
+static int LoadContents(const char* filename, FileContents* file,
+                        int retouch_flag, int map) {
     file->data = NULL;
+    file->map_size = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, map);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -67,25 +76,44 @@ int LoadFileContents(const char* filename, FileContents* file,
     }
 
     file->size = file->st.st_size;
-    file->data = malloc(file->size);
 
-    FILE* f = fopen(filename, "rb");
-    if (f == NULL) {
-        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
-        free(file->data);
-        file->data = NULL;
-        return -1;
+    if (map && file->size > 0) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+            return -1;
+        }
+        // Private and writable so that retouch masking stays in memory.
+        void* data = mmap(NULL, file->size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data != MAP_FAILED) {
+            file->data = data;
+            file->map_size = file->size;
+        }
     }
 
-    ssize_t bytes_read = fread(file->data, 1, file->size, f);
-    if (bytes_read != file->size) {
-        printf("short read of \"%s\" (%ld bytes of %ld)\n",
-               filename, (long)bytes_read, (long)file->size);
-        free(file->data);
-        file->data = NULL;
-        return -1;
+    if (file->data == NULL) {
+        file->data = malloc(file->size);
+
+        FILE* f = fopen(filename, "rb");
+        if (f == NULL) {
+            printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+            free(file->data);
+            file->data = NULL;
+            return -1;
+        }
+
+        ssize_t bytes_read = fread(file->data, 1, file->size, f);
+        if (bytes_read != file->size) {
+            printf("short read of \"%s\" (%ld bytes of %ld)\n",
+                   filename, (long)bytes_read, (long)file->size);
+            free(file->data);
+            file->data = NULL;
+            return -1;
+        }
+        fclose(f);
     }
-    fclose(f);
 
     // apply_patch[_check] functions are blind to randomization. Randomization
     // is taken care of in [Undo]RetouchBinariesFn. If there is a mismatch
@@ -95,8 +123,7 @@ int LoadFileContents(const char* filename, FileContents* file,
         if (retouch_mask_data(file->data, file->size,
                               &desired_offset, NULL) != RETOUCH_DATA_MATCHED) {
             printf("error trying to mask retouch entries\n");
-            free(file->data);
-            file->data = NULL;
+            FreeFileContents(file);
             return -1;
         }
     }
@@ -105,6 +132,29 @@ int LoadFileContents(const char* filename, FileContents* file,
     return 0;
 }
 
+int LoadFileContents(const char* filename, FileContents* file,
+                     int retouch_flag) {
+    return LoadContents(filename, file, retouch_flag, 0);
+}
+
+// Like LoadFileContents(), but map files and EMMC partitions instead of
+// reading them into memory, so that large sources don't have to fit in
+// RAM.  The result must be released with FreeFileContents().
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag) {
+    return LoadContents(filename, file, retouch_flag, 1);
+}
+
+void FreeFileContents(FileContents* file) {
+    if (file->map_size != 0) {
+        munmap(file->data, file->map_size);
+    } else {
+        free(file->data);
+    }
+    file->data = NULL;
+    file->map_size = 0;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -135,9 +185,13 @@ static int compare_size_indices(const void* a, const void* b) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// If 'map' is set, an EMMC partition is mapped rather than read into
+// memory.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map) {
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
@@ -189,6 +243,8 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
 
     MtdReadContext* ctx = NULL;
     FILE* dev = NULL;
+    int fd = -1;
+    off64_t dev_size = 0;
 
     switch (type) {
         case MTD:
@@ -213,6 +269,18 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             break;
 
         case EMMC:
+            if (map) {
+                fd = open(partition, O_RDONLY);
+                if (fd >= 0) {
+                    dev_size = lseek64(fd, 0, SEEK_END);
+                }
+                if (fd < 0 || dev_size < 0) {
+                    printf("failed to open emmc partition \"%s\": %s\n",
+                           partition, strerror(errno));
+                    return -1;
+                }
+                break;
+            }
             dev = fopen(partition, "rb");
             if (dev == NULL) {
                 printf("failed to open emmc partition \"%s\": %s\n",
@@ -225,8 +293,23 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
+    // allocate enough memory to hold the largest size, or map that much
+    // of the partition.  Only the part of the mapping that lies within
+    // the partition is ever touched.
+    if (fd >= 0) {
+        void* data = mmap(NULL, size[index[pairs-1]], PROT_READ,
+                          MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("failed to map emmc partition \"%s\": %s\n",
+                   partition, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        file->data = data;
+        file->map_size = size[index[pairs-1]];
+    } else {
+        file->data = malloc(size[index[pairs-1]]);
+    }
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -243,14 +326,20 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    if (fd >= 0) {
+                        read = next;
+                        if (file->size + next > dev_size) {
+                            read = dev_size > file->size ? dev_size - file->size : 0;
+                        }
+                    } else {
+                        read = fread(p, 1, next, dev);
+                    }
                     break;
             }
             if (next != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
                        read, next, partition);
-                free(file->data);
-                file->data = NULL;
+                FreeFileContents(file);
                 return -1;
             }
             SHA_update(&sha_ctx, p, read);
@@ -266,8 +355,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
+            FreeFileContents(file);
             return -1;
         }
 
@@ -288,7 +376,11 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             break;
 
         case EMMC:
-            fclose(dev);
+            if (fd >= 0) {
+                close(fd);
+            } else {
+                fclose(dev);
+            }
             break;
     }
 
@@ -298,8 +390,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         // finding a match.
         printf("contents of partition \"%s\" didn't match %s\n",
                partition, filename);
-        free(file->data);
-        file->data = NULL;
+        FreeFileContents(file);
         return -1;
     }
 
@@ -355,6 +446,446 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
+// EMMC targets are written in chunks of this size, each flushed to the
+// device and then read back by a verifier thread while the next chunk is
+// being written.
+#define EMMC_CHUNK_SIZE (1 << 20)
+#define EMMC_ALIGNMENT 4096
+#define EMMC_WRITE_ATTEMPTS 10
+// EMMC targets at least this large are streamed to the partition while
+// they are patched instead of being held in memory.
+#define EMMC_STREAM_THRESHOLD (32 << 20)
+
+typedef struct {
+    size_t len;
+    const char* partition;
+    int fd;
+    size_t sector;
+    unsigned char* buffer;
+    // SHA-1 of each chunk as it was written
+    uint8_t (*digests)[SHA_DIGEST_SIZE];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t written;       // bytes flushed to the device
+    size_t verified;      // bytes read back and found to match
+    int writer_done;
+    int mismatch;
+    int read_error;
+} EmmcVerifier;
+
+static ssize_t ReadFully(int fd, unsigned char* buffer, size_t len, off64_t offset) {
+    size_t so_far = 0;
+    while (so_far < len) {
+        ssize_t read_count = pread64(fd, buffer+so_far, len-so_far, offset+so_far);
+        if (read_count < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (read_count == 0) break;
+        so_far += read_count;
+    }
+    return so_far;
+}
+
+static ssize_t WriteFully(int fd, const unsigned char* buffer, size_t len, off64_t offset) {
+    size_t so_far = 0;
+    while (so_far < len) {
+        ssize_t written = pwrite64(fd, buffer+so_far, len-so_far, offset+so_far);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (written == 0) break;
+        so_far += written;
+    }
+    return so_far;
+}
+
+// Device reads and writes are rounded up to whole sectors.
+static size_t RoundToSector(size_t len, size_t sector) {
+    return (len + sector - 1) / sector * sector;
+}
+
+// Reads back each chunk once the writer has flushed it and compares its
+// SHA-1 with the digest of the data that was written.  Starts at
+// v->verified and stops at the first chunk that differs.
+static void* VerifyEmmcChunks(void* cookie) {
+    EmmcVerifier* v = (EmmcVerifier*)cookie;
+    size_t pos = v->verified;
+
+    while (pos < v->len) {
+        pthread_mutex_lock(&v->lock);
+        while (v->written <= pos && !v->writer_done) {
+            pthread_cond_wait(&v->cond, &v->lock);
+        }
+        size_t available = v->written;
+        pthread_mutex_unlock(&v->lock);
+        if (available <= pos) break;
+
+        while (pos < available) {
+            size_t to_read = available - pos;
+            if (to_read > EMMC_CHUNK_SIZE) to_read = EMMC_CHUNK_SIZE;
+            size_t rounded = RoundToSector(to_read, v->sector);
+
+            if (ReadFully(v->fd, v->buffer, rounded, pos) != (ssize_t)rounded) {
+                printf("verify read error %s at %ld: %s\n",
+                       v->partition, (long)pos, strerror(errno));
+                pthread_mutex_lock(&v->lock);
+                v->read_error = 1;
+                pthread_mutex_unlock(&v->lock);
+                return NULL;
+            }
+
+            uint8_t digest[SHA_DIGEST_SIZE];
+            SHA_hash(v->buffer, to_read, digest);
+            if (memcmp(digest, v->digests[pos / EMMC_CHUNK_SIZE], SHA_DIGEST_SIZE) != 0) {
+                printf("verification failed starting at %ld\n", (long)pos);
+                pthread_mutex_lock(&v->lock);
+                v->mismatch = 1;
+                pthread_mutex_unlock(&v->lock);
+                return NULL;
+            }
+
+            pos += to_read;
+            pthread_mutex_lock(&v->lock);
+            v->verified = pos;
+            pthread_mutex_unlock(&v->lock);
+        }
+    }
+    return NULL;
+}
+
+// An EMMC partition opened for writing, with the verifier that reads
+// back what has been written.
+typedef struct {
+    int fd;
+    int direct;
+    unsigned char* buffer;
+    EmmcVerifier v;
+    struct timeval begin;
+    size_t total_written;
+} EmmcWriter;
+
+// Open 'partition' to write 'len' bytes to it.  The device is opened with
+// O_DIRECT where the kernel allows it, so neither the writes nor the
+// verification reads go through the page cache; otherwise the block
+// device buffers are invalidated after each chunk is flushed.  Return 0
+// on success.
+static int OpenEmmcWriter(EmmcWriter* w, const char* partition, size_t len) {
+    memset(w, 0, sizeof(*w));
+    w->direct = 1;
+    w->fd = open(partition, O_RDWR | O_DIRECT);
+    if (w->fd < 0 && errno == EINVAL) {
+        w->direct = 0;
+        w->fd = open(partition, O_RDWR);
+    }
+    if (w->fd < 0) {
+        printf("failed to open %s: %s\n", partition, strerror(errno));
+        return -1;
+    }
+
+    EmmcVerifier* v = &w->v;
+    v->len = len;
+    v->partition = partition;
+    v->fd = open(partition, O_RDONLY | (w->direct ? O_DIRECT : 0));
+    if (v->fd < 0) {
+        printf("failed to open %s for verification: %s\n",
+               partition, strerror(errno));
+        close(w->fd);
+        return -1;
+    }
+
+    int sector = 0;
+    if (ioctl(w->fd, BLKSSZGET, &sector) != 0 || sector < 512 ||
+        sector > EMMC_ALIGNMENT || (sector & (sector - 1)) != 0) {
+        sector = 512;
+    }
+    v->sector = sector;
+
+    size_t chunks = (len + EMMC_CHUNK_SIZE - 1) / EMMC_CHUNK_SIZE;
+    w->buffer = memalign(EMMC_ALIGNMENT, EMMC_CHUNK_SIZE);
+    v->buffer = memalign(EMMC_ALIGNMENT, EMMC_CHUNK_SIZE);
+    v->digests = malloc((chunks ? chunks : 1) * SHA_DIGEST_SIZE);
+    if (w->buffer == NULL || v->buffer == NULL || v->digests == NULL) {
+        printf("failed to allocate buffers for %s\n", partition);
+        free(w->buffer);
+        free(v->buffer);
+        free(v->digests);
+        close(v->fd);
+        close(w->fd);
+        return -1;
+    }
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->cond, NULL);
+    gettimeofday(&w->begin, NULL);
+    return 0;
+}
+
+// Start verifying from 'start', which must be a chunk boundary.
+static int StartEmmcVerifier(EmmcWriter* w, pthread_t* thread, size_t start) {
+    EmmcVerifier* v = &w->v;
+    v->written = v->verified = start;
+    v->writer_done = v->mismatch = v->read_error = 0;
+    if (pthread_create(thread, NULL, VerifyEmmcChunks, v) != 0) {
+        printf("failed to start verifier for %s\n", v->partition);
+        return -1;
+    }
+    return 0;
+}
+
+// Tell the verifier that nothing more will be written and wait for it.
+static void FinishEmmcVerifier(EmmcWriter* w, pthread_t thread) {
+    EmmcVerifier* v = &w->v;
+    pthread_mutex_lock(&v->lock);
+    v->writer_done = 1;
+    pthread_cond_signal(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+    pthread_join(thread, NULL);
+}
+
+static int EmmcVerifyFailed(EmmcWriter* w) {
+    pthread_mutex_lock(&w->v.lock);
+    int failed = w->v.mismatch || w->v.read_error;
+    pthread_mutex_unlock(&w->v.lock);
+    return failed;
+}
+
+// Write the chunk starting at 'pos', flush it and hand it to the
+// verifier.  Return 0 on success.
+static int WriteEmmcChunk(EmmcWriter* w, const unsigned char* data,
+                          size_t pos, size_t len) {
+    EmmcVerifier* v = &w->v;
+    size_t rounded = RoundToSector(len, v->sector);
+
+    // A partial last sector keeps whatever follows the image.
+    if (rounded > len) {
+        size_t last = rounded - v->sector;
+        if (ReadFully(w->fd, w->buffer+last, v->sector, pos+last) != (ssize_t)v->sector) {
+            printf("failed to read last sector of %s (%s)\n",
+                   v->partition, strerror(errno));
+            return -1;
+        }
+    }
+    memcpy(w->buffer, data, len);
+    SHA_hash(data, len, v->digests[pos / EMMC_CHUNK_SIZE]);
+
+    if (WriteFully(w->fd, w->buffer, rounded, pos) != (ssize_t)rounded) {
+        printf("failed write writing to %s (%s)\n",
+               v->partition, strerror(errno));
+        return -1;
+    }
+    fsync(w->fd);
+    if (!w->direct) {
+        // drop the buffered copy so the verifier reads the device
+        ioctl(w->fd, BLKFLSBUF, 0);
+    }
+    w->total_written += len;
+
+    pthread_mutex_lock(&v->lock);
+    v->written = pos + len;
+    pthread_cond_signal(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+    return 0;
+}
+
+// Release the writer, reporting the throughput if 'success'.  Return 0
+// if the device was closed cleanly.
+static int CloseEmmcWriter(EmmcWriter* w, int success) {
+    EmmcVerifier* v = &w->v;
+    struct timeval end;
+    gettimeofday(&end, NULL);
+
+    pthread_mutex_destroy(&v->lock);
+    pthread_cond_destroy(&v->cond);
+    free(w->buffer);
+    free(v->buffer);
+    free(v->digests);
+    close(v->fd);
+
+    if (close(w->fd) != 0) {
+        printf("error closing %s (%s)\n", v->partition, strerror(errno));
+        return -1;
+    }
+
+    if (success) {
+        double elapsed = (end.tv_sec - w->begin.tv_sec) +
+                         (end.tv_usec - w->begin.tv_usec) / 1000000.0;
+        printf("wrote and verified %ld bytes to %s in %.2f s (%.1f MB/s)\n",
+               (long)w->total_written, v->partition, elapsed,
+               elapsed > 0 ? w->total_written / elapsed / (1024 * 1024) : 0.0);
+
+        // hack: sync and sleep after closing in hopes of getting the data
+        // actually onto flash.  Direct writes have already been flushed
+        // to the device, so only buffered writes still need the sleep.
+        sync();
+        if (!w->direct) {
+            printf("sleeping after close\n");
+            sleep(5);
+        }
+    }
+    return 0;
+}
+
+// Write a memory buffer to an EMMC partition device and verify it by
+// reading it back.  A chunk that reads back differently is rewritten,
+// along with everything after it.  Return 0 on success.
+static int WriteToEmmc(const unsigned char* data, size_t len,
+                       const char* partition) {
+    EmmcWriter w;
+    if (OpenEmmcWriter(&w, partition, len) != 0) {
+        return -1;
+    }
+
+    size_t start = 0;
+    int success = 0;
+    int failed = 0;
+    int attempt;
+    for (attempt = 0; attempt < EMMC_WRITE_ATTEMPTS && !failed; ++attempt) {
+        printf("raw write %s attempt %d start at %ld%s\n", partition,
+               attempt+1, (long)start, w.direct ? " (direct)" : "");
+
+        pthread_t verifier;
+        if (StartEmmcVerifier(&w, &verifier, start) != 0) {
+            failed = 1;
+            break;
+        }
+
+        size_t pos = start;
+        while (pos < len && !EmmcVerifyFailed(&w)) {
+            size_t to_write = len - pos;
+            if (to_write > EMMC_CHUNK_SIZE) to_write = EMMC_CHUNK_SIZE;
+            if (WriteEmmcChunk(&w, data+pos, pos, to_write) != 0) {
+                failed = 1;
+                break;
+            }
+            pos += to_write;
+        }
+        FinishEmmcVerifier(&w, verifier);
+
+        if (failed || w.v.read_error) {
+            failed = 1;
+        } else if (w.v.mismatch) {
+            start = w.v.verified;
+            sleep(2);
+        } else {
+            printf("verification read succeeded (attempt %d)\n", attempt+1);
+            success = 1;
+            break;
+        }
+    }
+
+    if (!success && !failed) {
+        printf("failed to verify after all attempts\n");
+    }
+    if (CloseEmmcWriter(&w, success) != 0 || !success) {
+        return -1;
+    }
+    return 0;
+}
+
+// A sink that writes patched output straight to an EMMC partition,
+// verifying each chunk as it goes, instead of collecting the whole
+// target in memory first.  Since the data is not kept, a chunk that
+// fails verification cannot be rewritten; the write fails instead.
+typedef struct {
+    EmmcWriter w;
+    pthread_t verifier;
+    char* partition;
+    unsigned char* staging;
+    size_t fill;            // bytes waiting in staging
+    size_t pos;             // partition offset of staging
+    int failed;
+} EmmcStreamInfo;
+
+// Open a stream of 'len' bytes to 'target', a string of the form
+// "EMMC:<partition_device>[:...]".  Return 0 on success.
+static int OpenEmmcStream(EmmcStreamInfo* esi, const char* target,
+                          size_t len) {
+    esi->fill = 0;
+    esi->pos = 0;
+    esi->failed = 0;
+    esi->partition = strdup(target + 5);
+    char* colon = strchr(esi->partition, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+    }
+    esi->staging = malloc(EMMC_CHUNK_SIZE);
+    if (esi->staging == NULL) {
+        printf("failed to allocate buffers for %s\n", esi->partition);
+        free(esi->partition);
+        return -1;
+    }
+    if (OpenEmmcWriter(&esi->w, esi->partition, len) != 0) {
+        free(esi->staging);
+        free(esi->partition);
+        return -1;
+    }
+    printf("streaming write %s%s\n", esi->partition,
+           esi->w.direct ? " (direct)" : "");
+    if (StartEmmcVerifier(&esi->w, &esi->verifier, 0) != 0) {
+        CloseEmmcWriter(&esi->w, 0);
+        free(esi->staging);
+        free(esi->partition);
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t EmmcStreamSink(unsigned char* data, ssize_t len, void* token) {
+    EmmcStreamInfo* esi = (EmmcStreamInfo*)token;
+    if (esi->failed || esi->pos + esi->fill + len > esi->w.v.len) {
+        return -1;
+    }
+    ssize_t done = 0;
+    while (done < len) {
+        size_t n = EMMC_CHUNK_SIZE - esi->fill;
+        if (n > (size_t)(len - done)) n = len - done;
+        memcpy(esi->staging + esi->fill, data + done, n);
+        esi->fill += n;
+        done += n;
+
+        if (esi->fill == EMMC_CHUNK_SIZE) {
+            if (EmmcVerifyFailed(&esi->w) ||
+                WriteEmmcChunk(&esi->w, esi->staging, esi->pos, esi->fill) != 0) {
+                esi->failed = 1;
+                return -1;
+            }
+            esi->pos += esi->fill;
+            esi->fill = 0;
+        }
+    }
+    return len;
+}
+
+// Write out the last partial chunk (unless 'success' is 0), wait for
+// verification to catch up and release the stream.  Return 0 if all
+// of the output reached the partition intact.
+static int CloseEmmcStream(EmmcStreamInfo* esi, int success) {
+    if (success && !esi->failed && esi->fill > 0) {
+        if (WriteEmmcChunk(&esi->w, esi->staging, esi->pos, esi->fill) != 0) {
+            esi->failed = 1;
+        } else {
+            esi->pos += esi->fill;
+            esi->fill = 0;
+        }
+    }
+    FinishEmmcVerifier(&esi->w, esi->verifier);
+    free(esi->staging);
+
+    success = success && !esi->failed && !EmmcVerifyFailed(&esi->w) &&
+              esi->pos == esi->w.v.len;
+    if (success) {
+        printf("verification read succeeded\n");
+    }
+    int closed = CloseEmmcWriter(&esi->w, success);
+    free(esi->partition);
+    if (closed != 0 || !success) {
+        return -1;
+    }
+    return 0;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
 // success.
@@ -421,111 +952,10 @@ int WriteToPartition(unsigned char* data, size_t len,
             break;
 
         case EMMC:
-        {
-            size_t start = 0;
-            int success = 0;
-            int fd = open(partition, O_RDWR);
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
-            }
-            int attempt;
-
-            for (attempt = 0; attempt < 10; ++attempt) {
-                size_t next_sync = start + (1<<20);
-                printf("raw write %s attempt %d start at %d\n", partition, attempt+1, start);
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 4096) to_write = 4096;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
-                    }
-                    start += written;
-                    if (start >= next_sync) {
-                        fsync(fd);
-                        next_sync = start + (1<<20);
-                    }
-                }
-                fsync(fd);
-
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %d: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %d: %d %d %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %d\n", p);
-                        start = p;
-                        break;
-                    }
-                }
-
-                if (start == len) {
-                    printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
-                    break;
-                }
-
-                sleep(2);
-            }
-
-            if (!success) {
-                printf("failed to verify after all attempts\n");
+            if (WriteToEmmc(data, len, partition) != 0) {
                 return -1;
             }
-
-            if (close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
-            }
-            // hack: sync and sleep after closing in hopes of getting
-            // the data actually onto flash.
-            printf("sleeping after close\n");
-            sync();
-            sleep(5);
             break;
-        }
     }
 
     free(copy);
@@ -591,7 +1021,7 @@ int applypatch_check(const char* filename,
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    int filestate = LoadFileContents(filename, &file, RETOUCH_DO_MASK);
+    int filestate = MapFileContents(filename, &file, RETOUCH_DO_MASK);
     if (filestate == -ENOENT) {
         return -ENOENT;
     }
@@ -602,8 +1032,7 @@ int applypatch_check(const char* filename,
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -611,19 +1040,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -734,19 +1163,21 @@ int applypatch(const char* source_filename,
     FileContents copy_file;
     FileContents source_file;
     copy_file.data = NULL;
+    copy_file.map_size = 0;
     source_file.data = NULL;
+    source_file.map_size = 0;
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
-                         RETOUCH_DO_MASK) == 0) {
+    if (MapFileContents(target_filename, &source_file,
+                        RETOUCH_DO_MASK) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
                    target_filename);
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -756,10 +1187,9 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
-                         RETOUCH_DO_MASK);
+        FreeFileContents(&source_file);
+        MapFileContents(source_filename, &source_file,
+                        RETOUCH_DO_MASK);
     }
 
     if (source_file.data != NULL) {
@@ -771,12 +1201,11 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
-                             RETOUCH_DO_MASK) < 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file,
+                            RETOUCH_DO_MASK) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
@@ -791,7 +1220,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -800,12 +1229,28 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
 
+// Replace source_file, just saved to CACHE_TEMP_SOURCE, with a
+// mapping of that copy, so that the original file is no longer in use.
+// Returns 0 on success.
+static int ReloadSourceFromCache(FileContents* source_file) {
+    uint8_t source_sha1[SHA_DIGEST_SIZE];
+    memcpy(source_sha1, source_file->sha1, SHA_DIGEST_SIZE);
+    FreeFileContents(source_file);
+    if (MapFileContents(CACHE_TEMP_SOURCE, source_file,
+                        RETOUCH_DONT_MASK) != 0 ||
+        memcmp(source_file->sha1, source_sha1, SHA_DIGEST_SIZE) != 0) {
+        printf("failed to reload source from %s\n", CACHE_TEMP_SOURCE);
+        return -1;
+    }
+    return 0;
+}
+
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
                           FileContents* copy_file,
@@ -819,6 +1264,8 @@ static int GenerateTarget(FileContents* source_file,
     SHA_CTX ctx;
     int output;
     MemorySinkInfo msi;
+    EmmcStreamInfo esi;
+    int stream = 0;
     FileContents* source_to_use;
     char* outname;
     int made_copy = 0;
@@ -849,17 +1296,31 @@ static int GenerateTarget(FileContents* source_file,
             // space to hold the file.
 
             // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+            // the partition write is interrupted.  (If we're patching
+            // from the copy, it's already there.)
+            if (source_patch_value != NULL) {
+                if (MakeFreeSpaceOnCache(source_file->size) < 0) {
+                    printf("not enough free space on /cache\n");
+                    return 1;
+                }
+                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                    printf("failed to back up source file\n");
+                    return 1;
+                }
             }
             made_copy = 1;
             retry = 0;
+
+            // Large EMMC targets are written to the partition as they
+            // are generated rather than collected in memory first.  The
+            // source may be the partition being overwritten, so patch
+            // from the copy on /cache instead.
+            stream = strncmp(target_filename, "EMMC:", 5) == 0 &&
+                     target_size >= EMMC_STREAM_THRESHOLD;
+            if (stream && source_patch_value != NULL &&
+                ReloadSourceFromCache(source_file) != 0) {
+                return 1;
+            }
         } else {
             int enough_space = 0;
             if (retry > 0) {
@@ -900,6 +1361,11 @@ static int GenerateTarget(FileContents* source_file,
                     return 1;
                 }
                 made_copy = 1;
+                // source_file may be a mapping of source_filename, which
+                // would keep its blocks allocated after the unlink.
+                if (ReloadSourceFromCache(source_file) != 0) {
+                    return 1;
+                }
                 unlink(source_filename);
 
                 size_t free_space = FreeSpaceForFile(target_fs);
@@ -925,8 +1391,14 @@ static int GenerateTarget(FileContents* source_file,
         void* token = NULL;
         output = -1;
         outname = NULL;
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0) {
+        if (stream) {
+            if (OpenEmmcStream(&esi, target_filename, target_size) != 0) {
+                return 1;
+            }
+            sink = EmmcStreamSink;
+            token = &esi;
+        } else if (strncmp(target_filename, "MTD:", 4) == 0 ||
+                   strncmp(target_filename, "EMMC:", 5) == 0) {
             // We store the decoded output in memory.
             msi.buffer = malloc(target_size);
             if (msi.buffer == NULL) {
@@ -971,6 +1443,9 @@ static int GenerateTarget(FileContents* source_file,
                                      patch, sink, token, &ctx, bonus_data);
         } else {
             printf("Unknown patch file format\n");
+            if (stream) {
+                CloseEmmcStream(&esi, 0);
+            }
             return 1;
         }
 
@@ -978,6 +1453,11 @@ static int GenerateTarget(FileContents* source_file,
             fsync(output);
             close(output);
         }
+        if (stream && CloseEmmcStream(&esi, result == 0) != 0 && result == 0) {
+            printf("streaming write of patched data to %s failed\n",
+                   target_filename);
+            result = 1;
+        }
 
         if (result != 0) {
             if (retry == 0) {
@@ -1001,7 +1481,10 @@ static int GenerateTarget(FileContents* source_file,
         return 1;
     }
 
-    if (output < 0) {
+    if (stream) {
+        // Already written and verified against the per-chunk digests;
+        // the SHA-1 check above covers the target as a whole.
+    } else if (output < 0) {
         // Copy the temp file to the partition.
         if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
             printf("write of patched data to %s failed\n", target_filename);
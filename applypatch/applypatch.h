@@ -32,6 +32,9 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  // nonzero if data is a private mapping of this many bytes rather
+  // than malloc()ed; see MapFileContents().
+  size_t map_size;
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -63,6 +66,8 @@ int applypatch_check(const char* filename,
 
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag);
 int SaveFileContents(const char* filename, const FileContents* file);
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
@@ -50,6 +50,7 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -57,105 +58,6 @@
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
-static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
-{
-	off_t i,j,k,x,tmp,jj,kk;
-
-	if(len<16) {
-		for(k=start;k<start+len;k+=j) {
-			j=1;x=V[I[k]+h];
-			for(i=1;k+i<start+len;i++) {
-				if(V[I[k+i]+h]<x) {
-					x=V[I[k+i]+h];
-					j=0;
-				};
-				if(V[I[k+i]+h]==x) {
-					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
-					j++;
-				};
-			};
-			for(i=0;i<j;i++) V[I[k+i]]=k+j-1;
-			if(j==1) I[k]=-1;
-		};
-		return;
-	};
-
-	x=V[I[start+len/2]+h];
-	jj=0;kk=0;
-	for(i=start;i<start+len;i++) {
-		if(V[I[i]+h]<x) jj++;
-		if(V[I[i]+h]==x) kk++;
-	};
-	jj+=start;kk+=jj;
-
-	i=start;j=0;k=0;
-	while(i<jj) {
-		if(V[I[i]+h]<x) {
-			i++;
-		} else if(V[I[i]+h]==x) {
-			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
-			j++;
-		} else {
-			tmp=I[i];I[i]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
-	};
-
-	while(jj+j<kk) {
-		if(V[I[jj+j]+h]==x) {
-			j++;
-		} else {
-			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
-	};
-
-	if(jj>start) split(I,V,start,jj-start,h);
-
-	for(i=0;i<kk-jj;i++) V[I[jj+i]]=kk-1;
-	if(jj==kk-1) I[jj]=-1;
-
-	if(start+len>kk) split(I,V,kk,start+len-kk,h);
-}
-
-static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
-{
-	off_t buckets[256];
-	off_t i,h,len;
-
-	for(i=0;i<256;i++) buckets[i]=0;
-	for(i=0;i<oldsize;i++) buckets[old[i]]++;
-	for(i=1;i<256;i++) buckets[i]+=buckets[i-1];
-	for(i=255;i>0;i--) buckets[i]=buckets[i-1];
-	buckets[0]=0;
-
-	for(i=0;i<oldsize;i++) I[++buckets[old[i]]]=i;
-	I[0]=oldsize;
-	for(i=0;i<oldsize;i++) V[i]=buckets[old[i]];
-	V[oldsize]=0;
-	for(i=1;i<256;i++) if(buckets[i]==buckets[i-1]+1) I[buckets[i]]=-1;
-	I[0]=-1;
-
-	for(h=1;I[0]!=-(oldsize+1);h+=h) {
-		len=0;
-		for(i=0;i<oldsize+1;) {
-			if(I[i]<0) {
-				len-=I[i];
-				i-=I[i];
-			} else {
-				if(len) I[i-len]=-len;
-				len=V[I[i]]+1-i;
-				split(I,V,i,len,h);
-				i+=len;
-				len=0;
-			};
-		};
-		if(len) I[i-len]=-len;
-	};
-
-	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
-}
-
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,30 +68,94 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
-		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
+#define SAIS_TYPE_S(t, i) (((t)[(i) >> 3] >> ((i) & 7)) & 1)
+#define SAIS_SET_S(t, i) ((t)[(i) >> 3] |= 1 << ((i) & 7))
+#define SAIS_IS_LMS(t, i) ((i) > 0 && SAIS_TYPE_S(t, i) && !SAIS_TYPE_S(t, (i)-1))
+
+// Suffix arrays of inputs under 2 GB use 32-bit indices, half the
+// memory of 64-bit ones.
+#define SAIDX int32_t
+#define SAIS(x) x##32
+#include "sais.h"
+#undef SAIDX
+#undef SAIS
+
+#define SAIDX int64_t
+#define SAIS(x) x##64
+#include "sais.h"
+#undef SAIDX
+#undef SAIS
+
+static int use_sais32(off_t oldsize)
 {
-	off_t x,y;
+	return oldsize < INT32_MAX;
+}
+
+void* bsdiff_suffix_array(u_char* old, off_t oldsize)
+{
+	if (use_sais32(oldsize))
+		return suffix_array32(old, oldsize);
+	else
+		return suffix_array64(old, oldsize);
+}
 
-	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+// A growable in-memory patch file.
+typedef struct {
+	u_char* data;
+	off_t len;
+	off_t cap;
+} patchbuf;
+
+// Compress len bytes of data into pb.  With action BZ_FINISH, also
+// flush the stream.
+static void bz2_write(bz_stream* strm, patchbuf* pb, u_char* data, off_t len,
+		int action)
+{
+	int act, r;
+
+	for (;;) {
+		if (strm->avail_in == 0 && len > 0) {
+			unsigned int n = MIN(len, 1 << 30);
+			strm->next_in = (char*)data;
+			strm->avail_in = n;
+			data += n;
+			len -= n;
+		}
+		act = (len == 0 && action == BZ_FINISH) ? BZ_FINISH : BZ_RUN;
 
-		if(x>y) {
-			*pos=I[st];
-			return x;
+		if (pb->cap - pb->len < 65536) {
+			pb->cap = pb->cap * 2 + 65536;
+			if ((pb->data = realloc(pb->data, pb->cap)) == NULL)
+				err(1, NULL);
+		}
+		strm->next_out = (char*)pb->data + pb->len;
+		strm->avail_out = MIN(pb->cap - pb->len, 1 << 30);
+		r = BZ2_bzCompress(strm, act);
+		pb->len = (u_char*)strm->next_out - pb->data;
+
+		if (act == BZ_FINISH) {
+			if (r == BZ_STREAM_END) break;
+			if (r != BZ_FINISH_OK)
+				errx(1, "BZ2_bzCompress, bz2err = %d", r);
 		} else {
-			*pos=I[en];
-			return y;
+			if (r != BZ_RUN_OK)
+				errx(1, "BZ2_bzCompress, bz2err = %d", r);
+			if (strm->avail_in == 0 && len == 0) break;
 		}
-	};
+	}
+}
 
-	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
-	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
-	};
+// Compress a whole block into pb as a separate bzip2 stream.
+static void bz2_block(patchbuf* pb, u_char* data, off_t len)
+{
+	bz_stream strm;
+	int r;
+
+	memset(&strm, 0, sizeof(strm));
+	if ((r = BZ2_bzCompressInit(&strm, 9, 0, 0)) != BZ_OK)
+		errx(1, "BZ2_bzCompressInit, bz2err = %d", r);
+	bz2_write(&strm, pb, data, len, BZ_FINISH);
+	BZ2_bzCompressEnd(&strm);
 }
 
 static void offtout(off_t x,u_char *buf)
@@ -216,16 +182,22 @@ static void offtout(off_t x,u_char *buf)
 //      data from files.  old and new are owned by the caller; we
 //      don't free them at the end.
 //
+//    - the patch is returned in a malloc()ed buffer, *patch, of
+//      *patch_size bytes, rather than written to a file.
+//
 //    - the "I" block of memory is owned by the caller, who passes a
 //      pointer to *I, which can be NULL.  This way if we call
-//      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//      bsdiff() multiple times with the same 'old' data, we only
+//      build the suffix array the first time.
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
+//    - the suffix array is built with SA-IS rather than qsufsort(),
+//      and holds 32-bit indices when 'old' is under 2 GB, so the
+//      caller must treat *I as opaque.
+//
+int bsdiff(u_char* old, off_t oldsize, void** IP, u_char* new, off_t newsize,
+           u_char** patch, off_t* patch_size)
 {
-	int fd;
-	off_t *I;
+	void *I;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -236,16 +208,12 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	u_char *db,*eb;
 	u_char buf[8];
 	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
+	patchbuf pb;
+	bz_stream strm;
 	int bz2err;
 
         if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+            *IP = bsdiff_suffix_array(old, oldsize);
         }
         I = *IP;
 
@@ -254,9 +222,10 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	dblen=0;
 	eblen=0;
 
-	/* Create the patch file */
-	if ((pf = fopen(patch_filename, "w")) == NULL)
-              err(1, "%s", patch_filename);
+	/* Create the patch buffer */
+	pb.data = NULL;
+	pb.len = 0;
+	pb.cap = 0;
 
 	/* Header is
 		0	8	 "BSDIFF40"
@@ -272,20 +241,26 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	offtout(0, header + 8);
 	offtout(0, header + 16);
 	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
+	if ((pb.data = malloc(65536)) == NULL) err(1, NULL);
+	pb.cap = 65536;
+	pb.len = 32;
 
 	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+	memset(&strm, 0, sizeof(strm));
+	if ((bz2err = BZ2_bzCompressInit(&strm, 9, 0, 0)) != BZ_OK)
+		errx(1, "BZ2_bzCompressInit, bz2err = %d", bz2err);
 	scan=0;len=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
 		oldscore=0;
 
 		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,new+scan,newsize-scan,
-					0,oldsize,&pos);
+			if (use_sais32(oldsize))
+				len=search32(I,old,oldsize,new+scan,newsize-scan,
+						0,oldsize,&pos);
+			else
+				len=search64(I,old,oldsize,new+scan,newsize-scan,
+						0,oldsize,&pos);
 
 			for(;scsc<scan+len;scsc++)
 			if((scsc+lastoffset<oldsize) &&
@@ -341,66 +316,39 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
 			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			bz2_write(&strm, &pb, buf, 8, BZ_RUN);
 
 			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			bz2_write(&strm, &pb, buf, 8, BZ_RUN);
 
 			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			bz2_write(&strm, &pb, buf, 8, BZ_RUN);
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
 			lastoffset=pos-scan;
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	bz2_write(&strm, &pb, NULL, 0, BZ_FINISH);
+	BZ2_bzCompressEnd(&strm);
 
 	/* Compute size of compressed ctrl data */
-	if ((len = ftello(pf)) == -1)
-		err(1, "ftello");
+	len = pb.len;
 	offtout(len-32, header + 8);
 
 	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	bz2_block(&pb, db, dblen);
 
 	/* Compute size of compressed diff data */
-	if ((newsize = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
+	offtout(pb.len - len, header + 16);
 
 	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseeko(pf, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
-	if (fclose(pf))
-		err(1, "fclose");
+	bz2_block(&pb, eb, eblen);
+
+	/* Fill in the header */
+	memcpy(pb.data, header, 32);
+	*patch = pb.data;
+	*patch_size = pb.len;
 
 	/* Free the memory we used */
 	free(db);
@@ -21,6 +21,7 @@
 // notice.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -97,32 +98,19 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
-
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
-    }
-
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
-    }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
-    }
-    free(new_data);
-
-    return 0;
-}
-
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+// Patched output is produced in windows of at most this many bytes, so
+// streaming a target to a sink needs no more memory than this no
+// matter how large the target is.
+#define BSDIFF_WINDOW_SIZE (1 << 20)
+
+// Apply a bsdiff patch, producing the new data in 'window'.  Whenever
+// the window fills up it is passed to 'sink' (and added to 'ctx', if
+// not NULL) and reused.  With a NULL sink the window must be large
+// enough to hold the whole output.
+static int ApplyBSDiff(const unsigned char* old_data, ssize_t old_size,
+                       const Value* patch, ssize_t patch_offset,
+                       unsigned char* window, ssize_t window_size,
+                       SinkFn sink, void* token, SHA_CTX* ctx) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -136,20 +124,9 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // extra block; seek forwards in oldfile by z bytes".
 
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
-        printf("corrupt bsdiff patch file header (magic number)\n");
-        return 1;
-    }
-
-    ssize_t ctrl_len, data_len;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
-    *new_size = offtin(header+24);
-
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
-        printf("corrupt patch file header (data lengths)\n");
-        return 1;
-    }
+    ssize_t ctrl_len = offtin(header+8);
+    ssize_t data_len = offtin(header+16);
+    ssize_t new_size = offtin(header+24);
 
     int bzerr;
 
@@ -183,70 +160,154 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         printf("failed to bzinit extra stream (%d)\n", bzerr);
     }
 
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
-        return 1;
-    }
-
+    int result = 1;
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
+    ssize_t fill = 0;           // bytes of output waiting in the window
+    ssize_t i;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
         if (FillBuffer(buf, 24, &cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
         ctrl[2] = offtin(buf+16);
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            newpos + ctrl[0] + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
-        }
-
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Read the diff string, then the extra string, a window at a
+        // time.
+        off_t left = ctrl[0] + ctrl[1];
+        while (left > 0) {
+            if (fill == window_size) {
+                if (sink == NULL || sink(window, fill, token) < fill) {
+                    printf("short write of output: %d (%s)\n", errno, strerror(errno));
+                    goto done;
+                }
+                if (ctx) {
+                    SHA_update(ctx, window, fill);
+                }
+                fill = 0;
             }
-        }
-
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
 
-        // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
-            printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
-
-        // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+            ssize_t n = window_size - fill;
+            if (left > ctrl[1]) {
+                if (n > left - ctrl[1]) n = left - ctrl[1];
+                if (FillBuffer(window + fill, n, &dstream) != 0) {
+                    printf("error while reading diff stream\n");
+                    goto done;
+                }
+                // Add old data to diff string
+                for (i = 0; i < n; ++i) {
+                    if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
+                        window[fill+i] += old_data[oldpos+i];
+                    }
+                }
+                oldpos += n;
+            } else {
+                if (n > left) n = left;
+                if (FillBuffer(window + fill, n, &estream) != 0) {
+                    printf("error while reading extra stream\n");
+                    goto done;
+                }
+            }
+            fill += n;
+            newpos += n;
+            left -= n;
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
 
+    if (sink != NULL && sink(window, fill, token) < fill) {
+        printf("short write of output: %d (%s)\n", errno, strerror(errno));
+        goto done;
+    }
+    if (ctx) {
+        SHA_update(ctx, window, fill);
+    }
+    result = 0;
+
+  done:
     BZ2_bzDecompressEnd(&cstream);
     BZ2_bzDecompressEnd(&dstream);
     BZ2_bzDecompressEnd(&estream);
+    return result;
+}
+
+// Check the bsdiff header and return the size of the patched output.
+static ssize_t BSDiffNewSize(const Value* patch, ssize_t patch_offset) {
+    unsigned char* header = (unsigned char*) patch->data + patch_offset;
+    if (patch_offset + 32 > patch->size || memcmp(header, "BSDIFF40", 8) != 0) {
+        printf("corrupt bsdiff patch file header (magic number)\n");
+        return -1;
+    }
+
+    ssize_t ctrl_len = offtin(header+8);
+    ssize_t data_len = offtin(header+16);
+    ssize_t new_size = offtin(header+24);
+
+    if (ctrl_len < 0 || data_len < 0 || new_size < 0 ||
+        patch_offset + 32 + ctrl_len + data_len > patch->size) {
+        printf("corrupt patch file header (data lengths)\n");
+        return -1;
+    }
+    return new_size;
+}
+
+// Apply a bsdiff patch and pass the output to 'sink' as it is produced,
+// holding at most BSDIFF_WINDOW_SIZE bytes of it in memory.
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    ssize_t new_size = BSDiffNewSize(patch, patch_offset);
+    if (new_size < 0) {
+        return 1;
+    }
+
+    ssize_t window_size = new_size < BSDIFF_WINDOW_SIZE ? new_size : BSDIFF_WINDOW_SIZE;
+    unsigned char* window = malloc(window_size > 0 ? window_size : 1);
+    if (window == NULL) {
+        printf("failed to allocate %ld bytes of memory for output window\n",
+               (long)window_size);
+        return 1;
+    }
+
+    int result = ApplyBSDiff(old_data, old_size, patch, patch_offset,
+                             window, window_size, sink, token, ctx);
+    free(window);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    *new_size = BSDiffNewSize(patch, patch_offset);
+    if (*new_size < 0) {
+        return 1;
+    }
+
+    *new_data = malloc(*new_size > 0 ? *new_size : 1);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+
+    if (ApplyBSDiff(old_data, old_size, patch, patch_offset,
+                    *new_data, *new_size, NULL, NULL, NULL) != 0) {
+        free(*new_data);
+        *new_data = NULL;
+        return 1;
+    }
     return 0;
 }
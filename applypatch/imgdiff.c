@@ -119,9 +119,17 @@
  * patch.  This is used to reduce the size of recovery-from-boot
  * patches by combining the boot image with recovery ramdisk
  * information that is stored on the system partition.
+ *
+ * It can also take a cache file (-c) recording which zlib parameters
+ * reproduce each deflate chunk, so that repeated runs over similar
+ * builds don't have to recompress every chunk to find them again.
+ * Entries are keyed by the SHA-1 of the uncompressed data and the
+ * compressed length; the SHA-1 of the compressed data is stored too,
+ * and must match before an entry is trusted.
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -129,6 +137,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 
+#include "mincrypt/sha.h"
 #include "zlib.h"
 #include "imgdiff.h"
 #include "utils.h"
@@ -143,7 +152,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  void* I;              // used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -179,8 +188,9 @@ static int fileentry_compare(const void* a, const void* b) {
 }
 
 // from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
+void* bsdiff_suffix_array(u_char* old, off_t oldsize);
+int bsdiff(u_char* old, off_t oldsize, void** IP, u_char* new, off_t newsize,
+           u_char** patch, off_t* patch_size);
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -565,6 +575,202 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
   return 0;
 }
 
+/*
+ * The encoder parameter sets we know how to reproduce.  'wins' counts
+ * the chunks of the current archive each one has reconstructed; the
+ * most successful set is tried first.
+ */
+typedef struct {
+  int level, method, windowBits, memLevel, strategy;
+  int wins;
+} DeflateParams;
+
+static DeflateParams deflate_params[] = {
+  // level 6 (the default) and level 9 (the maximum), with a 32kb
+  // window (negative to indicate a raw stream) and the default memLevel.
+  { 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY, 0 },
+  { 9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY, 0 },
+};
+#define NUM_DEFLATE_PARAMS (sizeof(deflate_params) / sizeof(deflate_params[0]))
+
+typedef struct DeflateCacheEntry {
+  uint8_t sha1[SHA_DIGEST_SIZE];          // of the uncompressed data
+  size_t deflate_len;
+  uint8_t deflate_sha1[SHA_DIGEST_SIZE];  // of the compressed data
+  int level;                              // -1 if nothing reproduces it
+  int method, windowBits, memLevel, strategy;
+  struct DeflateCacheEntry* next;
+} DeflateCacheEntry;
+
+#define DEFLATE_CACHE_BUCKETS 4096
+
+static DeflateCacheEntry* deflate_cache[DEFLATE_CACHE_BUCKETS];
+static int deflate_cache_dirty = 0;
+
+typedef struct {
+  int cached;     // chunks whose parameters came from the cache
+  int searched;   // chunks we had to recompress to find them
+  int attempts;   // recompressions done for those
+  int failed;     // chunks nothing reproduces
+} DeflateStats;
+
+static DeflateStats deflate_stats;
+
+static DeflateCacheEntry** DeflateCacheBucket(const uint8_t* sha1) {
+  return deflate_cache + (((sha1[0] << 8) | sha1[1]) % DEFLATE_CACHE_BUCKETS);
+}
+
+static DeflateCacheEntry* FindDeflateCacheEntry(const uint8_t* sha1,
+                                                size_t deflate_len) {
+  DeflateCacheEntry* e;
+  for (e = *DeflateCacheBucket(sha1); e != NULL; e = e->next) {
+    if (e->deflate_len == deflate_len &&
+        memcmp(e->sha1, sha1, SHA_DIGEST_SIZE) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static DeflateCacheEntry* AddDeflateCacheEntry(const uint8_t* sha1,
+                                               size_t deflate_len) {
+  DeflateCacheEntry* e = FindDeflateCacheEntry(sha1, deflate_len);
+  if (e == NULL) {
+    e = calloc(1, sizeof(DeflateCacheEntry));
+    memcpy(e->sha1, sha1, SHA_DIGEST_SIZE);
+    e->deflate_len = deflate_len;
+    DeflateCacheEntry** bucket = DeflateCacheBucket(sha1);
+    e->next = *bucket;
+    *bucket = e;
+  }
+  return e;
+}
+
+static void PrintHex(FILE* f, const uint8_t* data, int len) {
+  int i;
+  for (i = 0; i < len; ++i) {
+    fprintf(f, "%02x", data[i]);
+  }
+}
+
+static int ParseHex(const char* str, uint8_t* data, int len) {
+  int i;
+  for (i = 0; i < len; ++i) {
+    unsigned int b;
+    if (sscanf(str + i*2, "%2x", &b) != 1) return -1;
+    data[i] = b;
+  }
+  return str[len*2] == '\0' ? 0 : -1;
+}
+
+/*
+ * Read the cache file, one entry per line:
+ *
+ *   <sha1> <deflate len> <deflate sha1> <level> <method> <windowBits> <memLevel> <strategy>
+ *
+ * A missing file is an empty cache.  Returns 0 on success.
+ */
+int LoadDeflateCache(const char* filename) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) {
+    if (errno == ENOENT) return 0;
+    printf("failed to open cache file %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+
+  char sha1_str[SHA_DIGEST_SIZE*2+1];
+  char deflate_sha1_str[SHA_DIGEST_SIZE*2+1];
+  unsigned long deflate_len;
+  int level, method, windowBits, memLevel, strategy;
+  int count = 0;
+  int r;
+  while ((r = fscanf(f, "%40s %lu %40s %d %d %d %d %d",
+                     sha1_str, &deflate_len, deflate_sha1_str,
+                     &level, &method, &windowBits, &memLevel,
+                     &strategy)) == 8) {
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    uint8_t deflate_sha1[SHA_DIGEST_SIZE];
+    if (ParseHex(sha1_str, sha1, SHA_DIGEST_SIZE) != 0 ||
+        ParseHex(deflate_sha1_str, deflate_sha1, SHA_DIGEST_SIZE) != 0) {
+      break;
+    }
+    DeflateCacheEntry* e = AddDeflateCacheEntry(sha1, deflate_len);
+    memcpy(e->deflate_sha1, deflate_sha1, SHA_DIGEST_SIZE);
+    e->level = level;
+    e->method = method;
+    e->windowBits = windowBits;
+    e->memLevel = memLevel;
+    e->strategy = strategy;
+    ++count;
+  }
+  if (r != EOF) {
+    printf("cache file %s is corrupt after %d entries; ignoring the rest\n",
+           filename, count);
+  }
+  fclose(f);
+  printf("loaded %d deflate parameter entries from %s\n", count, filename);
+  return 0;
+}
+
+/*
+ * Write the cache back out, if anything was added to it.  The new file
+ * is renamed into place so an interrupted run can't truncate it.
+ * Returns 0 on success.
+ */
+int SaveDeflateCache(const char* filename) {
+  if (!deflate_cache_dirty) return 0;
+
+  size_t len = strlen(filename);
+  char* temp = malloc(len + 5);
+  strcpy(temp, filename);
+  strcpy(temp + len, ".tmp");
+
+  FILE* f = fopen(temp, "w");
+  if (f == NULL) {
+    printf("failed to open %s: %s\n", temp, strerror(errno));
+    free(temp);
+    return -1;
+  }
+  int i;
+  for (i = 0; i < DEFLATE_CACHE_BUCKETS; ++i) {
+    DeflateCacheEntry* e;
+    for (e = deflate_cache[i]; e != NULL; e = e->next) {
+      PrintHex(f, e->sha1, SHA_DIGEST_SIZE);
+      fprintf(f, " %lu ", (unsigned long)e->deflate_len);
+      PrintHex(f, e->deflate_sha1, SHA_DIGEST_SIZE);
+      fprintf(f, " %d %d %d %d %d\n", e->level, e->method,
+              e->windowBits, e->memLevel, e->strategy);
+    }
+  }
+  if (fclose(f) != 0 || rename(temp, filename) != 0) {
+    printf("failed to write cache file %s: %s\n", filename, strerror(errno));
+    unlink(temp);
+    free(temp);
+    return -1;
+  }
+  free(temp);
+  deflate_cache_dirty = 0;
+  return 0;
+}
+
+/*
+ * Print how the deflate chunks of an archive were reconstructed, and
+ * reset the counts for the next one.
+ */
+void DumpDeflateStats(const char* name) {
+  int i;
+  printf("%s: %d deflate chunks from cache, %d searched (%d attempts), "
+         "%d not reconstructible\n", name, deflate_stats.cached,
+         deflate_stats.searched, deflate_stats.attempts,
+         deflate_stats.failed);
+  for (i = 0; i < NUM_DEFLATE_PARAMS; ++i) {
+    printf("  level %d: %d chunks\n",
+           deflate_params[i].level, deflate_params[i].wins);
+    deflate_params[i].wins = 0;
+  }
+  memset(&deflate_stats, 0, sizeof(deflate_stats));
+}
+
 /*
  * Verify that we can reproduce exactly the same compressed data that
  * we started with.  Sets the level, method, windowBits, memLevel, and
@@ -577,32 +783,117 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
     return -1;
   }
 
-  size_t p = 0;
-  unsigned char* out = malloc(BUFFER_SIZE);
+  uint8_t sha1[SHA_DIGEST_SIZE];
+  uint8_t deflate_sha1[SHA_DIGEST_SIZE];
+  int i, j;
+  SHA_hash(chunk->data, chunk->len, sha1);
+  SHA_hash(chunk->deflate_data, chunk->deflate_len, deflate_sha1);
+
+  DeflateCacheEntry* e = FindDeflateCacheEntry(sha1, chunk->deflate_len);
+  if (e != NULL &&
+      memcmp(e->deflate_sha1, deflate_sha1, SHA_DIGEST_SIZE) == 0) {
+    ++deflate_stats.cached;
+    if (e->level < 0) {
+      ++deflate_stats.failed;
+      return -1;
+    }
+    chunk->level = e->level;
+    chunk->method = e->method;
+    chunk->windowBits = e->windowBits;
+    chunk->memLevel = e->memLevel;
+    chunk->strategy = e->strategy;
+    for (i = 0; i < NUM_DEFLATE_PARAMS; ++i) {
+      DeflateParams* dp = deflate_params+i;
+      if (dp->level == e->level && dp->method == e->method &&
+          dp->windowBits == e->windowBits && dp->memLevel == e->memLevel &&
+          dp->strategy == e->strategy) {
+        ++dp->wins;
+      }
+    }
+    return 0;
+  }
+
+  // Try the parameter sets in order of how many chunks of this archive
+  // they have reproduced so far.
+  DeflateParams* order[NUM_DEFLATE_PARAMS];
+  for (i = 0; i < NUM_DEFLATE_PARAMS; ++i) {
+    DeflateParams* dp = deflate_params+i;
+    for (j = i; j > 0 && order[j-1]->wins < dp->wins; --j) {
+      order[j] = order[j-1];
+    }
+    order[j] = dp;
+  }
 
-  // We only check two combinations of encoder parameters:  level 6
-  // (the default) and level 9 (the maximum).
-  for (chunk->level = 6; chunk->level <= 9; chunk->level += 3) {
-    chunk->windowBits = -15;  // 32kb window; negative to indicate a raw stream.
-    chunk->memLevel = 8;      // the default value.
-    chunk->method = Z_DEFLATED;
-    chunk->strategy = Z_DEFAULT_STRATEGY;
+  ++deflate_stats.searched;
+  e = AddDeflateCacheEntry(sha1, chunk->deflate_len);
+  memcpy(e->deflate_sha1, deflate_sha1, SHA_DIGEST_SIZE);
+  e->level = -1;
+  deflate_cache_dirty = 1;
 
+  unsigned char* out = malloc(BUFFER_SIZE);
+  for (i = 0; i < NUM_DEFLATE_PARAMS; ++i) {
+    chunk->level = order[i]->level;
+    chunk->method = order[i]->method;
+    chunk->windowBits = order[i]->windowBits;
+    chunk->memLevel = order[i]->memLevel;
+    chunk->strategy = order[i]->strategy;
+
+    ++deflate_stats.attempts;
     if (TryReconstruction(chunk, out) == 0) {
+      ++order[i]->wins;
+      e->level = chunk->level;
+      e->method = chunk->method;
+      e->windowBits = chunk->windowBits;
+      e->memLevel = chunk->memLevel;
+      e->strategy = chunk->strategy;
       free(out);
       return 0;
     }
   }
 
+  ++deflate_stats.failed;
   free(out);
   return -1;
 }
 
 /*
- * Given source and target chunks, compute a bsdiff patch between them
- * by running bsdiff in a subprocess.  Return the patch data, placing
- * its length in *size.  Return NULL on failure.  We expect the bsdiff
- * program to be in the path.
+ * Several target chunks may be diffed against the same source chunk
+ * (in zip mode, every chunk without a matching entry uses the whole
+ * source file).  The first thread to need a chunk's suffix array
+ * builds it, leaving src->I pointing at suffix_array_pending meanwhile;
+ * others wait for it rather than building their own copy.
+ */
+static pthread_mutex_t suffix_array_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t suffix_array_cond = PTHREAD_COND_INITIALIZER;
+static char suffix_array_pending;
+
+static void* GetSuffixArray(ImageChunk* src) {
+  void* I;
+
+  pthread_mutex_lock(&suffix_array_lock);
+  while (src->I == &suffix_array_pending) {
+    pthread_cond_wait(&suffix_array_cond, &suffix_array_lock);
+  }
+  if (src->I == NULL) {
+    src->I = &suffix_array_pending;
+    pthread_mutex_unlock(&suffix_array_lock);
+
+    I = bsdiff_suffix_array(src->data, src->len);
+
+    pthread_mutex_lock(&suffix_array_lock);
+    src->I = I;
+    pthread_cond_broadcast(&suffix_array_cond);
+  }
+  I = src->I;
+  pthread_mutex_unlock(&suffix_array_lock);
+  return I;
+}
+
+/*
+ * Given source and target chunks, compute a bsdiff patch between them.
+ * Return the patch data, placing its length in *size.  Return NULL on
+ * failure.  May be called from several threads at once, as long as
+ * each call has a different tgt.
  */
 unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   if (tgt->type == CHUNK_NORMAL) {
@@ -613,46 +904,25 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
     }
   }
 
-  char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-  mkstemp(ptemp);
-
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
+  void* I = GetSuffixArray(src);
+  unsigned char* data;
+  off_t data_size;
+  int r = bsdiff(src->data, src->len, &I, tgt->data, tgt->len,
+                 &data, &data_size);
   if (r != 0) {
     printf("bsdiff() failed: %d\n", r);
     return NULL;
   }
 
-  struct stat st;
-  if (stat(ptemp, &st) != 0) {
-    printf("failed to stat patch file %s: %s\n",
-            ptemp, strerror(errno));
-    return NULL;
-  }
-
-  unsigned char* data = malloc(st.st_size);
-
-  if (tgt->type == CHUNK_NORMAL && tgt->len <= st.st_size) {
-    unlink(ptemp);
+  if (tgt->type == CHUNK_NORMAL && tgt->len <= data_size) {
+    free(data);
 
     tgt->type = CHUNK_RAW;
     *size = tgt->len;
     return tgt->data;
   }
 
-  *size = st.st_size;
-
-  FILE* f = fopen(ptemp, "rb");
-  if (f == NULL) {
-    printf("failed to open patch %s: %s\n", ptemp, strerror(errno));
-    return NULL;
-  }
-  if (fread(data, 1, st.st_size, f) != st.st_size) {
-    printf("failed to read patch %s: %s\n", ptemp, strerror(errno));
-    return NULL;
-  }
-  fclose(f);
-
-  unlink(ptemp);
+  *size = data_size;
 
   tgt->source_start = src->start;
   switch (tgt->type) {
@@ -668,6 +938,91 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+/*
+ * The chunks are diffed by a pool of worker threads, each taking the
+ * next job from a shared list.  The list is sorted largest target
+ * first, so that one big chunk picked up last doesn't leave the other
+ * threads idle.
+ */
+typedef struct {
+  ImageChunk* src;
+  ImageChunk* tgt;
+  unsigned char* patch;
+  size_t size;
+} PatchJob;
+
+typedef struct {
+  PatchJob** jobs;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} PatchQueue;
+
+static int patchjob_compare(const void* a, const void* b) {
+  size_t al = (*(PatchJob**)a)->tgt->len;
+  size_t bl = (*(PatchJob**)b)->tgt->len;
+  if (al > bl) {
+    return -1;
+  } else if (al < bl) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+static void* PatchWorker(void* cookie) {
+  PatchQueue* q = (PatchQueue*)cookie;
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    PatchJob* job = q->next < q->count ? q->jobs[q->next++] : NULL;
+    pthread_mutex_unlock(&q->lock);
+    if (job == NULL) break;
+
+    job->patch = MakePatch(job->src, job->tgt, &job->size);
+  }
+  return NULL;
+}
+
+/*
+ * Run all the jobs, on as many threads as there are CPUs online.
+ */
+static void MakePatches(PatchJob* jobs, int count) {
+  PatchQueue q;
+  int i;
+
+  q.jobs = malloc(count * sizeof(PatchJob*));
+  for (i = 0; i < count; ++i) {
+    q.jobs[i] = jobs+i;
+  }
+  qsort(q.jobs, count, sizeof(PatchJob*), patchjob_compare);
+  q.count = count;
+  q.next = 0;
+  pthread_mutex_init(&q.lock, NULL);
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads > count) num_threads = count;
+  if (num_threads < 1) num_threads = 1;
+
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  int started = 0;
+  for (i = 0; i < num_threads; ++i) {
+    if (pthread_create(threads+started, NULL, PatchWorker, &q) == 0) {
+      ++started;
+    }
+  }
+  // With no threads at all, do the work here.
+  if (started == 0) {
+    PatchWorker(&q);
+  }
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  pthread_mutex_destroy(&q.lock);
+  free(q.jobs);
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -813,9 +1168,21 @@ int main(int argc, char** argv) {
     argv += 2;
   }
 
+  const char* cache_file = NULL;
+  if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+    cache_file = argv[2];
+    if (LoadDeflateCache(cache_file) != 0) {
+      return 1;
+    }
+
+    argc -= 2;
+    argv += 2;
+  }
+
   if (argc != 4) {
     usage:
-    printf("usage: %s [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
+    printf("usage: %s [-z] [-b <bonus-file>] [-c <cache-file>] "
+           "<src-img> <tgt-img> <patch-file>\n",
             argv[0]);
     return 2;
   }
@@ -878,31 +1245,6 @@ int main(int argc, char** argv) {
 
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (tgt_chunks[i].type == CHUNK_DEFLATE) {
-      // Confirm that given the uncompressed chunk data in the target, we
-      // can recompress it and get exactly the same bits as are in the
-      // input target image.  If this fails, treat the chunk as a normal
-      // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
-        printf("failed to reconstruct target deflate chunk %d [%s]; "
-               "treating as normal\n", i, tgt_chunks[i].filename);
-        ChangeDeflateChunkToNormal(tgt_chunks+i);
-        if (zip_mode) {
-          ImageChunk* src = FindChunkByName(tgt_chunks[i].filename, src_chunks, num_src_chunks);
-          if (src) {
-            ChangeDeflateChunkToNormal(src);
-          }
-        } else {
-          ChangeDeflateChunkToNormal(src_chunks+i);
-        }
-        continue;
-      }
-
-      // If two deflate chunks are identical (eg, the kernel has not
-      // changed between two builds), treat them as normal chunks.
-      // This makes applypatch much faster -- it can apply a trivial
-      // patch to the compressed data, rather than uncompressing and
-      // recompressing to apply the trivial patch to the uncompressed
-      // data.
       ImageChunk* src;
       if (zip_mode) {
         src = FindChunkByName(tgt_chunks[i].filename, src_chunks, num_src_chunks);
@@ -910,15 +1252,38 @@ int main(int argc, char** argv) {
         src = src_chunks+i;
       }
 
+      // If two deflate chunks are identical (eg, the kernel has not
+      // changed between two builds), treat them as normal chunks.
+      // This makes applypatch much faster -- it can apply a trivial
+      // patch to the compressed data, rather than uncompressing and
+      // recompressing to apply the trivial patch to the uncompressed
+      // data.  Checking this first also saves recompressing them below.
       if (src == NULL || AreChunksEqual(tgt_chunks+i, src)) {
         ChangeDeflateChunkToNormal(tgt_chunks+i);
         if (src) {
           ChangeDeflateChunkToNormal(src);
         }
+        continue;
+      }
+
+      // Confirm that given the uncompressed chunk data in the target, we
+      // can recompress it and get exactly the same bits as are in the
+      // input target image.  If this fails, treat the chunk as a normal
+      // non-deflated chunk.
+      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
+        printf("failed to reconstruct target deflate chunk %d [%s]; "
+               "treating as normal\n", i, tgt_chunks[i].filename);
+        ChangeDeflateChunkToNormal(tgt_chunks+i);
+        ChangeDeflateChunkToNormal(src);
       }
     }
   }
 
+  DumpDeflateStats(argv[2]);
+  if (cache_file != NULL && SaveDeflateCache(cache_file) != 0) {
+    return 1;
+  }
+
   // Merging neighboring normal chunks.
   if (zip_mode) {
     // For zips, we only need to do this to the target:  deflated
@@ -944,17 +1309,17 @@ int main(int argc, char** argv) {
   DumpChunks(src_chunks, num_src_chunks);
 
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
-  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
-  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  PatchJob* jobs = malloc(num_tgt_chunks * sizeof(PatchJob));
   for (i = 0; i < num_tgt_chunks; ++i) {
+    jobs[i].tgt = tgt_chunks+i;
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        jobs[i].src = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        jobs[i].src = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -962,13 +1327,27 @@ int main(int argc, char** argv) {
         src_chunks[i].data = realloc(src_chunks[i].data, src_chunks[i].len + bonus_size);
         memcpy(src_chunks[i].data+src_chunks[i].len, bonus_data, bonus_size);
         src_chunks[i].len += bonus_size;
-     }
+      }
+
+      jobs[i].src = src_chunks+i;
+    }
+  }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+  MakePatches(jobs, num_tgt_chunks);
+
+  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
+  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    patch_data[i] = jobs[i].patch;
+    patch_size[i] = jobs[i].size;
+    if (patch_data[i] == NULL) {
+      printf("failed to construct patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
   }
+  free(jobs);
 
   // Figure out how big the imgdiff file header is going to be, so
   // that we can correctly compute the offset of each bsdiff patch
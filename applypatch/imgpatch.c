@@ -78,8 +78,11 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
             size_t src_len = Read8(normal_header+8);
             size_t patch_offset = Read8(normal_header+16);
 
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
+            if (ApplyBSDiffPatch(old_data + src_start, src_len,
+                                 patch, patch_offset, sink, token, ctx) != 0) {
+                printf("failed to apply chunk %d bsdiff patch\n", i);
+                return -1;
+            }
         } else if (type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Suffix array construction by induced sorting (SA-IS; Nong, Zhang and
+// Chan, "Two Efficient Algorithms for Linear Time Suffix Array
+// Construction", 2009), plus the bsdiff search over the result.
+//
+// There is no include guard: bsdiff.c includes this file once for each
+// index width, with SAIDX defined as the signed index type and SAIS(x)
+// giving a width-specific name for x.
+
+// Character i of T, which holds bytes if cs is 1 and SAIDX values
+// (names from the previous level of recursion) otherwise.
+static SAIDX SAIS(chr)(const void* T, int cs, SAIDX i) {
+    return cs == 1 ? ((const u_char*)T)[i] : ((const SAIDX*)T)[i];
+}
+
+// Fill bkt with the start (or, if 'end', one past the end) of each
+// character's bucket, given the character counts in cnt.
+static void SAIS(buckets)(const SAIDX* cnt, SAIDX* bkt, SAIDX k, int end) {
+    SAIDX i, sum = 0;
+    for (i = 0; i < k; i++) {
+        sum += cnt[i];
+        bkt[i] = end ? sum : sum - cnt[i];
+    }
+}
+
+// Induce the order of the L-type suffixes from the S-type suffixes
+// already in SA, then the order of the S-type suffixes from the L-type.
+static void SAIS(induce)(const void* T, int cs, const u_char* t, SAIDX* SA,
+                         const SAIDX* cnt, SAIDX* bkt, SAIDX n, SAIDX k) {
+    SAIDX i, j;
+
+    SAIS(buckets)(cnt, bkt, k, 0);
+    // the last suffix is followed by the (virtual) sentinel, which
+    // sorts before everything, so it comes first in its bucket.
+    SA[bkt[SAIS(chr)(T, cs, n-1)]++] = n-1;
+    for (i = 0; i < n; i++) {
+        j = SA[i] - 1;
+        if (SA[i] > 0 && !SAIS_TYPE_S(t, j)) SA[bkt[SAIS(chr)(T, cs, j)]++] = j;
+    }
+
+    SAIS(buckets)(cnt, bkt, k, 1);
+    for (i = n-1; i >= 0; i--) {
+        j = SA[i] - 1;
+        if (SA[i] > 0 && SAIS_TYPE_S(t, j)) SA[--bkt[SAIS(chr)(T, cs, j)]] = j;
+    }
+}
+
+// Sort the n suffixes of T, whose characters are in [0, k), into SA.
+static void SAIS(sort)(const void* T, int cs, SAIDX* SA, SAIDX n, SAIDX k) {
+    SAIDX i, j, d;
+
+    if (n == 0) return;
+    if (n == 1) {
+        SA[0] = 0;
+        return;
+    }
+
+    // Classify each suffix as S-type (smaller than the suffix after
+    // it) or L-type; the last one is L-type.
+    u_char* t = calloc((n >> 3) + 1, 1);
+    SAIDX* cnt = calloc(k, sizeof(SAIDX));
+    SAIDX* bkt = malloc(k * sizeof(SAIDX));
+    if (t == NULL || cnt == NULL || bkt == NULL) err(1, NULL);
+    for (i = 0; i < n; i++) cnt[SAIS(chr)(T, cs, i)]++;
+    for (i = n-2; i >= 0; i--) {
+        SAIDX c0 = SAIS(chr)(T, cs, i);
+        SAIDX c1 = SAIS(chr)(T, cs, i+1);
+        if (c0 < c1 || (c0 == c1 && SAIS_TYPE_S(t, i+1))) SAIS_SET_S(t, i);
+    }
+
+    // Sort the LMS substrings: put the LMS suffixes at the ends of
+    // their buckets and induce.
+    SAIS(buckets)(cnt, bkt, k, 1);
+    for (i = 0; i < n; i++) SA[i] = -1;
+    for (i = 1; i < n; i++) {
+        if (SAIS_IS_LMS(t, i)) SA[--bkt[SAIS(chr)(T, cs, i)]] = i;
+    }
+    SAIS(induce)(T, cs, t, SA, cnt, bkt, n, k);
+
+    // Move the sorted LMS substrings to the front of SA.  There are at
+    // most n/2 of them.
+    SAIDX n1 = 0;
+    for (i = 0; i < n; i++) {
+        if (SAIS_IS_LMS(t, SA[i])) SA[n1++] = SA[i];
+    }
+
+    // Name each LMS substring by its rank, giving equal substrings the
+    // same name.  No two LMS positions are adjacent, so the name for
+    // position p can be stored at SA[n1 + p/2].
+    for (i = n1; i < n; i++) SA[i] = -1;
+    SAIDX name = 0, prev = -1;
+    for (i = 0; i < n1; i++) {
+        SAIDX pos = SA[i];
+        int diff = prev < 0;
+        for (d = 0; !diff; d++) {
+            if (pos+d == n || prev+d == n ||
+                SAIS(chr)(T, cs, pos+d) != SAIS(chr)(T, cs, prev+d) ||
+                SAIS_TYPE_S(t, pos+d) != SAIS_TYPE_S(t, prev+d)) {
+                diff = 1;
+            } else if (d > 0 && SAIS_IS_LMS(t, pos+d)) {
+                break;
+            }
+        }
+        if (diff) {
+            name++;
+            prev = pos;
+        }
+        SA[n1 + (pos >> 1)] = name - 1;
+    }
+
+    // Gather the names in text order at the end of SA, giving the
+    // reduced string s1, and sort its suffixes into the front of SA.
+    for (i = n-1, j = n-1; i >= n1; i--) {
+        if (SA[i] >= 0) SA[j--] = SA[i];
+    }
+    SAIDX* s1 = SA + n - n1;
+    SAIDX* SA1 = SA;
+    if (name < n1) {
+        SAIS(sort)(s1, sizeof(SAIDX), SA1, n1, name);
+    } else {
+        for (i = 0; i < n1; i++) SA1[s1[i]] = i;
+    }
+
+    // The order of the reduced suffixes is the order of the LMS
+    // suffixes; put those at the ends of their buckets, in that order,
+    // and induce the rest.
+    for (i = 1, j = 0; i < n; i++) {
+        if (SAIS_IS_LMS(t, i)) s1[j++] = i;
+    }
+    for (i = 0; i < n1; i++) SA1[i] = s1[SA1[i]];
+    for (i = n1; i < n; i++) SA[i] = -1;
+    SAIS(buckets)(cnt, bkt, k, 1);
+    for (i = n1-1; i >= 0; i--) {
+        j = SA[i];
+        SA[i] = -1;
+        SA[--bkt[SAIS(chr)(T, cs, j)]] = j;
+    }
+    SAIS(induce)(T, cs, t, SA, cnt, bkt, n, k);
+
+    free(bkt);
+    free(cnt);
+    free(t);
+}
+
+// Build the suffix array bsdiff searches: oldsize+1 entries, the first
+// being the empty suffix.
+static SAIDX* SAIS(suffix_array)(u_char* old, off_t oldsize) {
+    SAIDX* I = malloc((oldsize+1) * sizeof(SAIDX));
+    if (I == NULL) err(1, NULL);
+    I[0] = oldsize;
+    SAIS(sort)(old, 1, I+1, oldsize, 256);
+    return I;
+}
+
+static off_t SAIS(search)(const SAIDX* I, u_char* old, off_t oldsize,
+                          u_char* new, off_t newsize, off_t st, off_t en,
+                          off_t* pos) {
+    off_t x, y;
+
+    while (en-st >= 2) {
+        x = st+(en-st)/2;
+        if (memcmp(old+I[x], new, MIN(oldsize-I[x], newsize)) < 0) {
+            st = x;
+        } else {
+            en = x;
+        }
+    }
+
+    x = matchlen(old+I[st], oldsize-I[st], new, newsize);
+    y = matchlen(old+I[en], oldsize-I[en], new, newsize);
+    if (x > y) {
+        *pos = I[st];
+        return x;
+    } else {
+        *pos = I[en];
+        return y;
+    }
+}
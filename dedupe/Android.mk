@@ -2,7 +2,7 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := dedupe.c driver.c
+LOCAL_SRC_FILES := dedupe.c manifest.c driver.c
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE := dedupe
 LOCAL_STATIC_LIBRARIES := libcrypto_static
@@ -10,7 +10,7 @@ LOCAL_C_INCLUDES += $(LOCAL_PATH)/../../../external/openssl/include
 include $(BUILD_HOST_EXECUTABLE)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := dedupe.c
+LOCAL_SRC_FILES := dedupe.c manifest.c
 LOCAL_STATIC_LIBRARIES := libcrypto_static libcutils libc
 LOCAL_MODULE := libdedupe
 LOCAL_MODULE_TAGS := eng
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
@@ -13,20 +14,21 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <paths.h>
+#include <pthread.h>
 #include <sys/wait.h>
 
-#define DEDUPE_VERSION 2
-#define ARRAY_CAPACITY 1000
+#include "manifest.h"
 
 static int copy_file(const char *src, const char *dst) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
+    char buf[65536];
+    int dstfd, srcfd, bytes_read;
     if (src == NULL)
         return 1;
     if (dst == NULL)
@@ -42,29 +44,280 @@ static int copy_file(const char *src, const char *dst) {
         return 4;
     }
 
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
+    while ((bytes_read = read(srcfd, buf, sizeof(buf))) > 0) {
+        if (write(dstfd, buf, bytes_read) != bytes_read) {
+            close(dstfd);
+            close(srcfd);
             return 5;
+        }
     }
 
-    close(dstfd);
     close(srcfd);
+    if (close(dstfd) || bytes_read < 0)
+        return 5;
+
+    return 0;
+}
+
+// On-disk cache of file hashes from previous backups, stored next to the
+// blob dir as <blob_dir>.cache. Entries are keyed by device and inode and
+// only trusted while size, mtime and ctime are all unchanged, which lets
+// unchanged files be stored without reading them. The file is written in
+// native byte order; it is only ever read back on the same device.
+#define DEDUPE_CACHE_MAGIC "DDUPCACH"
+#define DEDUPE_CACHE_VERSION 1
+// temporary blobs not written to for this long were left by a run that
+// died, and gc removes them
+#define DEDUPE_TMP_STALE_SECONDS (60 * 60)
+
+struct dedupe_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+};
+
+struct dedupe_cache_entry {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    unsigned char sha256[SHA256_DIGEST_LENGTH];
+};
+
+struct dedupe_cache_slot {
+    struct dedupe_cache_entry entry;
+    // 0 for an empty slot, 1 if loaded from disk, 2 if seen this run
+    int state;
+};
+
+struct dedupe_cache {
+    pthread_mutex_t lock;
+    struct dedupe_cache_slot *slots;
+    // always a power of two
+    unsigned int capacity;
+    unsigned int count;
+    // device of the tree being stored; entries for it that were not seen
+    // this run belong to deleted files and are dropped on save
+    dev_t dev;
+    // files changed during the second the backup started cannot be told
+    // apart from later changes in the same second, so they are not cached
+    time_t start_time;
+};
+
+static unsigned int cache_hash(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ (dev << 32) ^ (dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(h >> 32);
+}
+
+static struct dedupe_cache_slot* cache_find_slot(struct dedupe_cache *cache, uint64_t dev, uint64_t ino) {
+    unsigned int mask = cache->capacity - 1;
+    unsigned int i = cache_hash(dev, ino) & mask;
+    for (;;) {
+        struct dedupe_cache_slot *slot = &cache->slots[i];
+        if (slot->state == 0 || (slot->entry.dev == dev && slot->entry.ino == ino))
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+static void cache_grow(struct dedupe_cache *cache) {
+    struct dedupe_cache_slot *old_slots = cache->slots;
+    unsigned int old_capacity = cache->capacity;
+    cache->capacity = old_capacity ? old_capacity * 2 : 1024;
+    cache->slots = calloc(cache->capacity, sizeof(struct dedupe_cache_slot));
+    assert(cache->slots != NULL);
+
+    unsigned int i;
+    for (i = 0; i < old_capacity; i++) {
+        if (old_slots[i].state == 0)
+            continue;
+        *cache_find_slot(cache, old_slots[i].entry.dev, old_slots[i].entry.ino) = old_slots[i];
+    }
+    free(old_slots);
+}
+
+static void cache_put(struct dedupe_cache *cache, const struct dedupe_cache_entry *entry, int state) {
+    // keep the load factor under 3/4
+    if ((cache->count + 1) * 4 > cache->capacity * 3)
+        cache_grow(cache);
+    struct dedupe_cache_slot *slot = cache_find_slot(cache, entry->dev, entry->ino);
+    if (slot->state == 0)
+        cache->count++;
+    slot->entry = *entry;
+    slot->state = state;
+}
+
+static void cache_path(char *path, const char *blob_dir) {
+    sprintf(path, "%s.cache", blob_dir);
+}
+
+static struct dedupe_cache* cache_load(const char *blob_dir, dev_t dev) {
+    struct dedupe_cache *cache = calloc(1, sizeof(struct dedupe_cache));
+    assert(cache != NULL);
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->dev = dev;
+    cache->start_time = time(NULL);
+    cache_grow(cache);
+
+    char path[PATH_MAX];
+    cache_path(path, blob_dir);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return cache;
+
+    struct dedupe_cache_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+            memcmp(header.magic, DEDUPE_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != DEDUPE_CACHE_VERSION) {
+        fprintf(stderr, "Ignoring unrecognized hash cache %s\n", path);
+        fclose(f);
+        return cache;
+    }
+
+    struct dedupe_cache_entry entry;
+    uint32_t i;
+    for (i = 0; i < header.count && fread(&entry, sizeof(entry), 1, f) == 1; i++)
+        cache_put(cache, &entry, 1);
+    fclose(f);
+    return cache;
+}
+
+// Looks up st in the cache. On a hit, copies the cached hash to sha256
+// and returns 1.
+static int cache_lookup(struct dedupe_cache *cache, const struct stat *st, unsigned char *sha256) {
+    int hit = 0;
+    pthread_mutex_lock(&cache->lock);
+    struct dedupe_cache_slot *slot = cache_find_slot(cache, st->st_dev, st->st_ino);
+    if (slot->state != 0 &&
+            slot->entry.size == st->st_size &&
+            slot->entry.mtime == st->st_mtime &&
+            slot->entry.ctime == st->st_ctime) {
+        memcpy(sha256, slot->entry.sha256, SHA256_DIGEST_LENGTH);
+        slot->state = 2;
+        hit = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+static void cache_insert(struct dedupe_cache *cache, const struct stat *st, const unsigned char *sha256) {
+    if (st->st_mtime >= cache->start_time || st->st_ctime >= cache->start_time)
+        return;
+
+    struct dedupe_cache_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.dev = st->st_dev;
+    entry.ino = st->st_ino;
+    entry.size = st->st_size;
+    entry.mtime = st->st_mtime;
+    entry.ctime = st->st_ctime;
+    memcpy(entry.sha256, sha256, SHA256_DIGEST_LENGTH);
+
+    pthread_mutex_lock(&cache->lock);
+    cache_put(cache, &entry, 2);
+    pthread_mutex_unlock(&cache->lock);
+}
 
+static int cache_save(struct dedupe_cache *cache, const char *blob_dir) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    cache_path(path, blob_dir);
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to write hash cache %s\n", tmp_path);
+        return 1;
+    }
+
+    struct dedupe_cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DEDUPE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DEDUPE_CACHE_VERSION;
+    fwrite(&header, sizeof(header), 1, f);
+
+    unsigned int i;
+    for (i = 0; i < cache->capacity; i++) {
+        struct dedupe_cache_slot *slot = &cache->slots[i];
+        if (slot->state == 0)
+            continue;
+        if (slot->state == 1 && slot->entry.dev == (uint64_t)cache->dev)
+            continue;
+        fwrite(&slot->entry, sizeof(slot->entry), 1, f);
+        header.count++;
+    }
+
+    rewind(f);
+    fwrite(&header, sizeof(header), 1, f);
+    if (ferror(f) | fclose(f) || rename(tmp_path, path)) {
+        fprintf(stderr, "Unable to write hash cache %s\n", path);
+        unlink(tmp_path);
+        return 1;
+    }
     return 0;
 }
 
+static void cache_free(struct dedupe_cache *cache) {
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->slots);
+    free(cache);
+}
+
+struct dedupe_job {
+    struct dedupe_job *next;
+    struct stat st;
+    struct manifest_entry entry;
+    // entry.path and entry.link point into these copies
+    char *path;
+    char *link;
+    // set for files that still need hashing and copying into the blob store
+    int needs_blob;
+    int done;
+    int ret;
+};
+
+struct dedupe_pool {
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    // signalled when a job is queued or the pool shuts down
+    pthread_cond_t work_cond;
+    // signalled when a job completes
+    pthread_cond_t done_cond;
+    // jobs are kept in walk order; head is the oldest unwritten record
+    struct dedupe_job *head;
+    struct dedupe_job *tail;
+    // first job not yet picked up by a worker
+    struct dedupe_job *next_job;
+    int queued;
+    int shutdown;
+    // set once a job fails; later records are discarded
+    int failed;
+};
+
 typedef struct DEDUPE_STORE_CONTEXT {
     char blob_dir[PATH_MAX];
-    FILE *output_manifest;
+    struct manifest_writer output_manifest;
     const char** excludes;
     int exclude_count;
+    // NULL when hashing and copying on the walking thread
+    struct dedupe_pool *pool;
+    struct dedupe_cache *cache;
+    // temporary blobs are named <pid>.<tmp_serial>.tmp, so that runs
+    // sharing a blob store don't collide; gc removes stale ones
+    int tmp_serial;
+    // blobs found already stored vs. newly copied, used to pick
+    // between hashing before copying and hashing while copying
+    int blob_hits;
+    int blob_misses;
 };
 
 static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
-    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
-    fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "usage: %s c [-j threads] [-t] input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
+    fprintf(stderr, "usage: %s x [-j threads] input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s gc [-n] blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "usage: %s ls input_manifest [path...]\n", argv[0]);
 }
 
 static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
@@ -96,71 +349,325 @@ static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%d\t%d\t%lu\t%lu\t%lu\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, st.st_atime, st.st_mtime, st.st_ctime, f);
+static void stat_entry(struct manifest_entry *entry, char type, const struct stat *st, const char *f) {
+    memset(entry, 0, sizeof(*entry));
+    entry->type = type;
+    entry->mode = st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID);
+    entry->uid = st->st_uid;
+    entry->gid = st->st_gid;
+    entry->has_times = 1;
+    entry->atime = st->st_atime;
+    entry->mtime = st->st_mtime;
+    entry->ctime = st->st_ctime;
+    entry->path = f;
+    if (type == 'f')
+        entry->size = st->st_size;
 }
 
-static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
-    printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+// Copies src to dst and computes the sha256 of the data in the same pass.
+static int copy_file_sha256(const char *src, const char *dst, unsigned char *rptr) {
+    char buf[65536];
+    int dstfd, srcfd, bytes_read;
+    SHA256_CTX c;
+
+    srcfd = open(src, O_RDONLY);
+    if (srcfd < 0)
+        return 3;
+
+    dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (dstfd < 0) {
+        close(srcfd);
+        return 4;
+    }
+
+    SHA256_Init(&c);
+    while ((bytes_read = read(srcfd, buf, sizeof(buf))) > 0) {
+        SHA256_Update(&c, buf, bytes_read);
+        if (write(dstfd, buf, bytes_read) != bytes_read) {
+            close(dstfd);
+            close(srcfd);
+            return 5;
+        }
+    }
+    SHA256_Final(rptr, &c);
+
+    close(srcfd);
+    if (close(dstfd) || bytes_read < 0)
+        return 5;
+
+    return 0;
+}
+
+static int blob_exists(const char *out_blob, const struct stat *st) {
+    struct stat file_info;
+    // verify the file exists and is of the same size
+    return stat(out_blob, &file_info) == 0 && file_info.st_size == st->st_size;
+}
+
+// Hashes f and makes sure its contents are present in the blob store.
+// On success, sumdata holds the sha256 the blob is stored under.
+// Safe to call from several threads at once.
+static int store_blob(struct DEDUPE_STORE_CONTEXT *context, const struct stat *st, const char* f, unsigned char *sumdata) {
+    char key[DEDUPE_KEY_LENGTH];
+    char out_blob[PATH_MAX];
+    char tmp_out_blob[PATH_MAX];
     int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
+
+    if (context->cache != NULL && cache_lookup(context->cache, st, sumdata)) {
+        format_blob_key(sumdata, key);
+        sprintf(out_blob, "%s/%s", context->blob_dir, key);
+        if (blob_exists(out_blob, st)) {
+            __sync_fetch_and_add(&context->blob_hits, 1);
+            return 0;
+        }
+        // the blob has been collected since the file was cached,
+        // store it from scratch
+    }
+
+    // While most files turn out to be new blobs (a first backup), copy
+    // into a temporary blob and hash in the same pass so the source is
+    // only read once. Once most are already stored (an incremental
+    // backup), hash first and skip the copy instead.
+    int streaming = context->blob_misses >= context->blob_hits;
+    if (streaming) {
+        sprintf(tmp_out_blob, "%s/%d.%d.tmp", context->blob_dir, getpid(), __sync_fetch_and_add(&context->tmp_serial, 1));
+        if (ret = copy_file_sha256(f, tmp_out_blob, sumdata)) {
+            fprintf(stderr, "Error copying blob %s\n", f);
+            unlink(tmp_out_blob);
+            return ret;
+        }
+    }
+    else if (ret = do_sha256sum_file(f, sumdata)) {
         fprintf(stderr, "Error calculating sha256sum of %s\n", f);
         return ret;
     }
-    char psum[128];
-    int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
-        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+    if (context->cache != NULL)
+        cache_insert(context->cache, st, sumdata);
 
-    // if a hash is abcdefg,
-    // the output blob name is abc/defg
-    // this is to get around vfat having a 64k directory size limit (usually around 20k files)
-    char out_blob[PATH_MAX];
-    char tmp_out_blob[PATH_MAX];
-    char key[SHA256_DIGEST_LENGTH * 2 + 2];
-    // int i = 0;
-    // int keyIndex = 0;
-    // while (psum[i]) {
-    //     key[keyIndex] = psum[i];
-    //     i++;
-    //     keyIndex++;
-    //     if (i % 2 == 0 && psum[i]) {
-    //         key[keyIndex] = '/';
-    //         keyIndex++;
-    //     }
-    // }
-    strcpy(key, psum);
-    key[3] = '/';
-    key[4] = NULL;
-    strcat(key, psum + 3);
+    format_blob_key(sumdata, key);
+    // dirname() is not reentrant, so build the shard directory by hand
+    sprintf(out_blob, "%s/%.3s", context->blob_dir, key);
+    mkdir(out_blob, S_IRWXU | S_IRWXG | S_IRWXO);
     sprintf(out_blob, "%s/%s", context->blob_dir, key);
-    sprintf(tmp_out_blob, "%s.tmp", out_blob);
-    mkdir(dirname(out_blob), S_IRWXU | S_IRWXG | S_IRWXO);
 
     // don't copy the file if it exists? not quite sure how I feel about this.
-    int size = (int)st.st_size;
-    struct stat file_info;
-    // verify the file exists and is of the same size
-    int file_ok = stat(out_blob, &file_info) == 0;
+    int file_ok = blob_exists(out_blob, st);
     if (file_ok) {
-        int existing_size = file_info.st_size;
-        if (existing_size != size)
-            file_ok = 0;
+        __sync_fetch_and_add(&context->blob_hits, 1);
+        if (streaming)
+            unlink(tmp_out_blob);
+        return 0;
     }
-    if (!file_ok) {
-        // copy to the tmp file
-        if ((ret = copy_file(f, tmp_out_blob)) || (ret = rename(tmp_out_blob, out_blob))) {
+
+    __sync_fetch_and_add(&context->blob_misses, 1);
+    if (!streaming) {
+        // two workers may be storing identical contents at the same time,
+        // so each copy goes through its own temporary name
+        sprintf(tmp_out_blob, "%s.%d.%d.tmp", out_blob, getpid(), __sync_fetch_and_add(&context->tmp_serial, 1));
+        if (ret = copy_file(f, tmp_out_blob)) {
             fprintf(stderr, "Error copying blob %s\n", f);
+            unlink(tmp_out_blob);
             return ret;
         }
     }
+    if (ret = rename(tmp_out_blob, out_blob)) {
+        fprintf(stderr, "Error copying blob %s\n", f);
+        unlink(tmp_out_blob);
+        return ret;
+    }
 
-    fprintf(context->output_manifest, "%s\t%d\t\n", key, size);
     return 0;
 }
 
+static void* dedupe_worker(void *cookie) {
+    struct DEDUPE_STORE_CONTEXT *context = (struct DEDUPE_STORE_CONTEXT*)cookie;
+    struct dedupe_pool *pool = context->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->next_job == NULL && !pool->shutdown)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->next_job == NULL)
+            break;
+
+        struct dedupe_job *job = pool->next_job;
+        // skip over records that need no work
+        do {
+            pool->next_job = pool->next_job->next;
+        } while (pool->next_job != NULL && !pool->next_job->needs_blob);
+        pthread_mutex_unlock(&pool->lock);
+
+        int ret = store_blob(context, &job->st, job->path, job->entry.sha256);
+
+        pthread_mutex_lock(&pool->lock);
+        job->ret = ret;
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void free_job(struct dedupe_job *job) {
+    free(job->path);
+    free(job->link);
+    free(job);
+}
+
+// Writes out completed records from the head of the queue, in walk order.
+// If wait is set, blocks until every queued job has been written.
+// Called with the pool lock held.
+static int flush_jobs_locked(struct DEDUPE_STORE_CONTEXT *context, int wait) {
+    struct dedupe_pool *pool = context->pool;
+    int ret = 0;
+    for (;;) {
+        struct dedupe_job *job = pool->head;
+        if (job == NULL)
+            break;
+        if (!job->done) {
+            if (!wait)
+                break;
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+            continue;
+        }
+
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        pool->queued--;
+
+        if (!pool->failed && job->ret != 0) {
+            fprintf(stderr, "Error storing: %s\n", job->path);
+            ret = job->ret;
+            pool->failed = 1;
+            // no more records will be written, drain the rest of the queue
+            wait = 1;
+        }
+        if (!pool->failed) {
+            if (job->needs_blob)
+                printf("%s\n", job->path);
+            manifest_writer_add(&context->output_manifest, &job->entry);
+        }
+        free_job(job);
+    }
+    return ret;
+}
+
+// Maximum number of records buffered per worker before the walk waits
+// for hashing and copying to catch up.
+#define DEDUPE_JOBS_PER_THREAD 64
+
+static int queue_job(struct DEDUPE_STORE_CONTEXT *context, const struct manifest_entry *entry, const struct stat *st) {
+    struct dedupe_pool *pool = context->pool;
+    struct dedupe_job *job = calloc(1, sizeof(struct dedupe_job));
+    assert(job != NULL);
+    job->entry = *entry;
+    job->path = strdup(entry->path);
+    assert(job->path != NULL);
+    job->entry.path = job->path;
+    if (entry->link != NULL) {
+        job->link = strdup(entry->link);
+        assert(job->link != NULL);
+        job->entry.link = job->link;
+    }
+    job->st = *st;
+    job->needs_blob = entry->type == 'f';
+    job->done = !job->needs_blob;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->queued++;
+    if (job->needs_blob) {
+        if (pool->next_job == NULL)
+            pool->next_job = job;
+        pthread_cond_signal(&pool->work_cond);
+    }
+
+    int ret = flush_jobs_locked(context, 0);
+    while (ret == 0 && pool->queued >= pool->thread_count * DEDUPE_JOBS_PER_THREAD) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+        ret = flush_jobs_locked(context, 0);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+static int start_pool(struct DEDUPE_STORE_CONTEXT *context, int thread_count) {
+    struct dedupe_pool *pool = calloc(1, sizeof(struct dedupe_pool));
+    assert(pool != NULL);
+    pool->threads = malloc(sizeof(pthread_t) * thread_count);
+    assert(pool->threads != NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    context->pool = pool;
+
+    int i;
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, dedupe_worker, context))
+            break;
+        pool->thread_count++;
+    }
+    if (pool->thread_count == 0) {
+        fprintf(stderr, "Unable to start worker threads, hashing serially.\n");
+        free(pool->threads);
+        free(pool);
+        context->pool = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+// Waits for outstanding jobs, writes their records and tears the pool down.
+static int finish_pool(struct DEDUPE_STORE_CONTEXT *context) {
+    struct dedupe_pool *pool = context->pool;
+    if (pool == NULL)
+        return 0;
+
+    pthread_mutex_lock(&pool->lock);
+    int ret = flush_jobs_locked(context, 1);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i;
+    for (i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+    context->pool = NULL;
+    return ret;
+}
+
+// Writes a manifest record, keeping it behind any files still being
+// processed by the pool. Files are hashed and stored first.
+static int store_entry(struct DEDUPE_STORE_CONTEXT *context, struct manifest_entry *entry, const struct stat *st) {
+    if (context->pool != NULL)
+        return queue_job(context, entry, st);
+
+    if (entry->type == 'f') {
+        int ret;
+        printf("%s\n", entry->path);
+        if (ret = store_blob(context, st, entry->path, entry->sha256))
+            return ret;
+    }
+    return manifest_writer_add(&context->output_manifest, entry);
+}
+
+static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
+    struct manifest_entry entry;
+    stat_entry(&entry, 'f', &st, f);
+    return store_entry(context, &entry, &st);
+}
+
 static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
     char full_path[PATH_MAX];
     printf("%s\n", d);
@@ -204,28 +711,31 @@ static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
 static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
     printf("%s\n", l);
     char link[PATH_MAX];
-    int ret = readlink(l, link, PATH_MAX);
+    int ret = readlink(l, link, PATH_MAX - 1);
     if (ret < 0) {
         fprintf(stderr, "Error reading symlink\n");
         return errno;
     }
     link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
-    return 0;
+    struct manifest_entry entry;
+    stat_entry(&entry, 'l', &st, l);
+    entry.link = link;
+    return store_entry(context, &entry, &st);
 }
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
     if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, s);
         return store_file(context, st, s);
     }
     else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, s);
-        fprintf(context->output_manifest, "\n");
+        struct manifest_entry entry;
+        int ret;
+        stat_entry(&entry, 'd', &st, s);
+        if (ret = store_entry(context, &entry, &st))
+            return ret;
         return store_dir(context, st, s);
     }
     else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, s);
         return store_link(context, st, s);
     }
     else {
@@ -234,112 +744,445 @@ static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     }
 }
 
-static char* tokenize(char *out, const char* line, const char sep) {
-    while (*line != sep) {
-        if (*line == '\0') {
-            return NULL;
+// Parses the options starting at argv[first], in any order, and returns
+// the index of the first positional argument, or -1 on a malformed
+// option.  "-j threads" is always accepted; without it, one worker per
+// online CPU is used.  "-t" is accepted only if text_manifest isn't NULL.
+static int parse_options(int argc, char** argv, int first, int *thread_count, int *text_manifest) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    *thread_count = cpus > 0 ? (int)cpus : 1;
+    if (text_manifest != NULL)
+        *text_manifest = 0;
+    while (first < argc) {
+        if (strcmp(argv[first], "-j") == 0) {
+            if (first + 1 >= argc)
+                return -1;
+            *thread_count = atoi(argv[first + 1]);
+            if (*thread_count < 1)
+                return -1;
+            first += 2;
+        }
+        else if (text_manifest != NULL && strcmp(argv[first], "-t") == 0) {
+            *text_manifest = 1;
+            first++;
+        }
+        else {
+            break;
         }
-
-        *out = *line;
-        out++;
-        line++;
     }
-
-    *out = '\0';
-    // resume at the next char
-    return ++line;
+    return first;
 }
 
-static int dec_to_oct(int dec) {
-    int ret = 0;
-    int mult = 1;
-    while (dec != 0) {
-        int rem = dec % 10;
-        ret += (rem * mult);
-        dec /= 10;
-        mult *= 8;
-    }
+static int check_file(const char* f) {
+    struct stat cst;
+    return lstat(f, &cst);
+}
 
+static int open_manifest(struct manifest_reader *reader, const char *path) {
+    int ret = manifest_reader_open(reader, path);
+    if (ret == 2)
+        fprintf(stderr, "Attempting to read newer dedupe file: %s\n", path);
+    else if (ret)
+        fprintf(stderr, "Unable to open input manifest %s\n", path);
     return ret;
 }
 
-struct array {
-    void** data;
-    int size;
-    int capacity;
+// Set of referenced blob digests, used by gc. Open addressing over the
+// raw 32 byte digests; being hashes already, their leading bytes are used
+// directly as the probe start.
+struct digest_set {
+    unsigned char (*digests)[SHA256_DIGEST_LENGTH];
+    unsigned char *used;
+    // always a power of two
+    size_t capacity;
+    size_t count;
 };
 
-static void array_init(struct array* arr, int capacity) {
-    arr->data = malloc(sizeof(void*) * capacity);
-    assert(arr->data != NULL);
-    arr->size = 0;
-    arr->capacity = capacity;
+static size_t digest_slot(const struct digest_set *set, const unsigned char *digest) {
+    size_t h;
+    memcpy(&h, digest, sizeof(h));
+    size_t mask = set->capacity - 1;
+    size_t i = h & mask;
+    while (set->used[i] && memcmp(set->digests[i], digest, SHA256_DIGEST_LENGTH) != 0)
+        i = (i + 1) & mask;
+    return i;
 }
 
-static void array_free(struct array* arr, int free_members) {
-    if (free_members) {
-        int i;
-        for (i = 0; i < arr->size; i++) {
-            free(arr->data[i]);
+static void digest_set_init(struct digest_set *set, size_t capacity) {
+    set->capacity = capacity;
+    set->count = 0;
+    set->digests = malloc(SHA256_DIGEST_LENGTH * capacity);
+    set->used = calloc(capacity, 1);
+    assert(set->digests != NULL && set->used != NULL);
+}
+
+static void digest_set_free(struct digest_set *set) {
+    free(set->digests);
+    free(set->used);
+    memset(set, 0, sizeof(*set));
+}
+
+static void digest_set_add(struct digest_set *set, const unsigned char *digest) {
+    // keep the load factor under 1/2 so misses stay short
+    if ((set->count + 1) * 2 > set->capacity) {
+        struct digest_set grown;
+        digest_set_init(&grown, set->capacity * 2);
+        size_t i;
+        for (i = 0; i < set->capacity; i++) {
+            if (!set->used[i])
+                continue;
+            size_t slot = digest_slot(&grown, set->digests[i]);
+            memcpy(grown.digests[slot], set->digests[i], SHA256_DIGEST_LENGTH);
+            grown.used[slot] = 1;
         }
+        grown.count = set->count;
+        digest_set_free(set);
+        *set = grown;
     }
 
-    if (arr->data != NULL) {
-        free(arr->data);
-        arr->data = NULL;
-    }
-    arr->size = 0;
-    arr->capacity = 0;
+    size_t slot = digest_slot(set, digest);
+    if (set->used[slot])
+        return;
+    memcpy(set->digests[slot], digest, SHA256_DIGEST_LENGTH);
+    set->used[slot] = 1;
+    set->count++;
 }
 
-static void array_add(struct array* arr, void* val) {
-    if (arr->size == arr->capacity) {
-        // Expand array
-        arr->capacity *= 2;
-        arr->data = realloc(arr->data, sizeof(void*) * arr->capacity);
-        assert(arr->data != NULL);
-    }
-    arr->data[arr->size++] = val;
+static int digest_set_contains(const struct digest_set *set, const unsigned char *digest) {
+    return set->used[digest_slot(set, digest)];
 }
 
+struct gc_context {
+    char blob_dir[PATH_MAX];
+    struct digest_set used;
+    // keys of blobs stored under another layout, which do not parse as a
+    // digest; sorted once all manifests are read
+    char **other_keys;
+    int other_count;
+    int other_capacity;
+    int dry_run;
+    long long reclaimable_bytes;
+    int reclaimable_count;
+};
+
 static int string_compare(const void* a, const void* b) {
     return strcmp(*(char**) a, *(char **) b);
 }
 
-static void recursive_list_dir(char* d, struct array *arr) {
-    DIR *dp = opendir(d);
+static int gc_is_used(struct gc_context *gc, const char *key) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    if (parse_blob_key(key, digest) == 0 && digest_set_contains(&gc->used, digest))
+        return 1;
+    return gc->other_count > 0 &&
+        bsearch(&key, gc->other_keys, gc->other_count, sizeof(char*), string_compare) != NULL;
+}
+
+static int gc_mark(struct gc_context *gc, const char *manifest) {
+    struct manifest_reader input_manifest;
+    if (open_manifest(&input_manifest, manifest))
+        return 1;
+
+    struct manifest_entry entry;
+    int ret;
+    while ((ret = manifest_reader_next(&input_manifest, &entry)) > 0) {
+        if (entry.type != 'f')
+            continue;
+        if (entry.has_sha256) {
+            digest_set_add(&gc->used, entry.sha256);
+            continue;
+        }
+        if (gc->other_count == gc->other_capacity) {
+            gc->other_capacity = gc->other_capacity ? gc->other_capacity * 2 : 64;
+            gc->other_keys = realloc(gc->other_keys, sizeof(char*) * gc->other_capacity);
+            assert(gc->other_keys != NULL);
+        }
+        gc->other_keys[gc->other_count] = strdup(entry.key);
+        assert(gc->other_keys[gc->other_count] != NULL);
+        gc->other_count++;
+    }
+    manifest_reader_close(&input_manifest);
+    if (ret < 0) {
+        // collecting against a partial list would delete live blobs
+        fprintf(stderr, "Corrupt dedupe manifest: %s\n", manifest);
+        return 1;
+    }
+    return 0;
+}
+
+static void gc_collect(struct gc_context *gc, const char *blob, long long size) {
+    gc->reclaimable_bytes += size;
+    gc->reclaimable_count++;
+    if (gc->dry_run) {
+        printf("Unused: %s\n", blob);
+        return;
+    }
+    if (remove(blob)) {
+        fprintf(stderr, "Error removing: %s\n", blob);
+    }
+    printf("Delete: %s\n", blob);
+}
+
+static int is_tmp_blob(const char *name) {
+    size_t len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, ".tmp") == 0;
+}
+
+// Sweeps one directory of the blob store. rel is the directory relative to
+// blob_dir ("" for the top level). Only the names of the directory being
+// swept are held in memory at a time.
+static void gc_sweep(struct gc_context *gc, const char *rel) {
+    char dir[PATH_MAX];
+    if (*rel)
+        sprintf(dir, "%s/%s", gc->blob_dir, rel);
+    else
+        strcpy(dir, gc->blob_dir);
+
+    DIR *dp = opendir(dir);
     if (dp == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", d);
+        fprintf(stderr, "Error opening directory: %s\n", dir);
         return;
     }
+
+    // removing entries while readdir is walking the same directory is not
+    // reliable on every filesystem, so collect the names first
+    char **names = NULL;
+    int count = 0;
+    int capacity = 0;
     struct dirent *ep;
     while ((ep = readdir(dp))) {
         if (strcmp(ep->d_name, ".") == 0)
             continue;
         if (strcmp(ep->d_name, "..") == 0)
             continue;
-        struct stat cst;
-        int ret;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            names = realloc(names, sizeof(char*) * capacity);
+            assert(names != NULL);
+        }
+        names[count] = strdup(ep->d_name);
+        assert(names[count] != NULL);
+        count++;
+    }
+    closedir(dp);
+
+    int i;
+    for (i = 0; i < count; i++) {
+        char key[PATH_MAX];
         char blob[PATH_MAX];
-        sprintf(blob, "%s/%s", d, ep->d_name);
-        if ((ret = lstat(blob, &cst))) {
-            fprintf(stderr, "Error opening: %s\n", ep->d_name);
-            continue;
+        struct stat cst;
+        if (*rel)
+            sprintf(key, "%s/%s", rel, names[i]);
+        else
+            strcpy(key, names[i]);
+        sprintf(blob, "%s/%s", gc->blob_dir, key);
+        if (lstat(blob, &cst)) {
+            fprintf(stderr, "Error opening: %s\n", names[i]);
+        }
+        else if (S_ISDIR(cst.st_mode)) {
+            gc_sweep(gc, key);
+        }
+        else if (is_tmp_blob(names[i])) {
+            // leave the temporary blobs of a backup still running alone
+            if (cst.st_mtime < time(NULL) - DEDUPE_TMP_STALE_SECONDS)
+                gc_collect(gc, blob, cst.st_size);
         }
+        else if (!gc_is_used(gc, key)) {
+            gc_collect(gc, blob, cst.st_size);
+        }
+        free(names[i]);
+    }
+    free(names);
+}
 
-        if (S_ISDIR(cst.st_mode)) {
-            recursive_list_dir(blob, arr);
-            continue;
+// Restores run in three phases: directories are created while the
+// manifest is read, file contents are then copied from the blob store by
+// a pool of workers, and finally symlinks are made and directory metadata
+// is applied bottom up, so that writing into a directory does not
+// clobber the mtime restored on it.
+struct restore_item {
+    char type;
+    int mode;
+    int uid;
+    int gid;
+    int has_times;
+    time_t atime;
+    time_t mtime;
+    char *path;
+    // blob key for files, target for symlinks
+    char *data;
+};
+
+struct restore_list {
+    struct restore_item *items;
+    int count;
+    int capacity;
+};
+
+struct restore_context {
+    char blob_dir[PATH_MAX];
+    // in manifest order, so parents precede their children
+    struct restore_list dirs;
+    struct restore_list files;
+    struct restore_list links;
+    // next file to be claimed by a worker
+    int next_file;
+    // first error hit by a worker; stops the others
+    int failed;
+};
+
+static void restore_add(struct restore_list *list, const struct manifest_entry *entry, const char *data) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->items = realloc(list->items, sizeof(struct restore_item) * list->capacity);
+        assert(list->items != NULL);
+    }
+    struct restore_item *item = &list->items[list->count++];
+    item->type = entry->type;
+    item->mode = entry->mode;
+    item->uid = entry->uid;
+    item->gid = entry->gid;
+    item->has_times = entry->has_times;
+    item->atime = entry->atime;
+    item->mtime = entry->mtime;
+    item->path = strdup(entry->path);
+    item->data = data != NULL ? strdup(data) : NULL;
+    assert(item->path != NULL);
+}
+
+static void restore_list_free(struct restore_list *list) {
+    int i;
+    for (i = 0; i < list->count; i++) {
+        free(list->items[i].path);
+        free(list->items[i].data);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+static void restore_free(struct restore_context *restore) {
+    restore_list_free(&restore->dirs);
+    restore_list_free(&restore->files);
+    restore_list_free(&restore->links);
+}
+
+static void restore_times(const struct restore_item *item) {
+    if (!item->has_times)
+        return;
+    // don't follow symlinks: links are restored after the files they
+    // point to, and their times would overwrite the targets'
+    struct timespec times[2];
+    times[0].tv_sec = item->atime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = item->mtime;
+    times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, item->path, times, AT_SYMLINK_NOFOLLOW);
+}
+
+// Creates directories and sorts the remaining entries into their phases.
+// Returns -1 on a malformed manifest.
+static int restore_read_manifest(struct restore_context *restore, struct manifest_reader *input_manifest) {
+    struct manifest_entry entry;
+    int ret;
+    while ((ret = manifest_reader_next(input_manifest, &entry)) > 0) {
+        if (entry.type == 'f') {
+            restore_add(&restore->files, &entry, entry.key);
         }
+        else if (entry.type == 'l') {
+            restore_add(&restore->links, &entry, entry.link);
+        }
+        else {
+            printf("%s\n", entry.path);
+            // keep the directory writable until its contents are restored
+            mkdir(entry.path, S_IRWXU);
+            restore_add(&restore->dirs, &entry, NULL);
+        }
+    }
+    return ret;
+}
 
-        array_add(arr, strdup(blob));
+static int restore_file(struct restore_context *restore, const struct restore_item *item) {
+    char blob_file[PATH_MAX];
+    int ret;
+    sprintf(blob_file, "%s/%s", restore->blob_dir, item->data);
+    if (ret = copy_file(blob_file, item->path)) {
+        fprintf(stderr, "Unable to copy file %s\n", item->path);
+        return ret;
     }
-    closedir(dp);
+
+    chown(item->path, item->uid, item->gid);
+    chmod(item->path, item->mode);
+    restore_times(item);
+    printf("%s\n", item->path);
+    return 0;
 }
 
-static int check_file(const char* f) {
-    struct stat cst;
-    return lstat(f, &cst);
+static void* restore_worker(void *cookie) {
+    struct restore_context *restore = (struct restore_context*)cookie;
+    for (;;) {
+        int i = __sync_fetch_and_add(&restore->next_file, 1);
+        if (i >= restore->files.count || restore->failed)
+            break;
+        int ret = restore_file(restore, &restore->files.items[i]);
+        if (ret)
+            __sync_bool_compare_and_swap(&restore->failed, 0, ret);
+    }
+    return NULL;
+}
+
+static int restore_files(struct restore_context *restore, int thread_count) {
+    if (thread_count > restore->files.count)
+        thread_count = restore->files.count;
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * (thread_count + 1));
+    assert(threads != NULL);
+    int started = 0;
+    if (thread_count > 1) {
+        for (started = 0; started < thread_count; started++) {
+            if (pthread_create(&threads[started], NULL, restore_worker, restore))
+                break;
+        }
+    }
+    // copy on this thread too if no workers could be started
+    if (started == 0)
+        restore_worker(restore);
+
+    int i;
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    return restore->failed;
+}
+
+static void restore_finish(struct restore_context *restore) {
+    int i;
+    for (i = 0; i < restore->links.count; i++) {
+        const struct restore_item *item = &restore->links.items[i];
+        printf("%s\n", item->path);
+        symlink(item->data, item->path);
+
+        // Android has no lchmod, and chmod follows symlinks
+        //chmod(filename, mode_oct);
+        lchown(item->path, item->uid, item->gid);
+        restore_times(item);
+    }
+
+    // children come after their parents in the manifest, so walking it
+    // backwards applies metadata bottom up
+    for (i = restore->dirs.count - 1; i >= 0; i--) {
+        const struct restore_item *item = &restore->dirs.items[i];
+        chown(item->path, item->uid, item->gid);
+        chmod(item->path, item->mode);
+        restore_times(item);
+    }
+}
+
+static void print_entry(const struct manifest_entry *entry) {
+    printf("%c\t%o\t%d\t%d\t%lu\t", entry->type, entry->mode, entry->uid, entry->gid, (unsigned long)entry->mtime);
+    if (entry->type == 'f')
+        printf("%s\t%lld\t", entry->key, entry->size);
+    else if (entry->type == 'l')
+        printf("%s\t", entry->link);
+    printf("%s\n", entry->path);
 }
 
 int dedupe_main(int argc, char** argv) {
@@ -349,264 +1192,168 @@ int dedupe_main(int argc, char** argv) {
     }
 
     if (strcmp(argv[1], "c") == 0) {
-        if (argc < 5) {
+        int thread_count;
+        // tab separated text manifests can still be written for
+        // older restore tools
+        int text_manifest;
+        int first = parse_options(argc, argv, 2, &thread_count, &text_manifest);
+        if (first < 0 || argc - first < 3) {
             usage(argv);
             return 1;
         }
+        const char *input_dir = argv[first];
+        const char *blob_dir = argv[first + 1];
+        const char *manifest = argv[first + 2];
 
         struct stat st;
         int ret;
-        if (0 != (ret = lstat(argv[2], &st))) {
+        if (0 != (ret = lstat(input_dir, &st))) {
             fprintf(stderr, "Error opening input_file/input_directory.\n");
             return ret;
         }
 
         if (!S_ISDIR(st.st_mode)) {
-            fprintf(stderr, "%s must be a directory.\n", argv[2]);
+            fprintf(stderr, "%s must be a directory.\n", input_dir);
             return 1;
         }
 
         struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        fprintf(context.output_manifest, "dedupe\t%d\n", DEDUPE_VERSION);
-        if (context.output_manifest == NULL) {
-            fprintf(stderr, "Unable to open output file %s\n", argv[4]);
+        memset(&context, 0, sizeof(context));
+        if (manifest_writer_open(&context.output_manifest, manifest, !text_manifest)) {
+            fprintf(stderr, "Unable to open output file %s\n", manifest);
             return 1;
         }
-        mkdir(argv[3], S_IRWXU | S_IRWXG | S_IRWXO);
-        realpath(argv[3], context.blob_dir);
-        chdir(argv[2]);
-        context.excludes = argv + 5;
-        context.exclude_count = argc - 5;
-
-        return store_dir(&context, st, ".");
+        mkdir(blob_dir, S_IRWXU | S_IRWXG | S_IRWXO);
+        realpath(blob_dir, context.blob_dir);
+        context.cache = cache_load(context.blob_dir, st.st_dev);
+        chdir(input_dir);
+        context.excludes = (const char**)argv + first + 3;
+        context.exclude_count = argc - first - 3;
+
+        if (thread_count > 1)
+            start_pool(&context, thread_count);
+
+        ret = store_dir(&context, st, ".");
+        int pool_ret = finish_pool(&context);
+        if (ret == 0)
+            ret = pool_ret;
+        if (manifest_writer_close(&context.output_manifest) && ret == 0) {
+            fprintf(stderr, "Error writing output file %s\n", manifest);
+            ret = 1;
+        }
+        // a failed cache write only costs rehashing on the next backup
+        if (ret == 0)
+            cache_save(context.cache, context.blob_dir);
+        cache_free(context.cache);
+        return ret;
     }
     else if (strcmp(argv[1], "x") == 0) {
-        if (argc != 5) {
+        int thread_count;
+        int first = parse_options(argc, argv, 2, &thread_count, NULL);
+        if (first < 0 || argc - first != 3) {
             usage(argv);
             return 1;
         }
+        const char *manifest = argv[first];
+        char *output_dir = argv[first + 2];
 
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
+        struct manifest_reader input_manifest;
+        if (open_manifest(&input_manifest, manifest))
             return 1;
-        }
 
-        char blob_dir[PATH_MAX];
-        char *output_dir = argv[4];
-        realpath(argv[3], blob_dir);
+        struct restore_context restore;
+        memset(&restore, 0, sizeof(restore));
+        realpath(argv[first + 1], restore.blob_dir);
 
         printf("%s\n" , output_dir);
         mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
         if (chdir(output_dir)) {
             fprintf(stderr, "Unable to open output directory %s\n", output_dir);
+            manifest_reader_close(&input_manifest);
             return 1;
         }
 
-        char line[PATH_MAX];
-        fgets(line, PATH_MAX, input_manifest);
-        int version = 1;
-        if (sscanf(line, "dedupe\t%d", &version) != 1) {
-            fseek(input_manifest, 0, SEEK_SET);
-        }
-        if (version > DEDUPE_VERSION) {
-            fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", argv[2]);
-            return 1;
+        int ret = restore_read_manifest(&restore, &input_manifest);
+        manifest_reader_close(&input_manifest);
+        if (ret < 0) {
+            fprintf(stderr, "Corrupt dedupe manifest: %s\n", manifest);
+            ret = 1;
         }
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char at[32];
-            char mt[32];
-            char ct[32];
-            char filename[PATH_MAX];
-
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            if (version >= 2) {
-                token = tokenize(at, token, '\t');
-                token = tokenize(mt, token, '\t');
-                token = tokenize(ct, token, '\t');
-            }
-            token = tokenize(filename, token, '\t');
-
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            //printf("%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, filename);
-            printf("%s\n", filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                // printf("%s\t%d\n", sha256, size);
-
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(blob_file, filename)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                // printf("%s\n", link);
-
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                // printf("\n");
-
-                mkdir(filename, mode_oct);
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
-            }
-            if (version >= 2) {
-                struct timeval times[2];
-                times[0].tv_sec = atol(at);
-                times[1].tv_sec = atol(mt);
-                utimes(filename, times);
-            }
-        }
-
-        fclose(input_manifest);
-        return 0;
+        if (ret == 0)
+            ret = restore_files(&restore, thread_count);
+        if (ret == 0)
+            restore_finish(&restore);
+        restore_free(&restore);
+        return ret;
     }
     else if (strcmp(argv[1], "gc") == 0) {
-        if (argc < 3) {
+        int first = 2;
+        struct gc_context gc;
+        memset(&gc, 0, sizeof(gc));
+        if (first < argc && strcmp(argv[first], "-n") == 0) {
+            gc.dry_run = 1;
+            first++;
+        }
+        if (first >= argc) {
             usage(argv);
             return 1;
         }
-        
-        char blob_dir[PATH_MAX];
-        realpath(argv[2], blob_dir);
-        if (check_file(blob_dir)) {
-            fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir);
+
+        realpath(argv[first], gc.blob_dir);
+        if (check_file(gc.blob_dir)) {
+            fprintf(stderr, "Unable to open blobs dir: %s\n", gc.blob_dir);
             return 1;
         }
 
-        struct array used_files;
-        struct array all_files;
-        array_init(&used_files, ARRAY_CAPACITY);
-        array_init(&all_files, ARRAY_CAPACITY);
-
-        char blob[PATH_MAX];
+        digest_set_init(&gc.used, 4096);
         int i;
         int failure = 0;
-        for (i = 3; i < argc; i++) {
-            FILE *input_manifest = fopen(argv[i], "rb");
-            if (input_manifest == NULL) {
-                fprintf(stderr, "Unable to open input manifest %s\n", argv[i]);
-                failure = 1;
-                goto out;
-            }
-
-            char line[PATH_MAX];
-            fgets(line, PATH_MAX, input_manifest);
-            int version = 1;
-            if (sscanf(line, "dedupe\t%d", &version) != 1) {
-                fseek(input_manifest, 0, SEEK_SET);
-            }
-            if (version > DEDUPE_VERSION) {
-                fprintf(stderr, "Attempting to gc newer dedupe file: %s\n", argv[2]);
+        for (i = first + 1; i < argc; i++) {
+            if (gc_mark(&gc, argv[i])) {
                 failure = 1;
-                fclose(input_manifest);
                 break;
             }
-            while (fgets(line, PATH_MAX, input_manifest)) {
-                char type[4];
-                char mode[8];
-                char uid[32];
-                char gid[32];
-                char at[32];
-                char mt[32];
-                char ct[32];
-                char filename[PATH_MAX];
-
-                char *token = line;
-                token = tokenize(type, token, '\t');
-                token = tokenize(mode, token, '\t');
-                token = tokenize(uid, token, '\t');
-                token = tokenize(gid, token, '\t');
-                if (version >= 2) {
-                    token = tokenize(at, token, '\t');
-                    token = tokenize(mt, token, '\t');
-                    token = tokenize(ct, token, '\t');
-                }
-                token = tokenize(filename, token, '\t');
-
-                int mode_oct = dec_to_oct(atoi(mode));
-                int uid_int = atoi(uid);
-                int gid_int = atoi(gid);
-                int ret;
-                // printf("%s\n", filename);
-                if (strcmp(type, "f") == 0) {
-                    char key[128];
-                    token = tokenize(key, token, '\t');
-                    char sizeStr[32];
-                    token = tokenize(sizeStr, token, '\t');
-                    int size = atoi(sizeStr);
-
-                    sprintf(blob, "%s/%s", blob_dir, key);
-                    array_add(&used_files, strdup(blob));
-                }
-            }
-            fclose(input_manifest);
         }
 
-        recursive_list_dir(blob_dir, &all_files);
+        if (!failure) {
+            if (gc.other_count > 0)
+                qsort(gc.other_keys, gc.other_count, sizeof(char*), string_compare);
+            gc_sweep(&gc, "");
+            printf("%s %d unused blobs, %lld bytes.\n", gc.dry_run ? "Reclaimable:" : "Freed:", gc.reclaimable_count, gc.reclaimable_bytes);
+        }
 
-        qsort(used_files.data, used_files.size, sizeof(void*), string_compare);
-        qsort(all_files.data, all_files.size, sizeof(void*), string_compare);
+        for (i = 0; i < gc.other_count; i++)
+            free(gc.other_keys[i]);
+        free(gc.other_keys);
+        digest_set_free(&gc.used);
 
-        // Search for unused files
-        int j = 0;
-        for (i = 0; i < all_files.size; i++) {
-            int cmp;
-            while (j < used_files.size &&
-                (cmp = strcmp(used_files.data[j], all_files.data[i])) < 0) {
-                j++;
-            }
+        return failure;
+    }
+    else if (strcmp(argv[1], "ls") == 0) {
+        struct manifest_reader input_manifest;
+        if (open_manifest(&input_manifest, argv[2]))
+            return 1;
 
-            if (cmp > 0 || j >= used_files.size) {
-                if (remove(all_files.data[i])) {
-                    fprintf(stderr, "Error removing: %s\n", all_files.data[i]);
+        struct manifest_entry entry;
+        int ret = 0;
+        if (argc == 3) {
+            while ((ret = manifest_reader_next(&input_manifest, &entry)) > 0)
+                print_entry(&entry);
+        }
+        else {
+            int i;
+            for (i = 3; i < argc; i++) {
+                if (manifest_reader_find(&input_manifest, argv[i], &entry)) {
+                    print_entry(&entry);
+                }
+                else {
+                    fprintf(stderr, "Not found: %s\n", argv[i]);
+                    ret = -1;
                 }
-                printf("Delete: %s\n", all_files.data[i]);
             }
         }
-
-        out:
-        array_free(&used_files, 1);
-        array_free(&all_files, 1);
-
-        return failure;
+        manifest_reader_close(&input_manifest);
+        return ret < 0 ? 1 : 0;
     }
     else {
         usage(argv);
@@ -0,0 +1,461 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+
+#define DEDUPE_MAGIC_LENGTH 16
+
+// All fields are in the byte order of the device that wrote the backup.
+struct dedupe_manifest_header {
+    // "dedupe\t3\n", NUL padded
+    char magic[DEDUPE_MAGIC_LENGTH];
+    uint32_t version;
+    uint32_t record_count;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t index_offset;
+};
+
+struct dedupe_manifest_record {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t size;
+    // string table offsets; offset 0 is always the empty string
+    uint32_t path;
+    uint32_t link;
+    unsigned char sha256[SHA256_DIGEST_LENGTH];
+};
+
+void format_blob_key(const unsigned char *sha256, char *key) {
+    char psum[128];
+    int j;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
+        sprintf(&psum[(j*2)], "%02x", (int)sha256[j]);
+    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+
+    // if a hash is abcdefg,
+    // the output blob name is abc/defg
+    // this is to get around vfat having a 64k directory size limit (usually around 20k files)
+    strcpy(key, psum);
+    key[3] = '/';
+    key[4] = '\0';
+    strcat(key, psum + 3);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int parse_blob_key(const char *key, unsigned char *sha256) {
+    int nibble = 0;
+    const char *p;
+    for (p = key; *p; p++) {
+        if (*p == '/' && p - key == 3)
+            continue;
+        int v = hex_value(*p);
+        if (v < 0 || nibble >= SHA256_DIGEST_LENGTH * 2)
+            return 1;
+        if (nibble % 2 == 0)
+            sha256[nibble / 2] = v << 4;
+        else
+            sha256[nibble / 2] |= v;
+        nibble++;
+    }
+    return nibble == SHA256_DIGEST_LENGTH * 2 ? 0 : 1;
+}
+
+static uint32_t add_string(struct manifest_writer *writer, const char *s) {
+    uint32_t len = strlen(s) + 1;
+    if (len == 1 && writer->strings_size > 0)
+        return 0;
+    while (writer->strings_size + len > writer->strings_capacity) {
+        writer->strings_capacity = writer->strings_capacity ? writer->strings_capacity * 2 : 65536;
+        writer->strings = realloc(writer->strings, writer->strings_capacity);
+        assert(writer->strings != NULL);
+    }
+    uint32_t offset = writer->strings_size;
+    memcpy(writer->strings + offset, s, len);
+    writer->strings_size += len;
+    return offset;
+}
+
+int manifest_writer_open(struct manifest_writer *writer, const char *path, int binary) {
+    memset(writer, 0, sizeof(*writer));
+    writer->binary = binary;
+    writer->f = fopen(path, "wb");
+    if (writer->f == NULL)
+        return 1;
+
+    if (!binary) {
+        fprintf(writer->f, "dedupe\t%d\n", DEDUPE_TEXT_VERSION);
+        return 0;
+    }
+
+    // the header is rewritten with the final offsets on close
+    struct dedupe_manifest_header header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, writer->f);
+    add_string(writer, "");
+    return 0;
+}
+
+int manifest_writer_add(struct manifest_writer *writer, const struct manifest_entry *entry) {
+    if (!writer->binary) {
+        fprintf(writer->f, "%c\t%o\t%d\t%d\t%lu\t%lu\t%lu\t%s\t", entry->type, entry->mode, entry->uid, entry->gid, (unsigned long)entry->atime, (unsigned long)entry->mtime, (unsigned long)entry->ctime, entry->path);
+        if (entry->type == 'f') {
+            char key[DEDUPE_KEY_LENGTH];
+            format_blob_key(entry->sha256, key);
+            fprintf(writer->f, "%s\t%d\t\n", key, (int)entry->size);
+        }
+        else if (entry->type == 'l') {
+            fprintf(writer->f, "%s\t\n", entry->link);
+        }
+        else {
+            fprintf(writer->f, "\n");
+        }
+        return 0;
+    }
+
+    struct dedupe_manifest_record record;
+    memset(&record, 0, sizeof(record));
+    record.type = entry->type;
+    record.mode = entry->mode;
+    record.uid = entry->uid;
+    record.gid = entry->gid;
+    record.atime = entry->atime;
+    record.mtime = entry->mtime;
+    record.ctime = entry->ctime;
+    record.path = add_string(writer, entry->path);
+    if (entry->type == 'f') {
+        record.size = entry->size;
+        memcpy(record.sha256, entry->sha256, SHA256_DIGEST_LENGTH);
+    }
+    else if (entry->type == 'l') {
+        record.link = add_string(writer, entry->link);
+    }
+
+    if (writer->count == writer->paths_capacity) {
+        writer->paths_capacity = writer->paths_capacity ? writer->paths_capacity * 2 : 1024;
+        writer->paths = realloc(writer->paths, sizeof(uint32_t) * writer->paths_capacity);
+        assert(writer->paths != NULL);
+    }
+    writer->paths[writer->count++] = record.path;
+    fwrite(&record, sizeof(record), 1, writer->f);
+    return 0;
+}
+
+// qsort has no context argument; the index is only ever built by one
+// thread at a time.
+static const char *sort_strings;
+static const uint32_t *sort_paths;
+
+static int index_compare(const void *a, const void *b) {
+    return strcmp(sort_strings + sort_paths[*(const uint32_t*)a],
+                  sort_strings + sort_paths[*(const uint32_t*)b]);
+}
+
+int manifest_writer_close(struct manifest_writer *writer) {
+    int ret = 0;
+    if (writer->binary) {
+        struct dedupe_manifest_header header;
+        memset(&header, 0, sizeof(header));
+        sprintf(header.magic, "dedupe\t%d\n", DEDUPE_BINARY_VERSION);
+        header.version = DEDUPE_BINARY_VERSION;
+        header.record_count = writer->count;
+        header.records_offset = sizeof(header);
+        header.strings_offset = header.records_offset + (uint64_t)writer->count * sizeof(struct dedupe_manifest_record);
+        header.strings_size = writer->strings_size;
+        // keep the index 4 byte aligned so it can be used in place
+        header.index_offset = (header.strings_offset + header.strings_size + 3) & ~3ULL;
+
+        uint32_t *index = malloc(sizeof(uint32_t) * (writer->count + 1));
+        assert(index != NULL);
+        uint32_t i;
+        for (i = 0; i < writer->count; i++)
+            index[i] = i;
+        sort_strings = writer->strings;
+        sort_paths = writer->paths;
+        qsort(index, writer->count, sizeof(uint32_t), index_compare);
+
+        static const char padding[4];
+        fwrite(writer->strings, 1, writer->strings_size, writer->f);
+        fwrite(padding, 1, header.index_offset - header.strings_offset - header.strings_size, writer->f);
+        fwrite(index, sizeof(uint32_t), writer->count, writer->f);
+        free(index);
+
+        rewind(writer->f);
+        fwrite(&header, sizeof(header), 1, writer->f);
+    }
+
+    if (ferror(writer->f))
+        ret = 1;
+    if (fclose(writer->f))
+        ret = 1;
+    free(writer->strings);
+    free(writer->paths);
+    memset(writer, 0, sizeof(*writer));
+    return ret;
+}
+
+static char* tokenize(char *out, const char* line, const char sep) {
+    while (*line != sep) {
+        if (*line == '\0') {
+            return NULL;
+        }
+
+        *out = *line;
+        out++;
+        line++;
+    }
+
+    *out = '\0';
+    // resume at the next char
+    return (char*)++line;
+}
+
+static int dec_to_oct(int dec) {
+    int ret = 0;
+    int mult = 1;
+    while (dec != 0) {
+        int rem = dec % 10;
+        ret += (rem * mult);
+        dec /= 10;
+        mult *= 8;
+    }
+
+    return ret;
+}
+
+static int open_binary(struct manifest_reader *reader, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct dedupe_manifest_header))
+        return 1;
+
+    reader->map_size = st.st_size;
+    reader->map = mmap(NULL, reader->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (reader->map == MAP_FAILED) {
+        reader->map = NULL;
+        return 1;
+    }
+
+    const struct dedupe_manifest_header *header = reader->map;
+    uint64_t size = reader->map_size;
+    uint64_t records_size = (uint64_t)header->record_count * sizeof(struct dedupe_manifest_record);
+    if (header->version != DEDUPE_BINARY_VERSION ||
+            header->records_offset > size || records_size > size - header->records_offset ||
+            header->strings_offset > size || header->strings_size > size - header->strings_offset ||
+            header->strings_size == 0 ||
+            header->index_offset % 4 != 0 || header->index_offset > size ||
+            (uint64_t)header->record_count * sizeof(uint32_t) > size - header->index_offset ||
+            header->records_offset % 8 != 0)
+        return 1;
+
+    reader->header = header;
+    reader->version = header->version;
+    reader->records = (const struct dedupe_manifest_record*)((const char*)reader->map + header->records_offset);
+    reader->strings = (const char*)reader->map + header->strings_offset;
+    reader->index = (const uint32_t*)((const char*)reader->map + header->index_offset);
+    // the table ends in a NUL, so every offset inside it names a
+    // terminated string
+    if (reader->strings[header->strings_size - 1] != '\0')
+        return 1;
+    return 0;
+}
+
+int manifest_reader_open(struct manifest_reader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    char magic[DEDUPE_MAGIC_LENGTH];
+    char binary_magic[DEDUPE_MAGIC_LENGTH];
+    memset(binary_magic, 0, sizeof(binary_magic));
+    sprintf(binary_magic, "dedupe\t%d\n", DEDUPE_BINARY_VERSION);
+    if (read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, binary_magic, sizeof(magic)) == 0) {
+        int ret = open_binary(reader, fd);
+        close(fd);
+        if (ret) {
+            fprintf(stderr, "Corrupt dedupe manifest: %s\n", path);
+            manifest_reader_close(reader);
+        }
+        return ret;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    reader->f = fdopen(fd, "rb");
+    if (reader->f == NULL) {
+        close(fd);
+        return 1;
+    }
+
+    reader->version = 1;
+    if (fgets(reader->line, sizeof(reader->line), reader->f) == NULL ||
+            sscanf(reader->line, "dedupe\t%d", &reader->version) != 1) {
+        fseek(reader->f, 0, SEEK_SET);
+    }
+    if (reader->version > DEDUPE_TEXT_VERSION) {
+        manifest_reader_close(reader);
+        return 2;
+    }
+    return 0;
+}
+
+static int next_text(struct manifest_reader *reader, struct manifest_entry *entry) {
+    if (fgets(reader->line, sizeof(reader->line), reader->f) == NULL)
+        return 0;
+
+    char type[4];
+    char mode[8];
+    char uid[32];
+    char gid[32];
+    char at[32];
+    char mt[32];
+    char ct[32];
+
+    char *token = reader->line;
+    if ((token = tokenize(type, token, '\t')) == NULL ||
+            (token = tokenize(mode, token, '\t')) == NULL ||
+            (token = tokenize(uid, token, '\t')) == NULL ||
+            (token = tokenize(gid, token, '\t')) == NULL)
+        return -1;
+    if (reader->version >= 2) {
+        if ((token = tokenize(at, token, '\t')) == NULL ||
+                (token = tokenize(mt, token, '\t')) == NULL ||
+                (token = tokenize(ct, token, '\t')) == NULL)
+            return -1;
+        entry->has_times = 1;
+        entry->atime = atol(at);
+        entry->mtime = atol(mt);
+        entry->ctime = atol(ct);
+    }
+    if ((token = tokenize(reader->path, token, '\t')) == NULL)
+        return -1;
+
+    entry->type = type[0];
+    entry->mode = dec_to_oct(atoi(mode));
+    entry->uid = atoi(uid);
+    entry->gid = atoi(gid);
+    entry->path = reader->path;
+    if (strcmp(type, "f") == 0) {
+        char sizeStr[32];
+        if ((token = tokenize(entry->key, token, '\t')) == NULL ||
+                (token = tokenize(sizeStr, token, '\t')) == NULL)
+            return -1;
+        entry->size = atoll(sizeStr);
+        entry->has_sha256 = parse_blob_key(entry->key, entry->sha256) == 0;
+    }
+    else if (strcmp(type, "l") == 0) {
+        if ((token = tokenize(reader->link, token, '\t')) == NULL)
+            return -1;
+        entry->link = reader->link;
+    }
+    else if (strcmp(type, "d") != 0) {
+        fprintf(stderr, "Unknown type %s\n", type);
+        return -1;
+    }
+    return 1;
+}
+
+static int fill_binary(struct manifest_reader *reader, uint32_t n, struct manifest_entry *entry) {
+    const struct dedupe_manifest_record *record = &reader->records[n];
+    uint64_t strings_size = reader->header->strings_size;
+    if (record->path >= strings_size || record->link >= strings_size)
+        return -1;
+    if (record->type != 'f' && record->type != 'd' && record->type != 'l') {
+        fprintf(stderr, "Unknown type %c\n", record->type);
+        return -1;
+    }
+
+    entry->type = record->type;
+    entry->mode = record->mode;
+    entry->uid = record->uid;
+    entry->gid = record->gid;
+    entry->has_times = 1;
+    entry->atime = record->atime;
+    entry->mtime = record->mtime;
+    entry->ctime = record->ctime;
+    entry->path = reader->strings + record->path;
+    if (record->type == 'f') {
+        entry->size = record->size;
+        memcpy(entry->sha256, record->sha256, SHA256_DIGEST_LENGTH);
+        entry->has_sha256 = 1;
+        format_blob_key(entry->sha256, entry->key);
+    }
+    else if (record->type == 'l') {
+        entry->link = reader->strings + record->link;
+    }
+    return 1;
+}
+
+int manifest_reader_next(struct manifest_reader *reader, struct manifest_entry *entry) {
+    memset(entry, 0, sizeof(*entry));
+    if (reader->f != NULL)
+        return next_text(reader, entry);
+
+    if (reader->next >= reader->header->record_count)
+        return 0;
+    return fill_binary(reader, reader->next++, entry);
+}
+
+int manifest_reader_find(struct manifest_reader *reader, const char *path, struct manifest_entry *entry) {
+    if (reader->f != NULL) {
+        int ret;
+        fseek(reader->f, 0, SEEK_SET);
+        // skip the version line
+        if (reader->version > 1)
+            fgets(reader->line, sizeof(reader->line), reader->f);
+        while ((ret = manifest_reader_next(reader, entry)) > 0) {
+            if (strcmp(entry->path, path) == 0)
+                return 1;
+        }
+        return 0;
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = reader->header->record_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t n = reader->index[mid];
+        if (n >= reader->header->record_count || reader->records[n].path >= reader->header->strings_size)
+            return 0;
+        int cmp = strcmp(reader->strings + reader->records[n].path, path);
+        if (cmp == 0) {
+            memset(entry, 0, sizeof(*entry));
+            return fill_binary(reader, n, entry) > 0;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+void manifest_reader_close(struct manifest_reader *reader) {
+    if (reader->f != NULL)
+        fclose(reader->f);
+    if (reader->map != NULL)
+        munmap(reader->map, reader->map_size);
+    memset(reader, 0, sizeof(*reader));
+}
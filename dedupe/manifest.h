@@ -0,0 +1,96 @@
+#ifndef DEDUPE_MANIFEST_H
+#define DEDUPE_MANIFEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <openssl/sha.h>
+
+// Version 2 manifests are tab separated text, one record per line.
+// Version 3 manifests are binary: a header, fixed width records in walk
+// order, a string table holding paths and symlink targets, and an index
+// of record numbers sorted by path. The binary header begins with the
+// same "dedupe\t<version>\n" line as the text format so older builds
+// refuse it as a newer manifest instead of misparsing it.
+#define DEDUPE_TEXT_VERSION 2
+#define DEDUPE_BINARY_VERSION 3
+
+// hex digest with a '/' after the shard prefix, see format_blob_key
+#define DEDUPE_KEY_LENGTH (SHA256_DIGEST_LENGTH * 2 + 2)
+
+struct manifest_entry {
+    // 'f', 'd' or 'l'
+    char type;
+    int mode;
+    int uid;
+    int gid;
+    // version 1 manifests carry no timestamps
+    int has_times;
+    time_t atime;
+    time_t mtime;
+    time_t ctime;
+    const char *path;
+    // symlink target, for 'l' entries
+    const char *link;
+    // blob name and size, for 'f' entries
+    char key[DEDUPE_KEY_LENGTH];
+    unsigned char sha256[SHA256_DIGEST_LENGTH];
+    // set if key is a well formed blob name and sha256 holds its digest
+    int has_sha256;
+    long long size;
+};
+
+struct manifest_writer {
+    FILE *f;
+    int binary;
+    // binary manifests only
+    uint32_t count;
+    char *strings;
+    uint32_t strings_size;
+    uint32_t strings_capacity;
+    // string table offset of each record's path, for the index
+    uint32_t *paths;
+    uint32_t paths_capacity;
+};
+
+struct dedupe_manifest_header;
+struct dedupe_manifest_record;
+
+struct manifest_reader {
+    int version;
+    // text manifests
+    FILE *f;
+    char line[PATH_MAX * 2 + 256];
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+    // binary manifests, mapped read only
+    void *map;
+    size_t map_size;
+    const struct dedupe_manifest_header *header;
+    const struct dedupe_manifest_record *records;
+    const char *strings;
+    const uint32_t *index;
+    uint32_t next;
+};
+
+void format_blob_key(const unsigned char *sha256, char *key);
+int parse_blob_key(const char *key, unsigned char *sha256);
+
+int manifest_writer_open(struct manifest_writer *writer, const char *path, int binary);
+int manifest_writer_add(struct manifest_writer *writer, const struct manifest_entry *entry);
+int manifest_writer_close(struct manifest_writer *writer);
+
+// Opens a text or binary manifest. Returns 0 on success and 2 if the
+// manifest was written by a newer version of dedupe.
+int manifest_reader_open(struct manifest_reader *reader, const char *path);
+// Reads the next entry in walk order. Returns 1 if an entry was read,
+// 0 at the end of the manifest and -1 on a malformed manifest. Strings in
+// the entry stay valid until the next call.
+int manifest_reader_next(struct manifest_reader *reader, struct manifest_entry *entry);
+// Looks up a single path. Binary manifests use the path index, text
+// manifests are scanned from the start. Returns 1 if found.
+int manifest_reader_find(struct manifest_reader *reader, const char *path, struct manifest_entry *entry);
+void manifest_reader_close(struct manifest_reader *reader);
+
+#endif
@@ -1145,51 +1145,32 @@ static void run_dedupe_gc() {
 
 static void choose_default_backup_format() {
     static const char* headers[] = { "Default Backup Format", "", NULL };
+    // indexed by NANDROID_BACKUP_FORMAT_*
+    static const char* formats[] = { "tar", "dup", "tgz", "lz4", "zst" };
+    static const char* names[] = { "tar", "dup", "tar + gzip", "tar + lz4", "tar + zstd" };
+    static const char* descriptions[] = { "tar", "dedupe", "tar + gzip", "tar + lz4", "tar + zstd" };
 
     int fmt = nandroid_get_default_backup_format();
 
-    char **list;
-    char* list_tar_default[] = { "tar (default)",
-                                 "dup",
-                                 "tar + gzip",
-                                 NULL };
-    char* list_dup_default[] = { "tar",
-                                 "dup (default)",
-                                 "tar + gzip",
-                                 NULL };
-    char* list_tgz_default[] = { "tar",
-                                 "dup",
-                                 "tar + gzip (default)",
-                                 NULL };
-
-    if (fmt == NANDROID_BACKUP_FORMAT_DUP) {
-        list = list_dup_default;
-    } else if (fmt == NANDROID_BACKUP_FORMAT_TGZ) {
-        list = list_tgz_default;
-    } else {
-        list = list_tar_default;
+    char* list[NANDROID_BACKUP_FORMAT_ZST + 2];
+    int i;
+    for (i = 0; i <= NANDROID_BACKUP_FORMAT_ZST; i++) {
+        char buf[64];
+        sprintf(buf, i == fmt ? "%s (default)" : "%s", names[i]);
+        list[i] = nandroid_backup_format_supported(i) ? strdup(buf) : NULL;
     }
+    list[i] = NULL;
 
     char path[PATH_MAX];
     sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_BACKUP_FORMAT_FILE);
-    int chosen_item = get_menu_selection(headers, list, 0, 0);
-    switch (chosen_item) {
-        case 0: {
-            write_string_to_file(path, "tar");
-            ui_print("Default backup format set to tar.\n");
-            break;
-        }
-        case 1: {
-            write_string_to_file(path, "dup");
-            ui_print("Default backup format set to dedupe.\n");
-            break;
-        }
-        case 2: {
-            write_string_to_file(path, "tgz");
-            ui_print("Default backup format set to tar + gzip.\n");
-            break;
-        }
+    int chosen_item = get_filtered_menu_selection(headers, list, 0, 0, sizeof(list) / sizeof(char*));
+    if (chosen_item >= 0 && chosen_item <= NANDROID_BACKUP_FORMAT_ZST) {
+        write_string_to_file(path, formats[chosen_item]);
+        ui_print("Default backup format set to %s.\n", descriptions[chosen_item]);
     }
+
+    for (i = 0; i <= NANDROID_BACKUP_FORMAT_ZST; i++)
+        free(list[i]);
 }
 
 static void add_nandroid_options_for_volume(char** menu, char* path, int offset) {
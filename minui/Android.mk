@@ -18,12 +18,14 @@ LOCAL_MODULE := libminui
 # ordinary characters in this context).  Strip double-quotes from the
 # value so that either will work.
 
+minui_pixel_cflags :=
 ifeq ($(subst ",,$(TARGET_RECOVERY_PIXEL_FORMAT)),RGBX_8888)
-  LOCAL_CFLAGS += -DRECOVERY_RGBX
+  minui_pixel_cflags += -DRECOVERY_RGBX
 endif
 ifeq ($(subst ",,$(TARGET_RECOVERY_PIXEL_FORMAT)),BGRA_8888)
-  LOCAL_CFLAGS += -DRECOVERY_BGRA
+  minui_pixel_cflags += -DRECOVERY_BGRA
 endif
+LOCAL_CFLAGS += $(minui_pixel_cflags)
 
 ifneq ($(TARGET_RECOVERY_OVERSCAN_PERCENT),)
   LOCAL_CFLAGS += -DOVERSCAN_PERCENT=$(TARGET_RECOVERY_OVERSCAN_PERCENT)
@@ -36,3 +38,55 @@ ifneq ($(BOARD_USE_CUSTOM_RECOVERY_FONT),)
 endif
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := text_bench.c
+
+LOCAL_MODULE := minui_text_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_STATIC_LIBRARIES := libminui libpixelflinger_static libpng libz libcutils liblog libc
+
+include $(BUILD_EXECUTABLE)
+
+# Packs recovery's images, decoded and converted to the framebuffer's
+# pixel format, into /res/images.dat.  res_create_surface() uses it in
+# place of decoding PNGs at startup when it is present; add
+# minui_images.dat to PRODUCT_PACKAGES to install it.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := res_pack.c resources.c
+
+LOCAL_C_INCLUDES +=\
+    external/libpng\
+    external/zlib
+
+LOCAL_CFLAGS += $(minui_pixel_cflags)
+
+LOCAL_STATIC_LIBRARIES := libpng libz
+
+LOCAL_MODULE := minui_res_pack
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := minui_images.dat
+LOCAL_MODULE_STEM := images.dat
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_PATH := $(TARGET_RECOVERY_ROOT_OUT)/res
+
+include $(BUILD_SYSTEM)/base_rules.mk
+
+minui_images := $(wildcard $(LOCAL_PATH)/../res/images/*.png)
+minui_res_pack := $(HOST_OUT_EXECUTABLES)/minui_res_pack$(HOST_EXECUTABLE_SUFFIX)
+
+$(LOCAL_BUILT_MODULE): PRIVATE_IMAGES := $(minui_images)
+$(LOCAL_BUILT_MODULE): PRIVATE_PACK := $(minui_res_pack)
+$(LOCAL_BUILT_MODULE): $(minui_images) $(minui_res_pack)
+	@echo "Pack images: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(PRIVATE_PACK) $@ $(PRIVATE_IMAGES)
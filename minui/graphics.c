@@ -15,6 +15,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -30,6 +31,12 @@
 
 #include <pixelflinger/pixelflinger.h>
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef BOARD_USE_CUSTOM_RECOVERY_FONT
 #include BOARD_USE_CUSTOM_RECOVERY_FONT
 #else
@@ -37,28 +44,33 @@
 #endif
 
 #include "minui.h"
+#include "graphics.h"
 
-#if defined(RECOVERY_BGRA)
-#define PIXEL_FORMAT GGL_PIXEL_FORMAT_BGRA_8888
-#define PIXEL_SIZE   4
-#elif defined(RECOVERY_RGBX)
-#define PIXEL_FORMAT GGL_PIXEL_FORMAT_RGBX_8888
-#define PIXEL_SIZE   4
+#define NUM_BUFFERS 2
+
+#if PIXEL_SIZE == 4
+typedef uint32_t GRPixel;
 #else
-#define PIXEL_FORMAT GGL_PIXEL_FORMAT_RGB_565
-#define PIXEL_SIZE   2
+typedef uint16_t GRPixel;
 #endif
 
-#define NUM_BUFFERS 2
+#define FONT_GLYPHS 96
 
 typedef struct {
     GGLSurface texture;
     unsigned cwidth;
     unsigned cheight;
     unsigned ascent;
+    /* The glyphs again, as cheight rows of cwidth pixel masks each
+     * (all ones where the glyph is drawn), so gr_text() can write
+     * straight into gr_mem_surface.  NULL if it couldn't be
+     * allocated; gr_text() then draws through pixelflinger. */
+    GRPixel *atlas;
 } GRFont;
 
 static GRFont *gr_font = 0;
+static GRPixel gr_text_color;       /* gr_color() in the framebuffer format */
+static GRPixel *gr_text_mask;       /* one row of a line of text's masks */
 static GGLContext *gr_context = 0;
 static GGLSurface gr_font_texture;
 static GGLSurface gr_framebuffer[NUM_BUFFERS];
@@ -75,6 +87,18 @@ static int gr_vt_fd = -1;
 static struct fb_var_screeninfo vi;
 static struct fb_fix_screeninfo fi;
 
+/* The columns [x1, x2) of one row that have been drawn since a
+ * framebuffer was last updated; x1 >= x2 if none have. */
+typedef struct {
+    int x1;
+    int x2;
+} GRSpan;
+
+/* Per framebuffer, one span per row of the screen.  gr_flip() only
+ * copies these from gr_mem_surface, so a frame that changes just the
+ * progress bar or one line of log costs that much and no more. */
+static GRSpan *gr_damage[NUM_BUFFERS];
+
 static int get_framebuffer(GGLSurface *fb)
 {
     int fd;
@@ -190,6 +214,75 @@ static void set_active_framebuffer(unsigned n)
     }
 }
 
+/* Mark the rectangle [x1, x2) x [y1, y2) of the screen as drawn in
+ * every framebuffer.  Coordinates include the overscan offset. */
+static void gr_damage_rect(int x1, int y1, int x2, int y2)
+{
+    unsigned i;
+    int y;
+
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > (int) vi.xres) x2 = vi.xres;
+    if (y2 > (int) vi.yres) y2 = vi.yres;
+    if (x1 >= x2 || y1 >= y2)
+        return;
+
+    for (i = 0; i < (double_buffering ? NUM_BUFFERS : 1); i++) {
+        GRSpan *span = gr_damage[i];
+        if (span == NULL)
+            continue;
+        for (y = y1; y < y2; y++) {
+            if (span[y].x1 >= span[y].x2) {
+                span[y].x1 = x1;
+                span[y].x2 = x2;
+            } else {
+                if (x1 < span[y].x1) span[y].x1 = x1;
+                if (x2 > span[y].x2) span[y].x2 = x2;
+            }
+        }
+    }
+}
+
+/* Copy the damaged spans of the in-memory surface to framebuffer n and
+ * mark it clean. */
+static void gr_copy_damage(unsigned n)
+{
+    GRSpan *span = gr_damage[n];
+    unsigned char *dst = gr_framebuffer[n].data;
+    unsigned char *src = gr_mem_surface.data;
+    int width = vi.xres;
+    int y = 0, end;
+
+    if (span == NULL) {
+        memcpy(dst, src, fi.line_length * vi.yres);
+        return;
+    }
+
+    while (y < (int) vi.yres) {
+        if (span[y].x1 >= span[y].x2) {
+            y++;
+        } else if (span[y].x1 == 0 && span[y].x2 == width) {
+            /* whole rows are contiguous; copy a run of them at once */
+            for (end = y + 1; end < (int) vi.yres; end++) {
+                if (span[end].x1 != 0 || span[end].x2 != width)
+                    break;
+                span[end].x2 = 0;
+            }
+            memcpy(dst + y * fi.line_length, src + y * fi.line_length,
+                   (end - y) * fi.line_length);
+            span[y].x2 = 0;
+            y = end;
+        } else {
+            size_t off = y * fi.line_length + span[y].x1 * PIXEL_SIZE;
+            memcpy(dst + off, src + off,
+                   (span[y].x2 - span[y].x1) * PIXEL_SIZE);
+            span[y].x1 = span[y].x2 = 0;
+            y++;
+        }
+    }
+}
+
 void gr_flip(void)
 {
     GGLContext *gl = gr_context;
@@ -198,10 +291,9 @@ void gr_flip(void)
     if (double_buffering)
         gr_active_fb = (gr_active_fb + 1) & 1;
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           fi.line_length * vi.yres);
+    /* copy whatever has been drawn since it was last shown from the
+     * in-memory surface to the buffer we're about to make active. */
+    gr_copy_damage(gr_active_fb);
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
@@ -216,6 +308,14 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+
+#if defined(RECOVERY_BGRA)
+    gr_text_color = b | (g << 8) | (r << 16) | (0xffu << 24);
+#elif defined(RECOVERY_RGBX)
+    gr_text_color = r | (g << 8) | (b << 16) | (0xffu << 24);
+#else
+    gr_text_color = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+#endif
 }
 
 int gr_measure(const char *s)
@@ -229,6 +329,94 @@ void gr_font_size(int *x, int *y)
     *y = gr_font->cheight;
 }
 
+/* Set dst to gr_text_color wherever mask is set.  The font only has
+ * fully opaque and fully transparent texels, so this is the same as
+ * pixelflinger's blend of the font texture. */
+static void gr_blend_row(GRPixel *dst, const GRPixel *mask, int n)
+{
+    GRPixel color = gr_text_color;
+    int i = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#if PIXEL_SIZE == 4
+    uint8x16_t c = vreinterpretq_u8_u32(vdupq_n_u32(color));
+#else
+    uint8x16_t c = vreinterpretq_u8_u16(vdupq_n_u16(color));
+#endif
+    for (; i + 16 / PIXEL_SIZE <= n; i += 16 / PIXEL_SIZE) {
+        uint8x16_t m = vld1q_u8((const uint8_t *) (mask + i));
+        uint8x16_t d = vld1q_u8((const uint8_t *) (dst + i));
+        vst1q_u8((uint8_t *) (dst + i), vbslq_u8(m, c, d));
+    }
+#elif defined(__SSE2__)
+#if PIXEL_SIZE == 4
+    __m128i c = _mm_set1_epi32(color);
+#else
+    __m128i c = _mm_set1_epi16(color);
+#endif
+    for (; i + 16 / PIXEL_SIZE <= n; i += 16 / PIXEL_SIZE) {
+        __m128i m = _mm_loadu_si128((const __m128i *) (mask + i));
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+        d = _mm_or_si128(_mm_andnot_si128(m, d), _mm_and_si128(m, c));
+        _mm_storeu_si128((__m128i *) (dst + i), d);
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = (dst[i] & ~mask[i]) | (color & mask[i]);
+}
+
+/* Draw a string whose cells start at (x, y) (already including the
+ * overscan offset and ascent) into gr_mem_surface, a whole row of the
+ * line at a time.  Returns the x just past the last cell. */
+static int gr_text_atlas(int x, int y, const char *s)
+{
+    GRFont *font = gr_font;
+    int cw = font->cwidth;
+    int len = strlen(s);
+    int end = x + len * cw;
+    int x1 = x < 0 ? 0 : x;
+    int x2 = end > (int) vi.xres ? (int) vi.xres : end;
+    int y1 = y < 0 ? 0 : y;
+    int y2 = y + (int) font->cheight;
+    int row, cy;
+
+    if (y2 > (int) vi.yres) y2 = vi.yres;
+    if (x1 >= x2 || y1 >= y2)
+        return end;
+
+    /* only the characters that are at least partly on the screen */
+    int first = (x1 - x) / cw;
+    int last = (x2 - x - 1) / cw;
+
+    for (cy = y1; cy < y2; cy++) {
+        GRPixel *mask = gr_text_mask;
+        int i;
+
+        row = cy - y;
+        for (i = first; i <= last; i++) {
+            unsigned off = (unsigned char) s[i] - 32;
+            int cx = x + i * cw;
+            int from = cx < x1 ? x1 - cx : 0;
+            int to = cx + cw > x2 ? x2 - cx : cw;
+
+            if (off < FONT_GLYPHS) {
+                memcpy(mask, font->atlas + (off * font->cheight + row) * cw + from,
+                       (to - from) * sizeof(GRPixel));
+            } else {
+                memset(mask, 0, (to - from) * sizeof(GRPixel));
+            }
+            mask += to - from;
+        }
+
+        gr_blend_row((GRPixel *) ((unsigned char *) gr_mem_surface.data +
+                                  cy * fi.line_length) + x1,
+                     gr_text_mask, x2 - x1);
+    }
+    gr_damage_rect(x1, y1, x2, y2);
+
+    return end;
+}
+
 int gr_text(int x, int y, const char *s)
 {
     GGLContext *gl = gr_context;
@@ -240,12 +428,16 @@ int gr_text(int x, int y, const char *s)
 
     y -= font->ascent;
 
+    if (font->atlas != NULL && gr_text_mask != NULL)
+        return gr_text_atlas(x, y, s);
+
     gl->bindTexture(gl, &font->texture);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->enable(gl, GGL_TEXTURE_2D);
 
+    int x0 = x;
     while((off = *s++)) {
         off -= 32;
         if (off < 96) {
@@ -254,6 +446,7 @@ int gr_text(int x, int y, const char *s)
         }
         x += font->cwidth;
     }
+    gr_damage_rect(x0, y, x, y + font->cheight);
 
     return x;
 }
@@ -278,6 +471,7 @@ void gr_texticon(int x, int y, gr_surface icon) {
 
     gl->texCoord2i(gl, -x, -y);
     gl->recti(gl, x, y, x+gr_get_width(icon), y+gr_get_height(icon));
+    gr_damage_rect(x, y, x + w, y + h);
 }
 
 void gr_fill(int x1, int y1, int x2, int y2)
@@ -291,6 +485,7 @@ void gr_fill(int x1, int y1, int x2, int y2)
     GGLContext *gl = gr_context;
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x1, y1, x2, y2);
+    gr_damage_rect(x1, y1, x2, y2);
 }
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
@@ -309,6 +504,7 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     gl->enable(gl, GGL_TEXTURE_2D);
     gl->texCoord2i(gl, sx - dx, sy - dy);
     gl->recti(gl, dx, dy, dx + w, dy + h);
+    gr_damage_rect(dx, dy, dx + w, dy + h);
 }
 
 unsigned int gr_get_width(gr_surface surface) {
@@ -325,6 +521,30 @@ unsigned int gr_get_height(gr_surface surface) {
     return ((GGLSurface*) surface)->height;
 }
 
+/* Expand the font texture into gr_font->atlas. */
+static void gr_init_atlas(void)
+{
+    GRFont *f = gr_font;
+    const unsigned char *bits = f->texture.data;
+    unsigned g, row, col;
+
+    f->atlas = malloc(FONT_GLYPHS * f->cheight * f->cwidth * sizeof(GRPixel));
+    if (f->atlas == NULL)
+        return;
+
+    GRPixel *p = f->atlas;
+    for (g = 0; g < FONT_GLYPHS; g++) {
+        for (row = 0; row < f->cheight; row++) {
+            for (col = 0; col < f->cwidth; col++) {
+                unsigned tx = g * f->cwidth + col;
+                bool on = row < f->texture.height && tx < f->texture.width &&
+                          bits[row * f->texture.stride + tx] != 0;
+                *p++ = on ? (GRPixel) ~0 : 0;
+            }
+        }
+    }
+}
+
 static void gr_init_font(void)
 {
     GGLSurface *ftex;
@@ -352,6 +572,8 @@ static void gr_init_font(void)
     gr_font->cwidth = font.cwidth;
     gr_font->cheight = font.cheight;
     gr_font->ascent = font.cheight - 2;
+
+    gr_init_atlas();
 }
 
 int gr_init(void)
@@ -378,6 +600,21 @@ int gr_init(void)
     }
 
     get_memory_surface(&gr_mem_surface);
+    gr_text_mask = malloc(vi.xres * sizeof(GRPixel));
+
+    /* the in-memory surface starts out undefined, so the first flip to
+     * each buffer copies all of it.  If there's no memory to track
+     * damage, gr_flip() falls back to copying the whole frame. */
+    unsigned i, y;
+    for (i = 0; i < NUM_BUFFERS; i++) {
+        gr_damage[i] = malloc(vi.yres * sizeof(GRSpan));
+        if (gr_damage[i] == NULL)
+            continue;
+        for (y = 0; y < vi.yres; y++) {
+            gr_damage[i][y].x1 = 0;
+            gr_damage[i][y].x2 = vi.xres;
+        }
+    }
 
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
@@ -403,6 +640,14 @@ void gr_exit(void)
     gr_fb_fd = -1;
 
     free(gr_mem_surface.data);
+    free(gr_text_mask);
+    gr_text_mask = NULL;
+
+    unsigned i;
+    for (i = 0; i < NUM_BUFFERS; i++) {
+        free(gr_damage[i]);
+        gr_damage[i] = NULL;
+    }
 
     ioctl(gr_vt_fd, KDSETMODE, (void*) KD_TEXT);
     close(gr_vt_fd);
@@ -349,7 +349,13 @@ int free_overlay(int fd)
     return 0;
 }
 
-int overlay_display_frame(int fd, GGLubyte* data, size_t size)
+/*
+ * Show a frame through the overlay.  The overlay's buffer keeps the
+ * previous frame, so only the "size" bytes at "offset" in "data" that
+ * have changed since then are copied to it; pass 0 and the whole frame
+ * size to copy everything.
+ */
+int overlay_display_frame(int fd, GGLubyte* data, size_t offset, size_t size)
 {
     if (!overlay_supported)
         return -EINVAL;
@@ -364,7 +370,7 @@ int overlay_display_frame(int fd, GGLubyte* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        memcpy(mem_info.mem_buf + offset, data + offset, size);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -384,7 +390,7 @@ int overlay_display_frame(int fd, GGLubyte* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        memcpy(mem_info.mem_buf + offset, data + offset, size);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -446,7 +452,7 @@ int free_overlay(int fd)
     return -EINVAL;
 }
 
-int overlay_display_frame(int fd, GGLubyte* data, size_t size)
+int overlay_display_frame(int fd, GGLubyte* data, size_t offset, size_t size)
 {
     return -EINVAL;
 }
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Decodes recovery's PNGs with res_decode_png() and packs the results
+// into the file res_create_surface() maps (see resources.h).  It must
+// be built with the same pixel format flags as libminui.
+//
+//   minui_res_pack <out.dat> <image.png> ...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graphics.h"
+#include "resources.h"
+
+typedef struct {
+    ResBlobEntry entry;
+    GGLSurface* surface;
+} Image;
+
+static int compare_image(const void* a, const void* b) {
+    return strncmp(((const Image*) a)->entry.name,
+                   ((const Image*) b)->entry.name, RES_NAME_MAX);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <out.dat> <image.png> ...\n", argv[0]);
+        return 2;
+    }
+
+    int count = argc - 2;
+    Image* images = calloc(count ? count : 1, sizeof(Image));
+    if (images == NULL) return 1;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        const char* path = argv[i + 2];
+        const char* base = strrchr(path, '/');
+        base = base ? base + 1 : path;
+        size_t len = strlen(base);
+        if (len > 4 && strcmp(base + len - 4, ".png") == 0) len -= 4;
+        if (len >= RES_NAME_MAX) {
+            fprintf(stderr, "%s: name too long\n", path);
+            return 1;
+        }
+        memcpy(images[i].entry.name, base, len);
+
+        int result = res_decode_png(path, (gr_surface*) &images[i].surface);
+        if (result < 0) {
+            fprintf(stderr, "%s: can't decode (%d)\n", path, result);
+            return 1;
+        }
+        images[i].entry.format = images[i].surface->format;
+        images[i].entry.width = images[i].surface->width;
+        images[i].entry.height = images[i].surface->height;
+        images[i].entry.stride = images[i].surface->stride;
+    }
+    qsort(images, count, sizeof(Image), compare_image);
+
+    size_t offset = sizeof(ResBlobHeader) + count * sizeof(ResBlobEntry);
+    for (i = 0; i < count; ++i) {
+        offset = (offset + RES_BLOB_ALIGN - 1) & ~(size_t) (RES_BLOB_ALIGN - 1);
+        images[i].entry.offset = offset;
+        offset += (size_t) images[i].entry.stride * images[i].entry.height *
+                res_format_size(images[i].entry.format);
+    }
+
+    FILE* out = fopen(argv[1], "wb");
+    if (out == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    ResBlobHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RES_BLOB_MAGIC, sizeof(header.magic));
+    header.version = RES_BLOB_VERSION;
+    header.opaque_format = PIXEL_FORMAT;
+    header.count = count;
+    fwrite(&header, sizeof(header), 1, out);
+    for (i = 0; i < count; ++i) {
+        fwrite(&images[i].entry, sizeof(ResBlobEntry), 1, out);
+    }
+    for (i = 0; i < count; ++i) {
+        static const char zeros[RES_BLOB_ALIGN];
+        fwrite(zeros, 1, images[i].entry.offset - ftell(out), out);
+        fwrite(images[i].surface->data, 1,
+               (size_t) images[i].entry.stride * images[i].entry.height *
+               res_format_size(images[i].entry.format), out);
+        res_free_surface(images[i].surface);
+    }
+
+    if (ferror(out) || fclose(out) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    free(images);
+    return 0;
+}
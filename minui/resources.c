@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -22,6 +23,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -32,6 +34,8 @@
 #include <png.h>
 
 #include "minui.h"
+#include "graphics.h"
+#include "resources.h"
 
 // libpng gives "undefined reference to 'pow'" errors, and I have no
 // idea how to convince the build system to link with -lm.  We don't
@@ -41,8 +45,31 @@ double pow(double x, double y) {
     return x;
 }
 
-int res_create_surface(const char* name, gr_surface* pSurface) {
-    char resPath[256];
+int res_format_size(int format) {
+    return format == GGL_PIXEL_FORMAT_RGB_565 ? 2 : 4;
+}
+
+// Convert an opaque 8888 surface (R, G, B, 0xff) to PIXEL_FORMAT in place.
+static void res_convert_opaque(GGLSurface* surface) {
+    unsigned char* p = surface->data;
+    size_t i, n = (size_t) surface->stride * surface->height;
+
+    if (PIXEL_FORMAT == GGL_PIXEL_FORMAT_RGB_565) {
+        unsigned short* out = (unsigned short*) p;
+        for (i = 0; i < n; ++i, p += 4) {
+            out[i] = ((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3);
+        }
+    } else if (PIXEL_FORMAT == GGL_PIXEL_FORMAT_BGRA_8888) {
+        for (i = 0; i < n; ++i, p += 4) {
+            unsigned char r = p[0];
+            p[0] = p[2];
+            p[2] = r;
+        }
+    }
+    surface->format = PIXEL_FORMAT;
+}
+
+int res_decode_png(const char* resPath, gr_surface* pSurface) {
     GGLSurface* surface = NULL;
     int result = 0;
     unsigned char header[8];
@@ -51,8 +78,6 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
 
     *pSurface = NULL;
 
-    snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
-    resPath[sizeof(resPath)-1] = '\0';
     FILE* fp = fopen(resPath, "rb");
     if (fp == NULL) {
         result = -1;
@@ -103,7 +128,7 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
           ((channels == 3 && color_type == PNG_COLOR_TYPE_RGB) ||
            (channels == 4 && color_type == PNG_COLOR_TYPE_RGBA) ||
            (channels == 1 && color_type == PNG_COLOR_TYPE_PALETTE)))) {
-        return -7;
+        result = -7;
         goto exit;
     }
 
@@ -157,6 +182,10 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
         }
     }
 
+    if (channels == 3 || (channels == 1 && !alpha)) {
+        res_convert_opaque(surface);
+    }
+
     *pSurface = (gr_surface) surface;
 
 exit:
@@ -173,6 +202,90 @@ exit:
     return result;
 }
 
+// The packed images, mapped on first use; NULL if there are none.
+static const unsigned char* res_blob = NULL;
+static size_t res_blob_size;
+static int res_blob_mapped = 0;
+
+static void res_map_blob(void) {
+    struct stat st;
+    const ResBlobHeader* header;
+
+    if (res_blob_mapped) return;
+    res_blob_mapped = 1;
+
+    int fd = open(RES_BLOB_PATH, O_RDONLY);
+    if (fd < 0) return;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(ResBlobHeader)) {
+        close(fd);
+        return;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+
+    // Ignore a blob packed for another pixel format.
+    header = data;
+    if (memcmp(header->magic, RES_BLOB_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != RES_BLOB_VERSION ||
+        header->opaque_format != PIXEL_FORMAT ||
+        header->count > (st.st_size - sizeof(ResBlobHeader)) / sizeof(ResBlobEntry)) {
+        fprintf(stderr, "ignoring %s\n", RES_BLOB_PATH);
+        munmap(data, st.st_size);
+        return;
+    }
+    res_blob = data;
+    res_blob_size = st.st_size;
+}
+
+static int res_compare_entry(const void* name, const void* entry) {
+    return strncmp((const char*) name, ((const ResBlobEntry*) entry)->name,
+                   RES_NAME_MAX);
+}
+
+// Make a surface for the named image from the packed images, without
+// copying its pixels.  Returns 0 if no error, else negative.
+static int res_surface_from_blob(const char* name, gr_surface* pSurface) {
+    res_map_blob();
+    if (res_blob == NULL) return -1;
+
+    const ResBlobHeader* header = (const ResBlobHeader*) res_blob;
+    const ResBlobEntry* entry = bsearch(name, header + 1, header->count,
+                                        sizeof(ResBlobEntry), res_compare_entry);
+    if (entry == NULL) return -1;
+
+    size_t size = (size_t) entry->stride * entry->height *
+            res_format_size(entry->format);
+    if (entry->offset > res_blob_size || size > res_blob_size - entry->offset) {
+        return -1;
+    }
+
+    GGLSurface* surface = malloc(sizeof(GGLSurface));
+    if (surface == NULL) return -8;
+    surface->version = sizeof(GGLSurface);
+    surface->width = entry->width;
+    surface->height = entry->height;
+    surface->stride = entry->stride;
+    surface->data = (GGLubyte*) (res_blob + entry->offset);
+    surface->format = entry->format;
+    *pSurface = (gr_surface) surface;
+    return 0;
+}
+
+int res_create_surface(const char* name, gr_surface* pSurface) {
+    char resPath[256];
+
+    if (res_surface_from_blob(name, pSurface) == 0) {
+        return 0;
+    }
+
+    snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
+    resPath[sizeof(resPath)-1] = '\0';
+    return res_decode_png(resPath, pSurface);
+}
+
+// Surfaces from the packed images only own the GGLSurface; the pixels
+// stay mapped.  Either way a single free() releases everything.
 void res_free_surface(gr_surface surface) {
     GGLSurface* pSurface = (GGLSurface*) surface;
     if (pSurface) {
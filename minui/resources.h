@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_RESOURCES_H_
+#define _MINUI_RESOURCES_H_
+
+#include <stdint.h>
+
+#include "minui.h"
+
+// Images decoded ahead of time, in the form res_create_surface() would
+// produce, packed into one file that is mapped rather than read:
+//
+//   ResBlobHeader
+//   ResBlobEntry[count], sorted by name
+//   pixel data, each image starting on a RES_BLOB_ALIGN boundary
+//
+// All fields are in the target's byte order.
+#define RES_BLOB_PATH    "/res/images.dat"
+#define RES_BLOB_MAGIC   "MINUIRES"
+#define RES_BLOB_VERSION 1
+#define RES_BLOB_ALIGN   16
+#define RES_NAME_MAX     64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t opaque_format;   // PIXEL_FORMAT the packer was built for
+    uint32_t count;
+} ResBlobHeader;
+
+typedef struct {
+    char name[RES_NAME_MAX];  // file name without ".png"
+    uint32_t format;          // GGL_PIXEL_FORMAT_*
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;          // in pixels
+    uint32_t offset;          // of the pixels, from the start of the file
+} ResBlobEntry;
+
+// Bytes per pixel of the formats res_decode_png() produces.
+int res_format_size(int format);
+
+// Decode the PNG at "path" into a new surface.  Images without alpha
+// are converted to the framebuffer's pixel format, so drawing them
+// needs no conversion.  Returns 0 if no error, else negative.
+int res_decode_png(const char* path, gr_surface* pSurface);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times filling the screen with text, the way the recovery log view
+// redraws it, with and without flipping to the framebuffer.  Run it
+// from a shell with recovery stopped:
+//
+//   minui_text_bench [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "minui.h"
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void draw_screen(const char* line, int rows, int char_height) {
+    int row;
+    gr_color(0, 0, 0, 255);
+    gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+    gr_color(150, 150, 150, 255);
+    for (row = 0; row < rows; ++row) {
+        gr_text(0, (row+1)*char_height-1, line);
+    }
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+    int char_width, char_height;
+    int i;
+
+    if (gr_init() < 0) {
+        fprintf(stderr, "can't open the framebuffer\n");
+        return 1;
+    }
+    gr_font_size(&char_width, &char_height);
+
+    int cols = gr_fb_width() / char_width;
+    int rows = gr_fb_height() / char_height;
+    char* line = malloc(cols + 1);
+    for (i = 0; i < cols; ++i) {
+        line[i] = 33 + (i % 94);
+    }
+    line[cols] = '\0';
+
+    double start = now();
+    for (i = 0; i < rounds; ++i) {
+        draw_screen(line, rows, char_height);
+    }
+    double draw = (now() - start) / rounds;
+
+    start = now();
+    for (i = 0; i < rounds; ++i) {
+        draw_screen(line, rows, char_height);
+        gr_flip();
+    }
+    double flip = (now() - start) / rounds;
+
+    printf("%d x %d characters: draw %.2f ms (%.1f M chars/s), "
+           "draw + flip %.2f ms\n",
+           cols, rows, draw * 1000, cols * rows / draw / 1e6, flip * 1000);
+
+    free(line);
+    gr_exit();
+    return 0;
+}
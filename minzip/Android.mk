@@ -2,6 +2,7 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+	Crc32.c \
 	Hash.c \
 	SysUtil.c \
 	DirUtil.c \
@@ -19,3 +20,35 @@ LOCAL_MODULE := libminzip
 LOCAL_CFLAGS += -Wall
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := Crc32Bench.c
+
+LOCAL_C_INCLUDES := \
+	external/zlib
+
+LOCAL_STATIC_LIBRARIES := libminzip libz libselinux
+
+LOCAL_MODULE := minzip_crc32_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := HashBench.c
+
+LOCAL_C_INCLUDES := \
+	external/zlib
+
+LOCAL_STATIC_LIBRARIES := libminzip libz libselinux
+
+LOCAL_MODULE := minzip_hash_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * CRC-32 with the Zip polynomial, using the CPU's CRC or carry-less
+ * multiply instructions where it has them.
+ */
+#include "zlib.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "Crc32.h"
+
+static unsigned long crc32Table(unsigned long crc, const unsigned char* buf,
+        size_t len)
+{
+    /* zlib's crc32() takes a uInt length */
+    while (len > 0) {
+        uInt n = len > 0x40000000 ? 0x40000000 : (uInt)len;
+        crc = crc32(crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+    return crc;
+}
+
+#if defined(__aarch64__)
+
+/*
+ * ARMv8 CRC32 instructions (optional in ARMv8.0, present on nearly
+ * every core).  They are written as inline assembly so the rest of the
+ * library needn't be built for a CPU that has them.  32-bit ARM builds
+ * use the table: the ARMv7 cores they target have no CRC instructions,
+ * and their toolchains and headers predate HWCAP2.
+ */
+#define CRC_ARCH ".arch_extension crc\n\t"
+#define HAS_CRC32_INSN() ((getauxval(AT_HWCAP) & (1 << 7)) != 0)    /* HWCAP_CRC32 */
+
+static inline uint32_t crc32Byte(uint32_t crc, uint8_t b)
+{
+    __asm__(CRC_ARCH "crc32b %w0, %w0, %w1" : "+r"(crc) : "r"(b));
+    return crc;
+}
+
+static inline uint32_t crc32Word(uint32_t crc, uint32_t w)
+{
+    __asm__(CRC_ARCH "crc32w %w0, %w0, %w1" : "+r"(crc) : "r"(w));
+    return crc;
+}
+
+static unsigned long crc32Armv8(unsigned long crc, const unsigned char* buf,
+        size_t len)
+{
+    uint32_t c = ~(uint32_t)crc;
+
+    while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+        c = crc32Byte(c, *buf++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t d;
+        memcpy(&d, buf, sizeof(d));
+        __asm__(CRC_ARCH "crc32x %w0, %w0, %x1" : "+r"(c) : "r"(d));
+        buf += 8;
+        len -= 8;
+    }
+    while (len >= 4) {
+        uint32_t w;
+        memcpy(&w, buf, sizeof(w));
+        c = crc32Word(c, w);
+        buf += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        c = crc32Byte(c, *buf++);
+        len--;
+    }
+    return ~c;
+}
+
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+
+/*
+ * Carry-less multiply folding, after Gopal et al., "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+ * (Intel, 2009).  The constants are the bit-reflected ones for the
+ * Zip polynomial from the end of that paper.
+ *
+ * Takes and returns the CRC without zlib's pre- and post-inversion.
+ * len must be a multiple of 16, and at least 64.
+ */
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32FoldPclmul(uint32_t crc, const unsigned char* buf,
+        size_t len)
+{
+    static const uint64_t __attribute__((aligned(16))) k1k2[] =
+            { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] =
+            { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] =
+            { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] =
+            { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    /* Four 128-bit accumulators, the first seeded with the CRC. */
+    x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* Fold 64 bytes at a time into the accumulators. */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    /* Fold the four accumulators into one. */
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* Fold in whatever 16-byte blocks are left. */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    /* Reduce 128 bits to 64... */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* ...and Barrett-reduce to 32. */
+    x0 = _mm_load_si128((const __m128i*)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static unsigned long crc32Pclmul(unsigned long crc, const unsigned char* buf,
+        size_t len)
+{
+    if (len >= 64) {
+        size_t n = len & ~(size_t)15;
+        crc = ~crc32FoldPclmul(~(uint32_t)crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+    return crc32Table(crc, buf, len);
+}
+
+static int hasPclmul(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSE4_1) != 0;
+}
+
+#endif
+
+static MzCrc32Impl gImpls[3];
+static int gNumImpls;
+static pthread_once_t gImplsOnce = PTHREAD_ONCE_INIT;
+
+static void findImplementations(void)
+{
+    int n = 0;
+#if defined(__aarch64__)
+    if (HAS_CRC32_INSN()) {
+        gImpls[n].name = "armv8";
+        gImpls[n].update = crc32Armv8;
+        n++;
+    }
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+    if (hasPclmul()) {
+        gImpls[n].name = "pclmul";
+        gImpls[n].update = crc32Pclmul;
+        n++;
+    }
+#endif
+    gImpls[n].name = "table";
+    gImpls[n].update = crc32Table;
+    n++;
+    gNumImpls = n;
+}
+
+int mzCrc32Implementations(const MzCrc32Impl** impls)
+{
+    pthread_once(&gImplsOnce, findImplementations);
+    *impls = gImpls;
+    return gNumImpls;
+}
+
+unsigned long mzCrc32(unsigned long crc, const unsigned char* buf,
+        size_t len)
+{
+    pthread_once(&gImplsOnce, findImplementations);
+    return gImpls[0].update(crc, buf, len);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * CRC-32 with the Zip polynomial, using the CPU's CRC or carry-less
+ * multiply instructions where it has them.
+ */
+#ifndef _MINZIP_CRC32
+#define _MINZIP_CRC32
+
+#include <stddef.h>
+
+/*
+ * One way of computing the CRC.  "update" has the same contract as
+ * zlib's crc32(): start from 0 and pass the previous result back in.
+ */
+typedef struct {
+    const char* name;
+    unsigned long (*update)(unsigned long crc, const unsigned char* buf,
+            size_t len);
+} MzCrc32Impl;
+
+/*
+ * Update "crc" with "len" bytes of "buf", using the fastest
+ * implementation this CPU supports.
+ */
+unsigned long mzCrc32(unsigned long crc, const unsigned char* buf,
+        size_t len);
+
+/*
+ * Get the implementations this CPU supports, fastest first.  The last
+ * is always zlib's table-driven one.  Returns the number of entries.
+ */
+int mzCrc32Implementations(const MzCrc32Impl** impls);
+
+#endif /*_MINZIP_CRC32*/
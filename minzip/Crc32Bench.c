@@ -0,0 +1,95 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Compares the CRC-32 implementations this CPU supports and, given a
+ * package, times a whole-package integrity check with the fastest.
+ *
+ *   minzip_crc32_bench [package.zip]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Crc32.h"
+#include "Zip.h"
+
+#define BENCH_BUFFER_SIZE (16 * 1024 * 1024)
+#define BENCH_ROUNDS 16
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int benchPackage(const char* path)
+{
+    ZipArchive za;
+    if (mzOpenZipArchive(path, &za) != 0) {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+
+    unsigned int i, bad = 0;
+    double bytes = 0;
+    double start = now();
+    for (i = 0; i < mzZipEntryCount(&za); i++) {
+        const ZipEntry* pEntry = mzGetZipEntryAt(&za, i);
+        if (!mzIsZipEntryIntact(&za, pEntry)) {
+            bad++;
+        }
+        bytes += mzGetZipEntryUncompLen(pEntry);
+    }
+    double elapsed = now() - start;
+    printf("%s: %u entries, %.1f MB checked in %.3f s (%.1f MB/s), %u bad\n",
+            path, mzZipEntryCount(&za), bytes / 1e6, elapsed,
+            bytes / 1e6 / elapsed, bad);
+    mzCloseZipArchive(&za);
+    return bad != 0;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned char* buf = malloc(BENCH_BUFFER_SIZE);
+    if (buf == NULL) {
+        return 1;
+    }
+    srand(1);
+    size_t i;
+    for (i = 0; i < BENCH_BUFFER_SIZE; i++) {
+        buf[i] = rand();
+    }
+
+    const MzCrc32Impl* impls;
+    int numImpls = mzCrc32Implementations(&impls);
+    const MzCrc32Impl* table = &impls[numImpls - 1];
+    unsigned long expected = table->update(0, buf, BENCH_BUFFER_SIZE);
+
+    int n, result = 0;
+    for (n = 0; n < numImpls; n++) {
+        /* check an unaligned, odd-length run too */
+        if (impls[n].update(0, buf, BENCH_BUFFER_SIZE) != expected ||
+            impls[n].update(0, buf + 3, 1001) != table->update(0, buf + 3, 1001)) {
+            printf("%-8s WRONG RESULT\n", impls[n].name);
+            result = 1;
+            continue;
+        }
+
+        int round;
+        unsigned long crc = 0;
+        double start = now();
+        for (round = 0; round < BENCH_ROUNDS; round++) {
+            crc = impls[n].update(crc, buf, BENCH_BUFFER_SIZE);
+        }
+        double elapsed = now() - start;
+        printf("%-8s %8.1f MB/s\n", impls[n].name,
+                (double)BENCH_BUFFER_SIZE * BENCH_ROUNDS / 1e6 / elapsed);
+    }
+    free(buf);
+
+    if (argc > 1) {
+        result |= benchPackage(argv[1]);
+    }
+    return result;
+}
@@ -2,10 +2,19 @@
  * Copyright 2006 The Android Open Source Project
  *
  * Hash table.  The dominant calls are add and lookup, with removals
- * happening very infrequently.  We use probing, and don't worry much
- * about tombstone removal.
+ * happening very infrequently.
+ *
+ * This is an open-addressed table in the style of Abseil's "Swiss
+ * tables".  Next to the entries is an array of control bytes, one per
+ * slot.  A live slot holds the low 7 bits of its (mixed) hash; an unused
+ * one holds CTRL_EMPTY or CTRL_DELETED.  Slots are probed a group at a
+ * time: one vector compare of the group's control bytes finds the slots
+ * that might hold the item, and only those are passed to the compare
+ * function.  A lookup stops at the first group with an empty slot.
  */
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #define LOG_TAG "minzip"
@@ -13,12 +22,143 @@
 #include "Hash.h"
 
 /* table load factor, i.e. how full can it get before we resize */
-//#define LOAD_NUMER  3       // 75%
-//#define LOAD_DENOM  4
-#define LOAD_NUMER  5       // 62.5%
+#define LOAD_NUMER  7       // 87.5%
 #define LOAD_DENOM  8
-//#define LOAD_NUMER  1       // 50%
-//#define LOAD_DENOM  2
+
+#define CTRL_EMPTY      0x80
+#define CTRL_DELETED    0xfe
+
+/*
+ * Group operations.  Each returns a mask with a bit set for every
+ * matching slot in the group; the slot's index within the group is
+ * the bit number >> GROUP_SHIFT.  Groups are aligned, so a group never
+ * wraps around the end of the table.
+ */
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define GROUP_WIDTH 16
+#define GROUP_SHIFT 0
+typedef uint32_t GroupMask;
+
+static inline GroupMask groupMatch(const unsigned char* ctrl, unsigned char h2)
+{
+    __m128i group = _mm_loadu_si128((const __m128i*) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h2)));
+}
+
+static inline GroupMask groupMatchEmpty(const unsigned char* ctrl)
+{
+    return groupMatch(ctrl, CTRL_EMPTY);
+}
+
+/* empty or deleted: the only control bytes with the top bit set */
+static inline GroupMask groupMatchFree(const unsigned char* ctrl)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) ctrl));
+}
+
+#else
+
+/*
+ * Eight control bytes in a 64-bit word, matching in the top bit of each
+ * byte.  This assumes a little-endian CPU, so that slot i is byte i.
+ */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define GROUP_WIDTH 8
+#define GROUP_SHIFT 3
+typedef uint64_t GroupMask;
+
+#define GROUP_LSBS  0x0101010101010101ULL
+#define GROUP_MSBS  0x8080808080808080ULL
+
+static inline uint64_t groupLoad(const unsigned char* ctrl)
+{
+    uint64_t group;
+    memcpy(&group, ctrl, sizeof(group));
+    return group;
+}
+
+static inline GroupMask groupMatch(const unsigned char* ctrl, unsigned char h2)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x8_t eq = vceq_u8(vld1_u8(ctrl), vdup_n_u8(h2));
+    return vget_lane_u64(vreinterpret_u64_u8(eq), 0) & GROUP_MSBS;
+#else
+    /*
+     * Finds every zero byte of x, but may also flag a byte just above a
+     * zero one.  That only costs a wasted compare, because the caller
+     * checks the full hash value.
+     */
+    uint64_t x = groupLoad(ctrl) ^ (GROUP_LSBS * h2);
+    return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+#endif
+}
+
+/* CTRL_EMPTY is the only control byte with bit 7 set and bit 1 clear */
+static inline GroupMask groupMatchEmpty(const unsigned char* ctrl)
+{
+    uint64_t group = groupLoad(ctrl);
+    return group & ~(group << 6) & GROUP_MSBS;
+}
+
+static inline GroupMask groupMatchFree(const unsigned char* ctrl)
+{
+    return groupLoad(ctrl) & GROUP_MSBS;
+}
+
+#endif
+
+#define MASK_SLOT(mask) (__builtin_ctzll(mask) >> GROUP_SHIFT)
+
+/*
+ * Spread the caller's hash over all 32 bits (the first steps of
+ * MurmurHash3's finalizer).  Callers' hashes tend to be weak in some
+ * bits, and we use the low 7 for the control byte and the rest to pick
+ * the first group.
+ */
+static inline unsigned int mixHash(unsigned int itemHash)
+{
+    itemHash ^= itemHash >> 16;
+    itemHash *= 0x85ebca6bU;
+    itemHash ^= itemHash >> 13;
+    return itemHash;
+}
+#define HASH_H1(mixed)  ((mixed) >> 7)
+#define HASH_H2(mixed)  ((unsigned char) ((mixed) & 0x7f))
+
+/*
+ * Step through the groups: the first is picked by the hash, the rest by
+ * triangular numbers, which visit every group of a power-of-2 table.
+ */
+typedef struct ProbeSeq {
+    int         group;
+    int         step;
+    int         groupMask;
+} ProbeSeq;
+
+static inline void probeBegin(ProbeSeq* pSeq, const HashTable* pHashTable,
+    unsigned int mixed)
+{
+    pSeq->groupMask = pHashTable->tableSize / GROUP_WIDTH - 1;
+    pSeq->group = HASH_H1(mixed) & pSeq->groupMask;
+    pSeq->step = 0;
+}
+
+static inline void probeNext(ProbeSeq* pSeq)
+{
+    pSeq->step++;
+    pSeq->group = (pSeq->group + pSeq->step) & pSeq->groupMask;
+}
+
+static inline int growthLimit(int tableSize)
+{
+    return (tableSize / LOAD_DENOM) * LOAD_NUMER;
+}
 
 /*
  * Compute the capacity needed for a table to hold "size" elements.
@@ -45,6 +185,23 @@ unsigned int roundUpPower2(unsigned int val)
     return val;
 }
 
+/*
+ * Allocate empty storage for "tableSize" slots.
+ */
+static bool allocSlots(int tableSize, unsigned char** pCtrl,
+    HashEntry** pEntries)
+{
+    *pCtrl = (unsigned char*) malloc(tableSize);
+    *pEntries = (HashEntry*) calloc(tableSize, sizeof(HashEntry));
+    if (*pCtrl == NULL || *pEntries == NULL) {
+        free(*pCtrl);
+        free(*pEntries);
+        return false;
+    }
+    memset(*pCtrl, CTRL_EMPTY, tableSize);
+    return true;
+}
+
 /*
  * Create and initialize a hash table.
  */
@@ -59,11 +216,14 @@ HashTable* mzHashTableCreate(size_t initialSize, HashFreeFunc freeFunc)
         return NULL;
 
     pHashTable->tableSize = roundUpPower2(initialSize);
+    if (pHashTable->tableSize < GROUP_WIDTH)
+        pHashTable->tableSize = GROUP_WIDTH;
     pHashTable->numEntries = pHashTable->numDeadEntries = 0;
+    pHashTable->growthLeft = growthLimit(pHashTable->tableSize);
     pHashTable->freeFunc = freeFunc;
-    pHashTable->pEntries =
-        (HashEntry*) calloc((size_t)pHashTable->tableSize, sizeof(HashTable));
-    if (pHashTable->pEntries == NULL) {
+    if (!allocSlots(pHashTable->tableSize, &pHashTable->ctrl,
+            &pHashTable->pEntries))
+    {
         free(pHashTable);
         return NULL;
     }
@@ -81,19 +241,18 @@ void mzHashTableClear(HashTable* pHashTable)
 
     pEnt = pHashTable->pEntries;
     for (i = 0; i < pHashTable->tableSize; i++, pEnt++) {
-        if (pEnt->data == HASH_TOMBSTONE) {
-            // nuke entry
-            pEnt->data = NULL;
-        } else if (pEnt->data != NULL) {
+        if (pEnt->data != NULL) {
             // call free func then nuke entry
             if (pHashTable->freeFunc != NULL)
                 (*pHashTable->freeFunc)(pEnt->data);
             pEnt->data = NULL;
         }
     }
+    memset(pHashTable->ctrl, CTRL_EMPTY, pHashTable->tableSize);
 
     pHashTable->numEntries = 0;
     pHashTable->numDeadEntries = 0;
+    pHashTable->growthLeft = growthLimit(pHashTable->tableSize);
 }
 
 /*
@@ -104,29 +263,31 @@ void mzHashTableFree(HashTable* pHashTable)
     if (pHashTable == NULL)
         return;
     mzHashTableClear(pHashTable);
+    free(pHashTable->ctrl);
     free(pHashTable->pEntries);
     free(pHashTable);
 }
 
-#ifndef NDEBUG
 /*
- * Count up the number of tombstone entries in the hash table.
+ * Find the first unused slot for an item whose mixed hash is "mixed".
  */
-static int countTombStones(HashTable* pHashTable)
+static int findFreeSlot(const HashTable* pHashTable, unsigned int mixed)
 {
-    int i, count;
+    ProbeSeq seq;
 
-    for (count = i = 0; i < pHashTable->tableSize; i++) {
-        if (pHashTable->pEntries[i].data == HASH_TOMBSTONE)
-            count++;
+    for (probeBegin(&seq, pHashTable, mixed); ; probeNext(&seq)) {
+        int base = seq.group * GROUP_WIDTH;
+        GroupMask mask = groupMatchFree(pHashTable->ctrl + base);
+        if (mask != 0)
+            return base + MASK_SLOT(mask);
     }
-    return count;
 }
-#endif
 
 /*
- * Resize a hash table.  We do this when adding an entry increased the
- * size of the table beyond its comfy limit.
+ * Resize a hash table.  We do this when adding an entry used up the
+ * last of the empty slots we allow.  If most of those went to entries
+ * that have since been removed, we just rebuild at the same size to
+ * clear out the deleted slots.
  *
  * This essentially requires re-inserting all elements into the new storage.
  *
@@ -134,117 +295,120 @@ static int countTombStones(HashTable* pHashTable)
  * have been grabbed before issuing the "lookup+add" call that led to the
  * resize, so we don't have a synchronization problem here.
  */
-static bool resizeHash(HashTable* pHashTable, int newSize)
+static bool resizeHash(HashTable* pHashTable)
 {
-    HashEntry* pNewEntries;
+    unsigned char* pOldCtrl = pHashTable->ctrl;
+    HashEntry* pOldEntries = pHashTable->pEntries;
+    int oldSize = pHashTable->tableSize;
+    int newSize = oldSize;
     int i;
 
-    assert(countTombStones(pHashTable) == pHashTable->numDeadEntries);
-    //LOGI("before: dead=%d\n", pHashTable->numDeadEntries);
+    if (pHashTable->numEntries > growthLimit(oldSize) / 2)
+        newSize = oldSize * 2;
 
-    pNewEntries = (HashEntry*) calloc(newSize, sizeof(HashTable));
-    if (pNewEntries == NULL)
+    if (!allocSlots(newSize, &pHashTable->ctrl, &pHashTable->pEntries)) {
+        pHashTable->ctrl = pOldCtrl;
+        pHashTable->pEntries = pOldEntries;
         return false;
+    }
+    pHashTable->tableSize = newSize;
 
-    for (i = 0; i < pHashTable->tableSize; i++) {
-        void* data = pHashTable->pEntries[i].data;
-        if (data != NULL && data != HASH_TOMBSTONE) {
-            int hashValue = pHashTable->pEntries[i].hashValue;
-            int newIdx;
-
-            /* probe for new spot, wrapping around */
-            newIdx = hashValue & (newSize-1);
-            while (pNewEntries[newIdx].data != NULL)
-                newIdx = (newIdx + 1) & (newSize-1);
-
-            pNewEntries[newIdx].hashValue = hashValue;
-            pNewEntries[newIdx].data = data;
+    for (i = 0; i < oldSize; i++) {
+        if (pOldEntries[i].data != NULL) {
+            unsigned int mixed = mixHash(pOldEntries[i].hashValue);
+            int newIdx = findFreeSlot(pHashTable, mixed);
+
+            pHashTable->ctrl[newIdx] = HASH_H2(mixed);
+            pHashTable->pEntries[newIdx] = pOldEntries[i];
         }
     }
 
-    free(pHashTable->pEntries);
-    pHashTable->pEntries = pNewEntries;
-    pHashTable->tableSize = newSize;
+    free(pOldCtrl);
+    free(pOldEntries);
     pHashTable->numDeadEntries = 0;
+    pHashTable->growthLeft = growthLimit(newSize) - pHashTable->numEntries;
 
-    assert(countTombStones(pHashTable) == 0);
     return true;
 }
 
+/*
+ * Find the slot holding "item", or return -1.  If "pGroups" isn't NULL,
+ * it's set to the number of groups probed past the first.
+ */
+static int findSlot(const HashTable* pHashTable, unsigned int itemHash,
+    const void* item, HashCompareFunc cmpFunc, int* pGroups)
+{
+    unsigned int mixed = mixHash(itemHash);
+    unsigned char h2 = HASH_H2(mixed);
+    ProbeSeq seq;
+
+    for (probeBegin(&seq, pHashTable, mixed); ; probeNext(&seq)) {
+        int base = seq.group * GROUP_WIDTH;
+        const unsigned char* ctrl = pHashTable->ctrl + base;
+        GroupMask mask;
+
+        if (pGroups != NULL)
+            *pGroups = seq.step;
+        for (mask = groupMatch(ctrl, h2); mask != 0; mask &= mask - 1) {
+            HashEntry* pEntry = &pHashTable->pEntries[base + MASK_SLOT(mask)];
+            if (pEntry->data != NULL &&
+                pEntry->hashValue == itemHash &&
+                (*cmpFunc)(pEntry->data, item) == 0)
+            {
+                return pEntry - pHashTable->pEntries;
+            }
+        }
+        if (groupMatchEmpty(ctrl) != 0)
+            return -1;
+    }
+}
+
 /*
  * Look up an entry.
- *
- * We probe on collisions, wrapping around the table.
  */
 void* mzHashTableLookup(HashTable* pHashTable, unsigned int itemHash, void* item,
     HashCompareFunc cmpFunc, bool doAdd)
 {
-    HashEntry* pEntry;
-    HashEntry* pEnd;
-    void* result = NULL;
+    unsigned int mixed;
+    int idx;
 
     assert(pHashTable->tableSize > 0);
-    assert(item != HASH_TOMBSTONE);
     assert(item != NULL);
 
-    /* jump to the first entry and probe for a match */
-    pEntry = &pHashTable->pEntries[itemHash & (pHashTable->tableSize-1)];
-    pEnd = &pHashTable->pEntries[pHashTable->tableSize];
-    while (pEntry->data != NULL) {
-        if (pEntry->data != HASH_TOMBSTONE &&
-            pEntry->hashValue == itemHash &&
-            (*cmpFunc)(pEntry->data, item) == 0)
-        {
-            /* match */
-            //LOGD("+++ match on entry %d\n", pEntry - pHashTable->pEntries);
-            break;
-        }
-
-        pEntry++;
-        if (pEntry == pEnd) {     /* wrap around to start */
-            if (pHashTable->tableSize == 1)
-                break;      /* edge case - single-entry table */
-            pEntry = pHashTable->pEntries;
-        }
+    idx = findSlot(pHashTable, itemHash, item, cmpFunc, NULL);
+    if (idx >= 0)
+        return pHashTable->pEntries[idx].data;
+    if (!doAdd)
+        return NULL;
 
-        //LOGI("+++ look probing %d...\n", pEntry - pHashTable->pEntries);
+    /*
+     * Take the first free slot on the item's probe sequence.  Reusing a
+     * deleted slot doesn't use up any of the table's room to grow.
+     */
+    mixed = mixHash(itemHash);
+    idx = findFreeSlot(pHashTable, mixed);
+    if (pHashTable->ctrl[idx] == CTRL_DELETED) {
+        pHashTable->numDeadEntries--;
+    } else {
+        pHashTable->growthLeft--;
     }
-
-    if (pEntry->data == NULL) {
-        if (doAdd) {
-            pEntry->hashValue = itemHash;
-            pEntry->data = item;
-            pHashTable->numEntries++;
-
-            /*
-             * We've added an entry.  See if this brings us too close to full.
-             */
-            if ((pHashTable->numEntries+pHashTable->numDeadEntries) * LOAD_DENOM
-                > pHashTable->tableSize * LOAD_NUMER)
-            {
-                if (!resizeHash(pHashTable, pHashTable->tableSize * 2)) {
-                    /* don't really have a way to indicate failure */
-                    LOGE("Dalvik hash resize failure\n");
-                    abort();
-                }
-                /* note "pEntry" is now invalid */
-            } else {
-                //LOGW("okay %d/%d/%d\n",
-                //    pHashTable->numEntries, pHashTable->tableSize,
-                //    (pHashTable->tableSize * LOAD_NUMER) / LOAD_DENOM);
-            }
-
-            /* full table is bad -- search for nonexistent never halts */
-            assert(pHashTable->numEntries < pHashTable->tableSize);
-            result = item;
-        } else {
-            assert(result == NULL);
+    pHashTable->ctrl[idx] = HASH_H2(mixed);
+    pHashTable->pEntries[idx].hashValue = itemHash;
+    pHashTable->pEntries[idx].data = item;
+    pHashTable->numEntries++;
+
+    /*
+     * We've added an entry.  See if this brings us too close to full.
+     */
+    if (pHashTable->growthLeft == 0) {
+        if (!resizeHash(pHashTable)) {
+            /* don't really have a way to indicate failure */
+            LOGE("Dalvik hash resize failure\n");
+            abort();
         }
-    } else {
-        result = pEntry->data;
     }
 
-    return result;
+    return item;
 }
 
 /*
@@ -254,34 +418,42 @@ void* mzHashTableLookup(HashTable* pHashTable, unsigned int itemHash, void* item
  */
 bool mzHashTableRemove(HashTable* pHashTable, unsigned int itemHash, void* item)
 {
-    HashEntry* pEntry;
-    HashEntry* pEnd;
+    unsigned int mixed = mixHash(itemHash);
+    ProbeSeq seq;
 
     assert(pHashTable->tableSize > 0);
 
-    /* jump to the first entry and probe for a match */
-    pEntry = &pHashTable->pEntries[itemHash & (pHashTable->tableSize-1)];
-    pEnd = &pHashTable->pEntries[pHashTable->tableSize];
-    while (pEntry->data != NULL) {
-        if (pEntry->data == item) {
-            //LOGI("+++ stepping on entry %d\n", pEntry - pHashTable->pEntries);
-            pEntry->data = HASH_TOMBSTONE;
+    for (probeBegin(&seq, pHashTable, mixed); ; probeNext(&seq)) {
+        int base = seq.group * GROUP_WIDTH;
+        unsigned char* ctrl = pHashTable->ctrl + base;
+        GroupMask mask;
+
+        for (mask = groupMatch(ctrl, HASH_H2(mixed)); mask != 0;
+            mask &= mask - 1)
+        {
+            int i = MASK_SLOT(mask);
+            if (pHashTable->pEntries[base + i].data != item)
+                continue;
+
+            /*
+             * If the group still has an empty slot, no lookup has ever
+             * gone past it, so this slot can go back to being empty.
+             * Otherwise it has to stay marked so probing continues.
+             */
+            pHashTable->pEntries[base + i].data = NULL;
             pHashTable->numEntries--;
-            pHashTable->numDeadEntries++;
+            if (groupMatchEmpty(ctrl) != 0) {
+                ctrl[i] = CTRL_EMPTY;
+                pHashTable->growthLeft++;
+            } else {
+                ctrl[i] = CTRL_DELETED;
+                pHashTable->numDeadEntries++;
+            }
             return true;
         }
-
-        pEntry++;
-        if (pEntry == pEnd) {     /* wrap around to start */
-            if (pHashTable->tableSize == 1)
-                break;      /* edge case - single-entry table */
-            pEntry = pHashTable->pEntries;
-        }
-
-        //LOGI("+++ del probing %d...\n", pEntry - pHashTable->pEntries);
+        if (groupMatchEmpty(ctrl) != 0)
+            return false;
     }
-
-    return false;
 }
 
 /*
@@ -296,7 +468,7 @@ int mzHashForeach(HashTable* pHashTable, HashForeachFunc func, void* arg)
     for (i = 0; i < pHashTable->tableSize; i++) {
         HashEntry* pEnt = &pHashTable->pEntries[i];
 
-        if (pEnt->data != NULL && pEnt->data != HASH_TOMBSTONE) {
+        if (pEnt->data != NULL) {
             val = (*func)(pEnt->data, arg);
             if (val != 0)
                 return val;
@@ -308,43 +480,20 @@ int mzHashForeach(HashTable* pHashTable, HashForeachFunc func, void* arg)
 
 
 /*
- * Look up an entry, counting the number of times we have to probe.
+ * Look up an entry, counting the number of groups we have to probe past
+ * the first.
  *
  * Returns -1 if the entry wasn't found.
  */
 int countProbes(HashTable* pHashTable, unsigned int itemHash, const void* item,
     HashCompareFunc cmpFunc)
 {
-    HashEntry* pEntry;
-    HashEntry* pEnd;
-    int count = 0;
+    int count;
 
     assert(pHashTable->tableSize > 0);
-    assert(item != HASH_TOMBSTONE);
     assert(item != NULL);
 
-    /* jump to the first entry and probe for a match */
-    pEntry = &pHashTable->pEntries[itemHash & (pHashTable->tableSize-1)];
-    pEnd = &pHashTable->pEntries[pHashTable->tableSize];
-    while (pEntry->data != NULL) {
-        if (pEntry->data != HASH_TOMBSTONE &&
-            pEntry->hashValue == itemHash &&
-            (*cmpFunc)(pEntry->data, item) == 0)
-        {
-            /* match */
-            break;
-        }
-
-        pEntry++;
-        if (pEntry == pEnd) {     /* wrap around to start */
-            if (pHashTable->tableSize == 1)
-                break;      /* edge case - single-entry table */
-            pEntry = pHashTable->pEntries;
-        }
-
-        count++;
-    }
-    if (pEntry->data == NULL)
+    if (findSlot(pHashTable, itemHash, item, cmpFunc, &count) < 0)
         return -1;
 
     return count;
@@ -372,7 +521,7 @@ void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
     {
         const void* data = (const void*)mzHashIterData(&iter);
         int count;
-            
+
         count = countProbes(pHashTable, (*calcFunc)(data), data, cmpFunc);
 
         numEntries++;
@@ -384,7 +533,7 @@ void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
         totalProbe += count;
     }
 
-    LOGI("Probe: min=%d max=%d, total=%d in %d (%d), avg=%.3f\n",
+    LOGI("Probe: min=%d max=%d, total=%d in %d (%d, groups of %d), avg=%.3f\n",
         minProbe, maxProbe, totalProbe, numEntries, pHashTable->tableSize,
-        (float) totalProbe / (float) numEntries);
+        GROUP_WIDTH, (float) totalProbe / (float) numEntries);
 }
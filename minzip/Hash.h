@@ -3,7 +3,7 @@
  *
  * General purpose hash table, used for finding classes, methods, etc.
  *
- * When the number of elements reaches 3/4 of the table's capacity, the
+ * When the number of elements reaches 7/8 of the table's capacity, the
  * table will be resized.
  */
 #ifndef _MINZIP_HASH
@@ -38,11 +38,10 @@ typedef int (*HashForeachFunc)(void* data, void* arg);
 
 /*
  * One entry in the hash table.  "data" values are expected to be (or have
- * the same characteristics as) valid pointers.  In particular, a NULL
- * value for "data" indicates an empty slot, and HASH_TOMBSTONE indicates
- * a no-longer-used slot that must be stepped over during probing.
+ * the same characteristics as) valid pointers.  A NULL value for "data"
+ * indicates an unused slot.
  *
- * Attempting to add a NULL or tombstone value is an error.
+ * Attempting to add a NULL value is an error.
  *
  * When an entry is released, we will call (HashFreeFunc)(entry->data).
  */
@@ -51,17 +50,22 @@ typedef struct HashEntry {
     void* data;
 } HashEntry;
 
-#define HASH_TOMBSTONE ((void*) 0xcbcacccd)     // invalid ptr value
-
 /*
  * Expandable hash table.
  *
+ * Each slot has a control byte as well as an entry: 7 bits of the hash
+ * for a live slot, or an empty or deleted marker.  Lookups compare a
+ * group of control bytes at once and only look at the entries whose
+ * bits match.
+ *
  * This structure should be considered opaque.
  */
 typedef struct HashTable {
     int         tableSize;          /* must be power of 2 */
     int         numEntries;         /* current #of "live" entries */
-    int         numDeadEntries;     /* current #of tombstone entries */
+    int         numDeadEntries;     /* current #of deleted slots */
+    int         growthLeft;         /* adds left before we resize */
+    unsigned char* ctrl;            /* control bytes, one per slot */
     HashEntry*  pEntries;           /* array on heap */
     HashFreeFunc freeFunc;
 } HashTable;
@@ -105,7 +109,8 @@ INLINE int mzHashTableNumEntries(HashTable* pHashTable) {
  * Get total size of hash table (for memory usage calculations).
  */
 INLINE int mzHashTableMemUsage(HashTable* pHashTable) {
-    return sizeof(HashTable) + pHashTable->tableSize * sizeof(HashEntry);
+    return sizeof(HashTable) +
+        pHashTable->tableSize * (sizeof(HashEntry) + 1);
 }
 
 /*
@@ -153,8 +158,7 @@ INLINE void mzHashIterNext(HashIter* pIter) {
     int i = pIter->idx +1;
     int lim = pIter->pHashTable->tableSize;
     for ( ; i < lim; i++) {
-        void* data = pIter->pHashTable->pEntries[i].data;
-        if (data != NULL && data != HASH_TOMBSTONE)
+        if (pIter->pHashTable->pEntries[i].data != NULL)
             break;
     }
     pIter->idx = i;
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Times hash table lookups on a set of package-like names and prints
+ * the table's probe statistics.  Given a package, also times looking up
+ * each of its entries by name.
+ *
+ *   minzip_hash_bench [package.zip]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Hash.h"
+#include "Zip.h"
+
+#define BENCH_NAMES 100000
+#define BENCH_ROUNDS 10
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int hashName(const void* name)
+{
+    const unsigned char* p = (const unsigned char*) name;
+    unsigned int hash = 1;
+
+    while (*p != '\0')
+        hash = hash * 31 + *p++;
+    return hash;
+}
+
+static int cmpName(const void* tableItem, const void* looseItem)
+{
+    return strcmp((const char*) tableItem, (const char*) looseItem);
+}
+
+static int benchNames(void)
+{
+    char** names = (char**) malloc(BENCH_NAMES * sizeof(char*));
+    char miss[64];
+    int i, round, bad = 0;
+
+    if (names == NULL)
+        return 1;
+    for (i = 0; i < BENCH_NAMES; i++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "system/app/Package%d/lib/lib%d.so",
+                i / 16, i);
+        names[i] = strdup(buf);
+    }
+
+    HashTable* pHash = mzHashTableCreate(mzHashSize(BENCH_NAMES), NULL);
+    double start = now();
+    for (i = 0; i < BENCH_NAMES; i++) {
+        mzHashTableLookup(pHash, hashName(names[i]), names[i], cmpName, true);
+    }
+    double addTime = now() - start;
+
+    start = now();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < BENCH_NAMES; i++) {
+            if (mzHashTableLookup(pHash, hashName(names[i]), names[i],
+                    cmpName, false) != names[i])
+                bad++;
+        }
+    }
+    double hitTime = now() - start;
+
+    start = now();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < BENCH_NAMES; i++) {
+            snprintf(miss, sizeof(miss), "system/app/Missing%d", i);
+            if (mzHashTableLookup(pHash, hashName(miss), miss,
+                    cmpName, false) != NULL)
+                bad++;
+        }
+    }
+    double missTime = now() - start;
+
+    printf("%d names: add %.1f ns, hit %.1f ns, miss %.1f ns, %d bad\n",
+            BENCH_NAMES, addTime * 1e9 / BENCH_NAMES,
+            hitTime * 1e9 / BENCH_NAMES / BENCH_ROUNDS,
+            missTime * 1e9 / BENCH_NAMES / BENCH_ROUNDS, bad);
+    mzHashTableProbeCount(pHash, hashName, cmpName);
+
+    /* churn: removals shouldn't leave lookups any slower */
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = round & 1; i < BENCH_NAMES; i += 2) {
+            unsigned int hash = hashName(names[i]);
+            if (!mzHashTableRemove(pHash, hash, names[i]) ||
+                mzHashTableLookup(pHash, hash, names[i], cmpName, true)
+                    != names[i])
+                bad++;
+        }
+    }
+    printf("after churn: %d entries, %d deleted slots, %d bad\n",
+            mzHashTableNumEntries(pHash), pHash->numDeadEntries, bad);
+    mzHashTableProbeCount(pHash, hashName, cmpName);
+
+    mzHashTableFree(pHash);
+    for (i = 0; i < BENCH_NAMES; i++)
+        free(names[i]);
+    free(names);
+    return bad != 0;
+}
+
+static int benchPackage(const char* path)
+{
+    ZipArchive za;
+    if (mzOpenZipArchive(path, &za) != 0) {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+
+    unsigned int count = mzZipEntryCount(&za);
+    char** names = (char**) malloc(count * sizeof(char*));
+    unsigned int i;
+    int round, bad = 0;
+    for (i = 0; i < count; i++) {
+        const ZipEntry* pEntry = mzGetZipEntryAt(&za, i);
+        names[i] = strndup(pEntry->fileName, pEntry->fileNameLen);
+    }
+
+    /* the first lookup builds the table */
+    double start = now();
+    mzFindZipEntry(&za, "");
+    double buildTime = now() - start;
+
+    start = now();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < count; i++) {
+            if (mzFindZipEntry(&za, names[i]) == NULL)
+                bad++;
+        }
+    }
+    double findTime = now() - start;
+
+    printf("%s: %u entries, build %.3f ms, find %.1f ns, %d bad\n",
+            path, count, buildTime * 1e3,
+            findTime * 1e9 / count / BENCH_ROUNDS, bad);
+
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    mzCloseZipArchive(&za);
+    return bad != 0;
+}
+
+int main(int argc, char** argv)
+{
+    int result = benchNames();
+
+    if (argc > 1) {
+        result |= benchPackage(argv[1]);
+    }
+    return result;
+}
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -17,6 +18,7 @@
 #define LOG_TAG "minzip"
 #include "Zip.h"
 #include "Bits.h"
+#include "Crc32.h"
 #include "Log.h"
 #include "DirUtil.h"
 
@@ -25,6 +27,17 @@
 
 #define SORT_ENTRIES 1
 
+/*
+ * STORED entries are passed to process functions in blocks of at most
+ * this many bytes.
+ */
+#define STORED_BLOCK_SIZE (1024 * 1024)
+
+/*
+ * Upper limit on the number of threads MZ_EXTRACT_PARALLEL uses.
+ */
+#define MZ_EXTRACT_MAX_THREADS 8
+
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -143,6 +156,30 @@ static unsigned int computeHash(const char* name, int nameLen)
     return hash;
 }
 
+/*
+ * (This is a qsort callback.)
+ *
+ * Order ZipEntry structs by name, as a plain byte string with shorter
+ * names first among equal prefixes, so each directory's entries are
+ * contiguous.  Duplicate names keep their order in the file.
+ */
+static int sortcmpZipEntry(const void* ventry1, const void* ventry2)
+{
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    unsigned int len = entry1->fileNameLen < entry2->fileNameLen ?
+            entry1->fileNameLen : entry2->fileNameLen;
+    int diff = memcmp(entry1->fileName, entry2->fileName, len);
+
+    if (diff != 0)
+        return diff;
+    if (entry1->fileNameLen != entry2->fileNameLen)
+        return entry1->fileNameLen < entry2->fileNameLen ? -1 : 1;
+    if (entry1->offset != entry2->offset)
+        return entry1->offset < entry2->offset ? -1 : 1;
+    return 0;
+}
+
 static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
 {
     unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
@@ -180,7 +217,7 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * store it in pEntries, sorted by name.
  *
  * Returns "true" on success.
  */
@@ -241,8 +278,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
     ptr = pMap->addr + cdOffset;
@@ -275,58 +311,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -379,37 +364,19 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
 #if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
-     */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
-    }
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), sortcmpZipEntry);
 #endif
 
+    /* The hash table is built by the first mzFindZipEntry().
+     */
     result = true;
 
 bail:
-    if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
-    }
     return result;
 }
 
@@ -497,6 +464,39 @@ void mzCloseZipArchive(ZipArchive* pArchive)
     pArchive->pEntries = NULL;
 }
 
+/*
+ * Get the archive's name lookup table, building it on first use.  Many
+ * callers open a large package and look up only a few entries, or none,
+ * so mzOpenZipArchive() doesn't pay for this up front.
+ *
+ * Returns NULL if the table can't be allocated.
+ */
+static pthread_mutex_t gHashBuildLock = PTHREAD_MUTEX_INITIALIZER;
+
+static HashTable* getHashTable(ZipArchive* pArchive)
+{
+    HashTable* pHash = __atomic_load_n(&pArchive->pHash, __ATOMIC_ACQUIRE);
+    if (pHash != NULL)
+        return pHash;
+
+    pthread_mutex_lock(&gHashBuildLock);
+    pHash = pArchive->pHash;
+    if (pHash == NULL) {
+        pHash = mzHashTableCreate(mzHashSize(pArchive->numEntries), NULL);
+        if (pHash != NULL) {
+            unsigned int i;
+            for (i = 0; i < pArchive->numEntries; i++)
+                addEntryToHashTable(pHash, &pArchive->pEntries[i]);
+            __atomic_store_n(&pArchive->pHash, pHash, __ATOMIC_RELEASE);
+        } else {
+            LOGE("Can't allocate name table for %u entries\n",
+                pArchive->numEntries);
+        }
+    }
+    pthread_mutex_unlock(&gHashBuildLock);
+    return pHash;
+}
+
 /*
  * Find a matching entry.
  *
@@ -505,9 +505,13 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
+    HashTable* pHash = getHashTable((ZipArchive*) pArchive);
+    if (pHash == NULL)
+        return NULL;
+
     unsigned int itemHash = computeHash(entryName, strlen(entryName));
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
+    return (const ZipEntry*)mzHashTableLookup(pHash,
                 itemHash, (char*) entryName, hashcmpZipName, false);
 }
 
@@ -522,59 +526,81 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/*
+ * Return a pointer to the compressed data of "pEntry" within the
+ * archive's mapping.  parseZipArchive() has already checked that it
+ * lies inside the file.
+ */
+static const unsigned char* entryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    return (const unsigned char*)pArchive->map.addr + pEntry->offset;
+}
+
+/*
+ * Get a pointer to the contents of a STORED entry.
+ */
+bool mzGetStoredEntryData(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    const unsigned char **data, long *len)
+{
+    if (pEntry->compression != STORED) {
+        return false;
+    }
+    *data = entryData(pArchive, pEntry);
+    *len = pEntry->compLen;
+    return true;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
+ * The data is handed over straight from the mapping, in blocks small
+ * enough for processFunction's int length.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
+    const unsigned char* data = entryData(pArchive, pEntry);
     size_t bytesLeft = pEntry->compLen;
     while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
         size_t count;
         bool ret;
 
         count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
+        if (count > STORED_BLOCK_SIZE) {
+            count = STORED_BLOCK_SIZE;
         }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
-        }
-        ret = processFunction(buf, n, cookie);
+        ret = processFunction(data, count, cookie);
         if (!ret) {
             return false;
         }
+        data += count;
         bytesLeft -= count;
     }
     return true;
 }
 
+/* Call processFunction on the uncompressed data of a DEFLATED entry,
+ * inflating straight from the mapping.
+ */
 static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     long result = -1;
-    unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
-    long compRemaining;
-
-    compRemaining = pEntry->compLen;
 
     /*
-     * Initialize the zlib stream.
+     * Initialize the zlib stream.  The whole of the compressed data is
+     * available up front.
      */
     memset(&zstream, 0, sizeof(zstream));
     zstream.zalloc = Z_NULL;
     zstream.zfree = Z_NULL;
     zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
+    zstream.next_in = (Bytef*) entryData(pArchive, pEntry);
+    zstream.avail_in = pEntry->compLen;
     zstream.next_out = (Bytef*) procBuf;
     zstream.avail_out = sizeof(procBuf);
     zstream.data_type = Z_UNKNOWN;
@@ -598,25 +624,6 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
      * Loop while we have data.
      */
     do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
-
         /* uncompress the data */
         zerr = inflate(&zstream, Z_NO_FLUSH);
         if (zerr != Z_OK && zerr != Z_STREAM_END) {
@@ -674,13 +681,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,15 +695,13 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
 static bool crcProcessFunction(const unsigned char *data, int dataLen,
         void *crc)
 {
-    *(unsigned long *)crc = crc32(*(unsigned long *)crc, data, dataLen);
+    *(unsigned long *)crc = mzCrc32(*(unsigned long *)crc, data, dataLen);
     return true;
 }
 
@@ -907,6 +905,221 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* selabel_lookup() may compile the file contexts lazily, so only one
+ * thread at a time may use the handle.
+ */
+static pthread_mutex_t gSelabelLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Extract a file or symlink entry to targetFile, whose directory
+ * already exists.  Safe to call from several threads at once.
+ */
+static bool extractEntryToPath(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, const char *targetFile, int flags,
+    const struct utimbuf *timestamp, struct selabel_handle *sehnd)
+{
+    int ret;
+
+    /* With FILES_ONLY set, we need to ignore metadata entirely,
+     * so treat symlinks as regular files.
+     */
+    if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
+        /* The entry is a symbolic link.
+         * The relative target of the symlink is in the
+         * data section of this entry.
+         */
+        if (pEntry->uncompLen == 0) {
+            LOGE("Symlink entry \"%s\" has no target\n",
+                    targetFile);
+            return false;
+        }
+        char *linkTarget = malloc(pEntry->uncompLen + 1);
+        if (linkTarget == NULL) {
+            return false;
+        }
+        if (!mzReadZipEntry(pArchive, pEntry, linkTarget,
+                pEntry->uncompLen)) {
+            LOGE("Can't read symlink target for \"%s\"\n",
+                    targetFile);
+            free(linkTarget);
+            return false;
+        }
+        linkTarget[pEntry->uncompLen] = '\0';
+
+        /* Make the link.
+         */
+        ret = symlink(linkTarget, targetFile);
+        if (ret != 0) {
+            LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                    targetFile, linkTarget, strerror(errno));
+            free(linkTarget);
+            return false;
+        }
+        LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
+                targetFile, linkTarget);
+        free(linkTarget);
+        return true;
+    }
+
+    /* The entry is a regular file.
+     * Open the target for writing.  The file creation context is
+     * per-thread, so only the lookup needs the lock.
+     */
+    char *secontext = NULL;
+
+    if (sehnd) {
+        pthread_mutex_lock(&gSelabelLock);
+        selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
+        pthread_mutex_unlock(&gSelabelLock);
+        setfscreatecon(secontext);
+    }
+
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+
+    if (secontext) {
+        freecon(secontext);
+        setfscreatecon(NULL);
+    }
+
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/* One entry for MZ_EXTRACT_PARALLEL, in archive order.
+ */
+enum { MZ_JOB_PENDING, MZ_JOB_DONE, MZ_JOB_FAILED };
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    int state;
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    MzExtractJob *jobs;
+    unsigned int numJobs;
+    unsigned int next;          // next job for a worker to take
+    bool failed;                // stop taking jobs
+    int flags;
+    const struct utimbuf *timestamp;
+    struct selabel_handle *sehnd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // signalled as each job finishes
+} MzExtractPool;
+
+static void *extractWorker(void *arg)
+{
+    MzExtractPool *pool = (MzExtractPool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->failed && pool->next < pool->numJobs) {
+        MzExtractJob *job = &pool->jobs[pool->next++];
+        if (job->state != MZ_JOB_PENDING) {
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = extractEntryToPath(pool->pArchive, job->pEntry,
+                job->targetFile, pool->flags, pool->timestamp, pool->sehnd);
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = ok ? MZ_JOB_DONE : MZ_JOB_FAILED;
+        if (!ok) {
+            pool->failed = true;
+        }
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Extract the jobs on a pool of threads, one per CPU.  The callback is
+ * invoked from this thread, in archive order, as each entry completes;
+ * after a failure no further entries are started.
+ */
+static bool runExtractJobs(const ZipArchive *pArchive,
+    MzExtractJob *jobs, unsigned int numJobs, int flags,
+    const struct utimbuf *timestamp,
+    void (*callback)(const char *fn, void *), void *cookie,
+    struct selabel_handle *sehnd)
+{
+    MzExtractPool pool;
+    pool.pArchive = pArchive;
+    pool.jobs = jobs;
+    pool.numJobs = numJobs;
+    pool.next = 0;
+    pool.failed = false;
+    pool.flags = flags;
+    pool.timestamp = timestamp;
+    pool.sehnd = sehnd;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1) {
+        numThreads = 1;
+    } else if (numThreads > MZ_EXTRACT_MAX_THREADS) {
+        numThreads = MZ_EXTRACT_MAX_THREADS;
+    }
+    pthread_t threads[MZ_EXTRACT_MAX_THREADS];
+    int started = 0;
+    while (started < numThreads &&
+            pthread_create(&threads[started], NULL, extractWorker,
+                    &pool) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        LOGW("Can't start extraction threads; extracting serially\n");
+        extractWorker(&pool);
+    }
+
+    bool ok = true;
+    unsigned int i;
+    for (i = 0; i < numJobs; i++) {
+        pthread_mutex_lock(&pool.lock);
+        while (jobs[i].state == MZ_JOB_PENDING && !pool.failed) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        }
+        int state = jobs[i].state;
+        pthread_mutex_unlock(&pool.lock);
+        if (state != MZ_JOB_DONE) {
+            ok = false;
+            break;
+        }
+        if (callback != NULL) callback(jobs[i].targetFile, cookie);
+    }
+
+    int t;
+    for (t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    return ok;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -985,6 +1198,11 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     unsigned int i;
     bool seenMatch = false;
     int ok = true;
+    MzExtractJob *jobs = NULL;
+    unsigned int numJobs = 0, jobsCap = 0;
+    if (flags & MZ_EXTRACT_DRY_RUN) {
+        flags &= ~MZ_EXTRACT_PARALLEL;
+    }
     for (i = 0; i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
         if (pEntry->fileNameLen < zipDirLen) {
@@ -1039,124 +1257,80 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             continue;
         }
 
-        /* Create the file or directory.
+        /* Create the directory, or the directory containing the file.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
-        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
-            if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
-                        targetFile, UNZIP_DIRMODE, timestamp, false, sehnd);
-                if (ret != 0) {
-                    LOGE("Can't create containing directory for \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-                LOGD("Extracted dir \"%s\"\n", targetFile);
-            }
-        } else {
-            /* This is not a directory.  First, make sure that
-             * the containing directory exists.
-             */
+        bool isDir = pEntry->fileName[pEntry->fileNameLen-1] == '/';
+        if (!isDir || !(flags & MZ_EXTRACT_FILES_ONLY)) {
             int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
+                    targetFile, UNZIP_DIRMODE, timestamp, !isDir, sehnd);
             if (ret != 0) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
                         targetFile, strerror(errno));
                 ok = false;
                 break;
             }
+            if (isDir) {
+                LOGD("Extracted dir \"%s\"\n", targetFile);
+            }
+        }
 
-            /* With FILES_ONLY set, we need to ignore metadata entirely,
-             * so treat symlinks as regular files.
+        if (flags & MZ_EXTRACT_PARALLEL) {
+            /* Leave the file to the workers.  Directories go in the
+             * list too, already done, so the callback sees every
+             * entry in order.
              */
-            if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
-                /* The entry is a symbolic link.
-                 * The relative target of the symlink is in the
-                 * data section of this entry.
-                 */
-                if (pEntry->uncompLen == 0) {
-                    LOGE("Symlink entry \"%s\" has no target\n",
-                            targetFile);
-                    ok = false;
-                    break;
-                }
-                char *linkTarget = malloc(pEntry->uncompLen + 1);
-                if (linkTarget == NULL) {
-                    ok = false;
-                    break;
-                }
-                ok = mzReadZipEntry(pArchive, pEntry, linkTarget,
-                        pEntry->uncompLen);
-                if (!ok) {
-                    LOGE("Can't read symlink target for \"%s\"\n",
-                            targetFile);
-                    free(linkTarget);
-                    break;
-                }
-                linkTarget[pEntry->uncompLen] = '\0';
-
-                /* Make the link.
-                 */
-                ret = symlink(linkTarget, targetFile);
-                if (ret != 0) {
-                    LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
-                            targetFile, linkTarget, strerror(errno));
-                    free(linkTarget);
+            if (numJobs == jobsCap) {
+                jobsCap = jobsCap ? jobsCap * 2 : 256;
+                MzExtractJob *newJobs = (MzExtractJob *)realloc(jobs,
+                        jobsCap * sizeof(MzExtractJob));
+                if (newJobs == NULL) {
+                    LOGE("Can't allocate extraction job list\n");
                     ok = false;
                     break;
                 }
-                LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
-                        targetFile, linkTarget);
-                free(linkTarget);
-            } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
-                 */
-
-                char *secontext = NULL;
-
-                if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
-                }
-
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
-                }
-
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
+                jobs = newJobs;
             }
+            jobs[numJobs].pEntry = pEntry;
+            jobs[numJobs].targetFile = strdup(targetFile);
+            jobs[numJobs].state = isDir ? MZ_JOB_DONE : MZ_JOB_PENDING;
+            if (jobs[numJobs].targetFile == NULL) {
+                ok = false;
+                break;
+            }
+            /* Entries with the same name are adjacent, in archive
+             * order.  Skip all but the last, which wins as it does
+             * when extracting serially, so that no two workers write
+             * the same file.
+             */
+            if (!isDir && numJobs > 0 &&
+                    jobs[numJobs-1].state == MZ_JOB_PENDING &&
+                    strcmp(jobs[numJobs-1].targetFile, targetFile) == 0) {
+                jobs[numJobs-1].state = MZ_JOB_DONE;
+            }
+            numJobs++;
+            continue;
+        }
+
+        if (!isDir && !extractEntryToPath(pArchive, pEntry, targetFile,
+                flags, timestamp, sehnd)) {
+            ok = false;
+            break;
         }
 
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (jobs != NULL) {
+        if (ok) {
+            ok = runExtractJobs(pArchive, jobs, numJobs, flags, timestamp,
+                    callback, cookie, sehnd);
+        }
+        for (i = 0; i < numJobs; i++) {
+            free(jobs[i].targetFile);
+        }
+        free(jobs);
+    }
+
     free(helper.buf);
     free(zpath);
 
@@ -44,12 +44,16 @@ typedef struct ZipEntry {
 
 /*
  * One Zip archive.  Treat as opaque.
+ *
+ * "map" is a read-only mapping of the whole file; entry data is read
+ * from it rather than through "fd", so any number of threads may read
+ * entries at once.
  */
 typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
     ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
+    HashTable*  pHash;          // maps file name to ZipEntry; built lazily
     MemMapping  map;
 } ZipArchive;
 
@@ -157,6 +161,16 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie);
 
+/*
+ * Get a pointer to the contents of a STORED entry, and its length,
+ * without copying them out of the archive.  The data is valid until
+ * the archive is closed and must not be modified.
+ *
+ * Returns false if the entry is compressed.
+ */
+bool mzGetStoredEntryData(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    const unsigned char **data, long *len);
+
 /*
  * Read an entry into a buffer allocated by the caller.
  */
@@ -204,6 +218,9 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - create the directories first, then extract
+ *         the files on several threads.  The callback is still invoked
+ *         from the calling thread, in archive order.
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
@@ -211,7 +228,8 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2,
+       MZ_EXTRACT_PARALLEL = 4 };
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
@@ -19,6 +19,7 @@
 
 #include <signal.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #include "libcrecovery/common.h"
 
@@ -37,6 +38,8 @@
 #include "extendedcommands.h"
 #include "recovery_settings.h"
 #include "nandroid.h"
+#include "nandroid_md5.h"
+#include "nandroid_tar.h"
 #include "mounts.h"
 
 #include "flashutils/flashutils.h"
@@ -69,6 +72,36 @@ static int nandroid_backup_bitfield = 0;
 #define NANDROID_FIELD_DEDUPE_CLEARED_SPACE 1
 static int nandroid_files_total = 0;
 static int nandroid_files_count = 0;
+
+// While a full backup runs, the progress bar covers every partition: each
+// one owns a share of the bar in proportion to its expected size, and raw
+// dumps running in the background add theirs as they finish.
+static pthread_mutex_t nandroid_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long nandroid_progress_total = 0;
+static unsigned long long nandroid_progress_done = 0;
+// expected size of the partition being archived on the main thread
+static unsigned long long nandroid_progress_current = 0;
+
+// Held around a file name printed with ui_nice_print() and the
+// ui_delete_line() that removes it, and by background raw dumps while
+// they print, so their status lines can't land in between and be deleted.
+static pthread_mutex_t nandroid_ui_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void nandroid_set_progress(float fraction) {
+    pthread_mutex_lock(&nandroid_progress_lock);
+    if (nandroid_progress_total != 0)
+        fraction = (nandroid_progress_done + fraction * nandroid_progress_current) / (float)nandroid_progress_total;
+    pthread_mutex_unlock(&nandroid_progress_lock);
+    ui_set_progress(fraction);
+}
+
+static void nandroid_progress_add(unsigned long long bytes) {
+    pthread_mutex_lock(&nandroid_progress_lock);
+    nandroid_progress_done += bytes;
+    pthread_mutex_unlock(&nandroid_progress_lock);
+    nandroid_set_progress(0);
+}
+
 static void nandroid_callback(const char* filename) {
     if (filename == NULL)
         return;
@@ -80,11 +113,13 @@ static void nandroid_callback(const char* filename) {
     tmp[ui_get_text_cols() - 1] = '\0';
     nandroid_files_count++;
     ui_increment_frame();
+    pthread_mutex_lock(&nandroid_ui_lock);
     ui_nice_print("%s\n", tmp);
     if (!ui_was_niced() && nandroid_files_total != 0)
-        ui_set_progress((float)nandroid_files_count / (float)nandroid_files_total);
+        nandroid_set_progress((float)nandroid_files_count / (float)nandroid_files_total);
     if (!ui_was_niced())
         ui_delete_line();
+    pthread_mutex_unlock(&nandroid_ui_lock);
 }
 
 static void compute_directory_stats(const char* directory) {
@@ -97,8 +132,10 @@ static void compute_directory_stats(const char* directory) {
     fclose(f);
     nandroid_files_count = 0;
     nandroid_files_total = atoi(count_text);
-    ui_reset_progress();
-    ui_show_progress(1, 0);
+    if (nandroid_progress_total == 0) {
+        ui_reset_progress();
+        ui_show_progress(1, 0);
+    }
 }
 
 typedef void (*file_event_callback)(const char* filename);
@@ -123,39 +160,62 @@ static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_fil
     return __pclose(fp);
 }
 
-static int do_tar_compress(char* command, int callback) {
-    char buf[PATH_MAX];
+static void nandroid_tar_callback(const char* name, unsigned long long done, unsigned long long total) {
+    const char* justfile = basename(name);
+    char tmp[PATH_MAX];
+    strcpy(tmp, justfile);
+    tmp[ui_get_text_cols() - 1] = '\0';
+    ui_increment_frame();
+    pthread_mutex_lock(&nandroid_ui_lock);
+    ui_nice_print("%s\n", tmp);
+    if (!ui_was_niced() && total != 0)
+        nandroid_set_progress((float)done / (float)total);
+    if (!ui_was_niced())
+        ui_delete_line();
+    pthread_mutex_unlock(&nandroid_ui_lock);
+}
 
-    set_perf_mode(1);
-    FILE *fp = __popen(command, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar command!\n");
-        set_perf_mode(0);
-        return -1;
-    }
+static int do_tar_compress(const char* backup_path, const char* backup_file, int compression, int callback) {
+    const char* excludes[2];
+    int exclude_count = 0;
+    excludes[exclude_count++] = "data/data/com.google.android.music/files/*";
+    if (strcmp(backup_path, "/data") == 0 && is_data_media())
+        excludes[exclude_count++] = "data/media";
 
-    while (fgets(buf, PATH_MAX, fp) != NULL) {
-        buf[PATH_MAX - 1] = '\0';
-        if (callback)
-            nandroid_callback(buf);
-    }
+    // restore probes for the unsplit name to pick a handler
+    int fd = open(backup_file, O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0)
+        close(fd);
 
+    set_perf_mode(1);
+    int ret = tar_create(backup_path, backup_file, compression, excludes, exclude_count,
+                         callback ? nandroid_tar_callback : NULL, nandroid_md5_add);
     set_perf_mode(0);
-    return __pclose(fp);
+    return ret;
 }
 
 static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar ; (tar cv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude 'media'" : "", backup_path, backup_file_image);
-
-    return do_tar_compress(tmp, callback);
+    sprintf(tmp, "%s.tar", backup_file_image);
+    return do_tar_compress(backup_path, tmp, TAR_COMPRESS_NONE, callback);
 }
 
 static int tar_gzip_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar.gz ; (tar cv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | pigz -c | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.gz.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude 'media'" : "", backup_path, backup_file_image);
+    sprintf(tmp, "%s.tar.gz", backup_file_image);
+    return do_tar_compress(backup_path, tmp, TAR_COMPRESS_GZIP, callback);
+}
 
-    return do_tar_compress(tmp, callback);
+static int tar_lz4_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s.tar.lz4", backup_file_image);
+    return do_tar_compress(backup_path, tmp, TAR_COMPRESS_LZ4, callback);
+}
+
+static int tar_zstd_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s.tar.zst", backup_file_image);
+    return do_tar_compress(backup_path, tmp, TAR_COMPRESS_ZSTD, callback);
 }
 
 static int tar_dump_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
@@ -244,6 +304,10 @@ static void refresh_default_backup_handler() {
         default_backup_handler = dedupe_compress_wrapper;
     else if (0 == strcmp(fmt, "tgz"))
         default_backup_handler = tar_gzip_compress_wrapper;
+    else if (0 == strcmp(fmt, "lz4"))
+        default_backup_handler = tar_lz4_compress_wrapper;
+    else if (0 == strcmp(fmt, "zst") && tar_compression_supported(TAR_COMPRESS_ZSTD))
+        default_backup_handler = tar_zstd_compress_wrapper;
     else if (0 == strcmp(fmt, "tar"))
         default_backup_handler = tar_compress_wrapper;
     else
@@ -256,11 +320,21 @@ unsigned nandroid_get_default_backup_format() {
         return NANDROID_BACKUP_FORMAT_DUP;
     } else if (default_backup_handler == tar_gzip_compress_wrapper) {
         return NANDROID_BACKUP_FORMAT_TGZ;
+    } else if (default_backup_handler == tar_lz4_compress_wrapper) {
+        return NANDROID_BACKUP_FORMAT_LZ4;
+    } else if (default_backup_handler == tar_zstd_compress_wrapper) {
+        return NANDROID_BACKUP_FORMAT_ZST;
     } else {
         return NANDROID_BACKUP_FORMAT_TAR;
     }
 }
 
+int nandroid_backup_format_supported(unsigned fmt) {
+    if (fmt == NANDROID_BACKUP_FORMAT_ZST)
+        return tar_compression_supported(TAR_COMPRESS_ZSTD);
+    return fmt <= NANDROID_BACKUP_FORMAT_ZST;
+}
+
 static nandroid_backup_handler get_backup_handler(const char *backup_path) {
     Volume *v = volume_for_path(backup_path);
     if (v == NULL) {
@@ -338,6 +412,12 @@ int nandroid_backup_partition_extended(const char* backup_path, const char* moun
     return 0;
 }
 
+static int is_raw_volume(const Volume* vol) {
+    return strcmp(vol->fs_type, "mtd") == 0 ||
+            strcmp(vol->fs_type, "bml") == 0 ||
+            strcmp(vol->fs_type, "emmc") == 0;
+}
+
 int nandroid_backup_partition(const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists before attempting anything...
@@ -347,9 +427,7 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
     // see if we need a raw backup (mtd)
     char tmp[PATH_MAX];
     int ret;
-    if (strcmp(vol->fs_type, "mtd") == 0 ||
-            strcmp(vol->fs_type, "bml") == 0 ||
-            strcmp(vol->fs_type, "emmc") == 0) {
+    if (is_raw_volume(vol)) {
         const char* name = basename(root);
         if (strcmp(backup_path, "-") == 0)
             strcpy(tmp, "/proc/self/fd/1");
@@ -369,8 +447,245 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
     return nandroid_backup_partition_extended(backup_path, root, 1);
 }
 
+// One partition of a full backup.
+struct nandroid_backup_job {
+    const char* root;
+    // raw dumps
+    const Volume* vol;
+    char file[PATH_MAX];
+    // archives, see nandroid_backup_partition_extended
+    int umount_when_finished;
+    // share of the progress bar
+    unsigned long long size;
+    int background;
+    int ret;
+};
+
+struct nandroid_scheduler {
+    struct nandroid_backup_job* jobs;
+    int job_count;
+    int next_job;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+// boot, recovery, wimax, system, data, datadata, .android_secure, cache
+// and sd-ext; see nandroid_backup
+#define NANDROID_MAX_JOBS 9
+#define NANDROID_MAX_BACKGROUND_JOBS 4
+
+static int run_raw_dump(struct nandroid_backup_job* job) {
+    // not basename(): this runs on worker threads, and bionic's basename
+    // returns a static buffer the main thread keeps reusing
+    const char* slash = strrchr(job->root, '/');
+    char name[PATH_MAX];
+    strcpy(name, slash != NULL ? slash + 1 : job->root);
+    pthread_mutex_lock(&nandroid_ui_lock);
+    ui_print("Backing up %s image...\n", name);
+    pthread_mutex_unlock(&nandroid_ui_lock);
+    int ret = backup_raw_partition(job->vol->fs_type, job->vol->blk_device, job->file);
+    pthread_mutex_lock(&nandroid_ui_lock);
+    if (0 != ret)
+        ui_print("Error while backing up %s image!\n", name);
+    else
+        ui_print("Backup of %s image completed.\n", name);
+    pthread_mutex_unlock(&nandroid_ui_lock);
+    nandroid_progress_add(job->size);
+    return ret;
+}
+
+static void* raw_dump_worker(void* cookie) {
+    struct nandroid_scheduler* sched = (struct nandroid_scheduler*)cookie;
+    for (;;) {
+        struct nandroid_backup_job* job = NULL;
+        pthread_mutex_lock(&sched->lock);
+        while (!sched->failed && sched->next_job < sched->job_count && job == NULL) {
+            struct nandroid_backup_job* candidate = &sched->jobs[sched->next_job++];
+            if (candidate->background)
+                job = candidate;
+        }
+        pthread_mutex_unlock(&sched->lock);
+        if (job == NULL)
+            break;
+
+        job->ret = run_raw_dump(job);
+        if (job->ret != 0) {
+            pthread_mutex_lock(&sched->lock);
+            sched->failed = 1;
+            pthread_mutex_unlock(&sched->lock);
+        }
+    }
+    return NULL;
+}
+
+static unsigned long long raw_partition_size(const Volume* vol) {
+    int fd = open(vol->blk_device, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    off64_t size = lseek64(fd, 0, SEEK_END);
+    close(fd);
+    return size > 0 ? size : 0;
+}
+
+static unsigned long long used_space(const char* root) {
+    struct statfs sfs;
+    Volume* vol = volume_for_path(root);
+    // directories such as .android_secure share their volume's usage
+    if (vol == NULL || strcmp(vol->mount_point, root) != 0 ||
+            ensure_path_mounted(root) != 0 || statfs(root, &sfs) != 0)
+        return 0;
+    return (unsigned long long)(sfs.f_blocks - sfs.f_bfree) * sfs.f_bsize;
+}
+
+// Returns the next free job, cleared, or NULL if the queue is full.
+static struct nandroid_backup_job* new_job(struct nandroid_backup_job* jobs, int* count, const char* root) {
+    if (*count >= NANDROID_MAX_JOBS) {
+        LOGE("Too many backup jobs, not backing up %s\n", root);
+        return NULL;
+    }
+    struct nandroid_backup_job* job = &jobs[(*count)++];
+    memset(job, 0, sizeof(*job));
+    return job;
+}
+
+static void add_raw_job(struct nandroid_backup_job* jobs, int* count, const char* root, const Volume* vol, const char* file) {
+    struct nandroid_backup_job* job = new_job(jobs, count, root);
+    if (job == NULL)
+        return;
+    job->root = root;
+    job->vol = vol;
+    strcpy(job->file, file);
+    job->size = raw_partition_size(vol);
+    // mtd and bml dumps go through partition tables shared with the rest
+    // of recovery; only plain block device copies are safe to run
+    // alongside other work
+    job->background = strcmp(vol->fs_type, "emmc") == 0 && vol->blk_device[0] == '/';
+}
+
+static void add_archive_job(struct nandroid_backup_job* jobs, int* count, const char* root, int umount_when_finished) {
+    struct nandroid_backup_job* job = new_job(jobs, count, root);
+    if (job == NULL)
+        return;
+    job->root = root;
+    job->umount_when_finished = umount_when_finished;
+    job->size = used_space(root);
+}
+
+// Queues a partition the way nandroid_backup_partition would back it up.
+static void add_partition_job(struct nandroid_backup_job* jobs, int* count, const char* backup_path, const char* root) {
+    Volume* vol = volume_for_path(root);
+    // make sure the volume exists before attempting anything...
+    if (vol == NULL || vol->fs_type == NULL)
+        return;
+
+    if (is_raw_volume(vol)) {
+        char file[PATH_MAX];
+        sprintf(file, "%s/%s.img", backup_path, basename(root));
+        add_raw_job(jobs, count, root, vol, file);
+    } else {
+        add_archive_job(jobs, count, root, 1);
+    }
+}
+
+static int get_backup_concurrency() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.backup_jobs", value, "2");
+    int jobs = atoi(value);
+    if (jobs < 1)
+        jobs = 1;
+    if (jobs > NANDROID_MAX_BACKGROUND_JOBS + 1)
+        jobs = NANDROID_MAX_BACKGROUND_JOBS + 1;
+    return jobs;
+}
+
+// Runs the jobs in order on this thread, except for raw dumps that can
+// run in the background, which are handed to up to ro.cwm.backup_jobs - 1
+// worker threads so they overlap the long filesystem archives.
+static int run_backup_jobs(const char* backup_path, struct nandroid_backup_job* jobs, int job_count) {
+    struct nandroid_scheduler sched;
+    pthread_t threads[NANDROID_MAX_BACKGROUND_JOBS];
+    int thread_count = 0;
+    int background = 0;
+    int i;
+
+    memset(&sched, 0, sizeof(sched));
+    sched.jobs = jobs;
+    sched.job_count = job_count;
+    pthread_mutex_init(&sched.lock, NULL);
+
+    pthread_mutex_lock(&nandroid_progress_lock);
+    nandroid_progress_total = nandroid_progress_done = nandroid_progress_current = 0;
+    for (i = 0; i < job_count; i++) {
+        nandroid_progress_total += jobs[i].size;
+        background += jobs[i].background;
+    }
+    pthread_mutex_unlock(&nandroid_progress_lock);
+    ui_reset_progress();
+    ui_show_progress(1, 0);
+
+    int wanted = get_backup_concurrency() - 1;
+    if (wanted > background)
+        wanted = background;
+    for (i = 0; i < wanted; i++) {
+        if (pthread_create(&threads[thread_count], NULL, raw_dump_worker, &sched))
+            break;
+        thread_count++;
+    }
+    if (thread_count == 0) {
+        // nothing runs in the background
+        for (i = 0; i < job_count; i++)
+            jobs[i].background = 0;
+    }
+
+    int ret = 0;
+    for (i = 0; i < job_count && ret == 0; i++) {
+        struct nandroid_backup_job* job = &jobs[i];
+        if (job->background)
+            continue;
+
+        pthread_mutex_lock(&sched.lock);
+        int failed = sched.failed;
+        pthread_mutex_unlock(&sched.lock);
+        if (failed)
+            break;
+
+        if (job->vol != NULL) {
+            ret = run_raw_dump(job);
+        } else {
+            pthread_mutex_lock(&nandroid_progress_lock);
+            nandroid_progress_current = job->size;
+            pthread_mutex_unlock(&nandroid_progress_lock);
+            ret = nandroid_backup_partition_extended(backup_path, job->root, job->umount_when_finished);
+            pthread_mutex_lock(&nandroid_progress_lock);
+            nandroid_progress_current = 0;
+            pthread_mutex_unlock(&nandroid_progress_lock);
+            nandroid_progress_add(job->size);
+        }
+    }
+
+    if (ret != 0) {
+        // stop handing out background work
+        pthread_mutex_lock(&sched.lock);
+        sched.failed = 1;
+        pthread_mutex_unlock(&sched.lock);
+    }
+    for (i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+    for (i = 0; i < job_count && ret == 0; i++) {
+        if (jobs[i].background)
+            ret = jobs[i].ret;
+    }
+
+    pthread_mutex_destroy(&sched.lock);
+    pthread_mutex_lock(&nandroid_progress_lock);
+    nandroid_progress_total = nandroid_progress_done = 0;
+    pthread_mutex_unlock(&nandroid_progress_lock);
+    return ret;
+}
+
 int nandroid_backup(const char* backup_path) {
     nandroid_backup_bitfield = 0;
+    nandroid_md5_reset();
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     refresh_default_backup_handler();
 
@@ -402,44 +717,33 @@ int nandroid_backup(const char* backup_path) {
     char tmp[PATH_MAX];
     ensure_directory(backup_path);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
-        return ret;
+    struct nandroid_backup_job jobs[NANDROID_MAX_JOBS];
+    int job_count = 0;
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/recovery")))
-        return ret;
+    add_partition_job(jobs, &job_count, backup_path, "/boot");
+    add_partition_job(jobs, &job_count, backup_path, "/recovery");
 
     Volume *vol = volume_for_path("/wimax");
     if (vol != NULL && 0 == stat(vol->blk_device, &s)) {
         char serialno[PROPERTY_VALUE_MAX];
-        ui_print("Backing up WiMAX...\n");
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
         sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
-        ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp);
-        if (0 != ret)
-            return print_and_error("Error while dumping WiMAX image!\n");
+        add_raw_job(jobs, &job_count, "/wimax", vol, tmp);
     }
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/system")))
-        return ret;
-
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/data")))
-        return ret;
-
-    if (has_datadata()) {
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/datadata")))
-            return ret;
-    }
+    add_partition_job(jobs, &job_count, backup_path, "/system");
+    add_partition_job(jobs, &job_count, backup_path, "/data");
+    if (has_datadata())
+        add_partition_job(jobs, &job_count, backup_path, "/datadata");
 
     if (is_data_media() || 0 != stat(get_android_secure_path(), &s)) {
         ui_print("No .android_secure found. Skipping backup of applications on external storage.\n");
     } else {
-        if (0 != (ret = nandroid_backup_partition_extended(backup_path, get_android_secure_path(), 0)))
-            return ret;
+        add_archive_job(jobs, &job_count, get_android_secure_path(), 0);
     }
 
-    if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
-        return ret;
+    add_archive_job(jobs, &job_count, "/cache", 0);
 
     vol = volume_for_path("/sd-ext");
     if (vol == NULL || 0 != stat(vol->blk_device, &s)) {
@@ -447,13 +751,17 @@ int nandroid_backup(const char* backup_path) {
     } else {
         if (0 != ensure_path_mounted("/sd-ext"))
             LOGI("Could not mount sd-ext. sd-ext backup may not be supported on this device. Skipping backup of sd-ext.\n");
-        else if (0 != (ret = nandroid_backup_partition(backup_path, "/sd-ext")))
-            return ret;
+        else
+            add_partition_job(jobs, &job_count, backup_path, "/sd-ext");
     }
 
+    if (0 != (ret = run_backup_jobs(backup_path, jobs, job_count)))
+        return ret;
+
     ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    ret = nandroid_md5_write(backup_path);
+    nandroid_md5_reset();
+    if (0 != ret) {
         ui_print("Error while generating md5 sum!\n");
         return ret;
     }
@@ -534,39 +842,28 @@ static int unyaffs_wrapper(const char* backup_file_image, const char* backup_pat
     return __pclose(fp);
 }
 
-static int do_tar_extract(char* command, int callback) {
-    char buf[PATH_MAX];
-
+static int do_tar_extract(const char* backup_file_image, const char* backup_path, int compression, int callback) {
     set_perf_mode(1);
-    FILE *fp = __popen(command, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar command.\n");
-        set_perf_mode(0);
-        return -1;
-    }
-
-    while (fgets(buf, PATH_MAX, fp) != NULL) {
-        buf[PATH_MAX - 1] = '\0';
-        if (callback)
-            nandroid_callback(buf);
-    }
-
+    int ret = tar_extract(backup_file_image, backup_path, compression,
+                          callback ? nandroid_tar_callback : NULL, nandroid_md5_check);
     set_perf_mode(0);
-    return __pclose(fp);
+    return ret;
 }
 
 static int tar_gzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; cat %s* | pigz -d -c | tar xv ; exit $?", backup_path, backup_file_image);
+    return do_tar_extract(backup_file_image, backup_path, TAR_COMPRESS_GZIP, callback);
+}
 
-    return do_tar_extract(tmp, callback);
+static int tar_lz4_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_tar_extract(backup_file_image, backup_path, TAR_COMPRESS_LZ4, callback);
 }
 
-static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; cat %s* | tar xv ; exit $?", backup_path, backup_file_image);
+static int tar_zstd_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_tar_extract(backup_file_image, backup_path, TAR_COMPRESS_ZSTD, callback);
+}
 
-    return do_tar_extract(tmp, callback);
+static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_tar_extract(backup_file_image, backup_path, TAR_COMPRESS_NONE, callback);
 }
 
 static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
@@ -674,6 +971,18 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
                 restore_handler = tar_gzip_extract_wrapper;
                 break;
             }
+            sprintf(tmp, "%s/%s.%s.tar.lz4", backup_path, name, filesystem);
+            if (0 == (ret = stat(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = tar_lz4_extract_wrapper;
+                break;
+            }
+            sprintf(tmp, "%s/%s.%s.tar.zst", backup_path, name, filesystem);
+            if (0 == (ret = stat(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = tar_zstd_extract_wrapper;
+                break;
+            }
             sprintf(tmp, "%s/%s.%s.dup", backup_path, name, filesystem);
             if (0 == (ret = stat(tmp, &file_info))) {
                 backup_filesystem = filesystem;
@@ -705,6 +1014,15 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
     if (0 == strcmp(vol->mount_point, "/data") && is_data_media())
         backup_filesystem = NULL;
 
+    // tar archives are checked as they are extracted; images read by
+    // other tools are checked before the partition is wiped
+    if (strcmp(backup_path, "-") != 0 && restore_handler != tar_extract_wrapper &&
+            restore_handler != tar_gzip_extract_wrapper && restore_handler != tar_lz4_extract_wrapper &&
+            restore_handler != tar_zstd_extract_wrapper) {
+        if (0 != nandroid_md5_verify_file(tmp))
+            return -1;
+    }
+
     ensure_directory(mount_point);
 
     char path[PATH_MAX];
@@ -766,17 +1084,20 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
             strcmp(vol->fs_type, "emmc") == 0) {
         int ret;
         const char* name = basename(root);
+        if (strcmp(backup_path, "-") == 0)
+            strcpy(tmp, backup_path);
+        else
+            sprintf(tmp, "%s%s.img", backup_path, root);
+
+        if (strcmp(backup_path, "-") != 0 && 0 != nandroid_md5_verify_file(tmp))
+            return -1;
+
         ui_print("Erasing %s before restore...\n", name);
         if (0 != (ret = format_volume(root))) {
             ui_print("Error while erasing %s image!", name);
             return ret;
         }
 
-        if (strcmp(backup_path, "-") == 0)
-            strcpy(tmp, backup_path);
-        else
-            sprintf(tmp, "%s%s.img", backup_path, root);
-
         ui_print("Restoring %s image...\n", name);
         if (0 != (ret = restore_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
             ui_print("Error while flashing %s image!\n", name);
@@ -787,21 +1108,8 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
     return nandroid_restore_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_show_indeterminate_progress();
-    nandroid_files_total = 0;
-
-    if (ensure_path_mounted(backup_path) != 0)
-        return print_and_error("Can't mount backup path\n");
-
+static int nandroid_restore_partitions(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
     char tmp[PATH_MAX];
-
-    ui_print("Checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
-        return print_and_error("MD5 mismatch!\n");
-
     int ret;
 
     if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_partition(backup_path, "/boot")))
@@ -823,6 +1131,8 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
             ui_print("         You should create a new backup to\n");
             ui_print("         protect your WiMAX keys.\n");
         } else {
+            if (0 != nandroid_md5_verify_file(tmp))
+                return -1;
             ui_print("Erasing WiMAX before restore...\n");
             if (0 != (ret = format_volume("/wimax")))
                 return print_and_error("Error while formatting wimax!\n");
@@ -852,6 +1162,26 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     if (restore_sdext && 0 != (ret = nandroid_restore_partition(backup_path, "/sd-ext")))
         return ret;
 
+    return 0;
+}
+
+int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    nandroid_files_total = 0;
+
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("Can't mount backup path\n");
+
+    // each file is checked against nandroid.md5 as it is restored
+    if (0 != nandroid_md5_load(backup_path))
+        return print_and_error("Unable to read MD5 sums!\n");
+
+    int ret = nandroid_restore_partitions(backup_path, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+    nandroid_md5_reset();
+    if (0 != ret)
+        return ret;
+
     sync();
     ui_set_background(BACKGROUND_ICON_NONE);
     ui_reset_progress();
@@ -861,6 +1191,7 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
 
 int nandroid_undump(const char* partition) {
     nandroid_files_total = 0;
+    nandroid_md5_reset();
 
     int ret;
 
@@ -10,9 +10,12 @@ int nandroid_undump(const char* partition);
 void nandroid_dedupe_gc(const char* blob_dir);
 void nandroid_force_backup_format(const char* fmt);
 unsigned nandroid_get_default_backup_format();
+int nandroid_backup_format_supported(unsigned fmt);
 
 #define NANDROID_BACKUP_FORMAT_TAR 0
 #define NANDROID_BACKUP_FORMAT_DUP 1
 #define NANDROID_BACKUP_FORMAT_TGZ 2
+#define NANDROID_BACKUP_FORMAT_LZ4 3
+#define NANDROID_BACKUP_FORMAT_ZST 4
 
 #endif
@@ -0,0 +1,256 @@
+#include <string.h>
+
+#include "nandroid_lz4.h"
+
+#define LZ4_MIN_MATCH 4
+// the last five bytes of a block are always literals, and the last match
+// must start at least twelve bytes before the end
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_FIND_LIMIT 12
+// give up on incompressible data faster the longer matches are not found
+#define LZ4_SKIP_TRIGGER 6
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash_sequence(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static unsigned char* write_length(unsigned char* op, size_t len) {
+    len -= 15;
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Emits one sequence: a token, the literal run and, if offset is not 0,
+// a match. Returns NULL if it would overflow the output.
+static unsigned char* write_sequence(unsigned char* op, unsigned char* op_end,
+                                     const unsigned char* literals, size_t literal_len,
+                                     size_t offset, size_t match_len) {
+    if ((size_t)(op_end - op) < 1 + literal_len + literal_len / 255 + 1 + 2 + match_len / 255 + 1)
+        return NULL;
+
+    unsigned char* token = op++;
+    if (literal_len >= 15) {
+        *token = 15 << 4;
+        op = write_length(op, literal_len);
+    } else {
+        *token = literal_len << 4;
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (offset == 0)
+        return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_len -= LZ4_MIN_MATCH;
+    if (match_len >= 15) {
+        *token |= 15;
+        op = write_length(op, match_len);
+    } else {
+        *token |= match_len;
+    }
+    return op;
+}
+
+size_t lz4_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+size_t lz4_compress_block(const unsigned char* src, size_t len,
+                          unsigned char* dst, size_t capacity, uint32_t* table) {
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;
+    const unsigned char* end = src + len;
+    unsigned char* op = dst;
+    unsigned char* op_end = dst + capacity;
+
+    if (len > LZ4_MATCH_FIND_LIMIT) {
+        const unsigned char* match_limit = end - LZ4_MATCH_FIND_LIMIT;
+        const unsigned char* match_end_limit = end - LZ4_LAST_LITERALS;
+        unsigned searches = 1 << LZ4_SKIP_TRIGGER;
+
+        // table entries are positions plus one, so 0 means empty
+        memset(table, 0, sizeof(uint32_t) * LZ4_HASH_TABLE_SIZE);
+        while (ip <= match_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t hash = hash_sequence(sequence);
+            uint32_t candidate = table[hash];
+            table[hash] = ip - src + 1;
+
+            const unsigned char* match = candidate == 0 ? ip : src + candidate - 1;
+            if (match == ip || ip - match >= LZ4_WINDOW_SIZE || read32(match) != sequence) {
+                ip += searches++ >> LZ4_SKIP_TRIGGER;
+                continue;
+            }
+            searches = 1 << LZ4_SKIP_TRIGGER;
+
+            while (ip > anchor && match > src && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+            const unsigned char* match_end = ip + LZ4_MIN_MATCH;
+            const unsigned char* ref = match + LZ4_MIN_MATCH;
+            while (match_end < match_end_limit && *match_end == *ref) {
+                match_end++;
+                ref++;
+            }
+
+            op = write_sequence(op, op_end, anchor, ip - anchor, ip - match, match_end - ip);
+            if (op == NULL)
+                return 0;
+            // seed the table from inside the match so the next search
+            // has something to find
+            if (match_end - 2 > ip && match_end - 2 <= match_limit)
+                table[hash_sequence(read32(match_end - 2))] = match_end - 2 - src + 1;
+            ip = anchor = match_end;
+        }
+    }
+
+    op = write_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+    return op - dst;
+}
+
+long lz4_decompress_block(const unsigned char* src, size_t len,
+                          unsigned char* dst, size_t capacity, size_t prefix_len) {
+    const unsigned char* ip = src;
+    const unsigned char* ip_end = src + len;
+    unsigned char* op = dst;
+    unsigned char* op_end = dst + capacity;
+
+    while (ip < ip_end) {
+        unsigned token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            unsigned char c;
+            do {
+                if (ip >= ip_end)
+                    return -1;
+                c = *ip++;
+                literal_len += c;
+            } while (c == 255);
+        }
+        if (literal_len > (size_t)(ip_end - ip) || literal_len > (size_t)(op_end - op))
+            return -1;
+        memcpy(op, ip, literal_len);
+        op += literal_len;
+        ip += literal_len;
+
+        // the last sequence has no match
+        if (ip == ip_end)
+            break;
+
+        if (ip_end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst) + prefix_len)
+            return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            unsigned char c;
+            do {
+                if (ip >= ip_end)
+                    return -1;
+                c = *ip++;
+                match_len += c;
+            } while (c == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(op_end - op))
+            return -1;
+
+        // matches may overlap their own output, copy forwards
+        const unsigned char* ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            while (match_len-- > 0)
+                *op++ = *ref++;
+        }
+    }
+    return op - dst;
+}
+
+size_t lz4_block_max_size(int id) {
+    if (id < 4 || id > 7)
+        return 0;
+    return (size_t)1 << (8 + 2 * id);
+}
+
+#define XXH_PRIME32_1 2654435761U
+#define XXH_PRIME32_2 2246822519U
+#define XXH_PRIME32_3 3266489917U
+#define XXH_PRIME32_4 668265263U
+#define XXH_PRIME32_5 374761393U
+
+static uint32_t rotl32(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+static uint32_t read32_le(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t xxh32_round(uint32_t acc, uint32_t input) {
+    acc += input * XXH_PRIME32_2;
+    acc = rotl32(acc, 13);
+    return acc * XXH_PRIME32_1;
+}
+
+uint32_t lz4_xxh32(const void* data, size_t len, uint32_t seed) {
+    const unsigned char* p = data;
+    const unsigned char* end = p + len;
+    uint32_t h;
+
+    if (len >= 16) {
+        uint32_t v1 = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
+        uint32_t v2 = seed + XXH_PRIME32_2;
+        uint32_t v3 = seed;
+        uint32_t v4 = seed - XXH_PRIME32_1;
+        const unsigned char* limit = end - 16;
+        do {
+            v1 = xxh32_round(v1, read32_le(p));
+            v2 = xxh32_round(v2, read32_le(p + 4));
+            v3 = xxh32_round(v3, read32_le(p + 8));
+            v4 = xxh32_round(v4, read32_le(p + 12));
+            p += 16;
+        } while (p <= limit);
+        h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+    } else {
+        h = seed + XXH_PRIME32_5;
+    }
+
+    h += (uint32_t)len;
+    while (p + 4 <= end) {
+        h += read32_le(p) * XXH_PRIME32_3;
+        h = rotl32(h, 17) * XXH_PRIME32_4;
+        p += 4;
+    }
+    while (p < end) {
+        h += *p * XXH_PRIME32_5;
+        h = rotl32(h, 11) * XXH_PRIME32_1;
+        p++;
+    }
+
+    h ^= h >> 15;
+    h *= XXH_PRIME32_2;
+    h ^= h >> 13;
+    h *= XXH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
@@ -0,0 +1,53 @@
+#ifndef NANDROID_LZ4_H
+#define NANDROID_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal LZ4 block codec and the frame format pieces nandroid needs to
+// write .tar.lz4 backups that the stock lz4 tool can read back.
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define LZ4_SKIPPABLE_MAGIC 0x184D2A50
+#define LZ4_SKIPPABLE_MASK 0xFFFFFFF0
+
+// frame descriptor flags
+#define LZ4_FLG_VERSION 0x40
+#define LZ4_FLG_BLOCK_INDEPENDENT 0x20
+#define LZ4_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID 0x01
+
+// set in a block size to mark a block stored uncompressed
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000U
+
+// matches reach at most this far back
+#define LZ4_WINDOW_SIZE 65536
+
+#define LZ4_HASH_LOG 14
+#define LZ4_HASH_TABLE_SIZE (1 << LZ4_HASH_LOG)
+
+// Worst case compressed size of len bytes.
+size_t lz4_compress_bound(size_t len);
+
+// Compresses src into a single independent block. table is scratch space
+// of LZ4_HASH_TABLE_SIZE entries. Returns the compressed length, or 0 if
+// the result would not fit in capacity.
+size_t lz4_compress_block(const unsigned char* src, size_t len,
+                          unsigned char* dst, size_t capacity, uint32_t* table);
+
+// Decompresses a block into dst. The prefix_len bytes before dst hold
+// previously decoded data that matches may refer to, for frames with
+// linked blocks. Returns the decompressed length, or -1 if the block is
+// malformed or does not fit in capacity.
+long lz4_decompress_block(const unsigned char* src, size_t len,
+                          unsigned char* dst, size_t capacity, size_t prefix_len);
+
+// Maximum block size for a block size id from the frame descriptor, or 0
+// if the id is invalid.
+size_t lz4_block_max_size(int id);
+
+uint32_t lz4_xxh32(const void* data, size_t len, uint32_t seed);
+
+#endif
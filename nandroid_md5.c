@@ -0,0 +1,234 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/md5.h>
+
+#include "common.h"
+#include "nandroid_md5.h"
+
+#define NANDROID_MD5_READ_SIZE (128 * 1024)
+
+struct nandroid_digest {
+    // file name within the backup directory
+    char* name;
+    unsigned char md5[MD5_DIGEST_LENGTH];
+};
+
+static struct nandroid_digest* digests = NULL;
+static int digest_count = 0;
+static int digest_capacity = 0;
+static int digests_loaded = 0;
+
+static const char* file_name(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
+}
+
+static struct nandroid_digest* find_digest(const char* name) {
+    int i;
+    for (i = 0; i < digest_count; i++) {
+        if (strcmp(digests[i].name, name) == 0)
+            return &digests[i];
+    }
+    return NULL;
+}
+
+static int add_digest(const char* name, const unsigned char* md5) {
+    struct nandroid_digest* digest = find_digest(name);
+    if (digest == NULL) {
+        if (digest_count == digest_capacity) {
+            int capacity = digest_capacity ? digest_capacity * 2 : 32;
+            struct nandroid_digest* grown = realloc(digests, sizeof(struct nandroid_digest) * capacity);
+            if (grown == NULL)
+                return -1;
+            digests = grown;
+            digest_capacity = capacity;
+        }
+        digest = &digests[digest_count];
+        digest->name = strdup(name);
+        if (digest->name == NULL)
+            return -1;
+        digest_count++;
+    }
+    memcpy(digest->md5, md5, MD5_DIGEST_LENGTH);
+    return 0;
+}
+
+static int hash_file(const char* path, unsigned char* md5) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    unsigned char* buf = malloc(NANDROID_MD5_READ_SIZE);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    ssize_t n;
+    while ((n = read(fd, buf, NANDROID_MD5_READ_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("Error reading %s: %s\n", path, strerror(errno));
+            break;
+        }
+        MD5_Update(&ctx, buf, n);
+    }
+    MD5_Final(md5, &ctx);
+    free(buf);
+    close(fd);
+    return n == 0 ? 0 : -1;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(((const struct nandroid_digest*)a)->name, ((const struct nandroid_digest*)b)->name);
+}
+
+void nandroid_md5_reset() {
+    int i;
+    for (i = 0; i < digest_count; i++)
+        free(digests[i].name);
+    free(digests);
+    digests = NULL;
+    digest_count = digest_capacity = 0;
+    digests_loaded = 0;
+}
+
+int nandroid_md5_add(const char* path, const unsigned char* md5) {
+    return add_digest(file_name(path), md5);
+}
+
+int nandroid_md5_write(const char* backup_path) {
+    DIR* dir = opendir(backup_path);
+    if (dir == NULL) {
+        LOGE("Unable to open %s: %s\n", backup_path, strerror(errno));
+        return -1;
+    }
+
+    // files written by external tools (raw dumps, yaffs2 images, dedupe
+    // manifests) were not hashed on the way out
+    int ret = 0;
+    struct dirent* de;
+    while (ret == 0 && (de = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (strcmp(de->d_name, NANDROID_MD5_FILE) == 0 || find_digest(de->d_name) != NULL)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", backup_path, de->d_name);
+        if (lstat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        unsigned char md5[MD5_DIGEST_LENGTH];
+        if (hash_file(path, md5) || add_digest(de->d_name, md5))
+            ret = -1;
+    }
+    closedir(dir);
+    if (ret)
+        return ret;
+
+    qsort(digests, digest_count, sizeof(struct nandroid_digest), compare_names);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", backup_path, NANDROID_MD5_FILE);
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        LOGE("Unable to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int i, j;
+    for (i = 0; i < digest_count; i++) {
+        for (j = 0; j < MD5_DIGEST_LENGTH; j++)
+            fprintf(f, "%02x", digests[i].md5[j]);
+        fprintf(f, "  %s\n", digests[i].name);
+    }
+    if (fclose(f)) {
+        LOGE("Error writing %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_hex(const char* hex, unsigned char* md5) {
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+        unsigned int byte;
+        if (!isxdigit(hex[i * 2]) || !isxdigit(hex[i * 2 + 1]) || sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return -1;
+        md5[i] = byte;
+    }
+    return 0;
+}
+
+int nandroid_md5_load(const char* backup_path) {
+    char path[PATH_MAX];
+    nandroid_md5_reset();
+    snprintf(path, sizeof(path), "%s/%s", backup_path, NANDROID_MD5_FILE);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        LOGE("Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int ret = 0;
+    char line[PATH_MAX + 64];
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        unsigned char md5[MD5_DIGEST_LENGTH];
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        // "<digest>  <name>", or "<digest> *<name>" for binary mode
+        if (len < MD5_DIGEST_LENGTH * 2 + 3 || parse_hex(line, md5) ||
+                line[MD5_DIGEST_LENGTH * 2] != ' ' ||
+                (line[MD5_DIGEST_LENGTH * 2 + 1] != ' ' && line[MD5_DIGEST_LENGTH * 2 + 1] != '*')) {
+            LOGE("Malformed line in %s\n", path);
+            ret = -1;
+            break;
+        }
+        ret = add_digest(file_name(line + MD5_DIGEST_LENGTH * 2 + 2), md5);
+    }
+    fclose(f);
+
+    if (ret)
+        nandroid_md5_reset();
+    else
+        digests_loaded = 1;
+    return ret;
+}
+
+int nandroid_md5_check(const char* path, const unsigned char* md5) {
+    if (!digests_loaded)
+        return 0;
+    struct nandroid_digest* digest = find_digest(file_name(path));
+    if (digest == NULL) {
+        ui_print("No MD5 sum for %s!\n", file_name(path));
+        return -1;
+    }
+    if (memcmp(digest->md5, md5, MD5_DIGEST_LENGTH) != 0) {
+        ui_print("MD5 mismatch for %s!\n", file_name(path));
+        return -1;
+    }
+    return 0;
+}
+
+int nandroid_md5_verify_file(const char* path) {
+    if (!digests_loaded)
+        return 0;
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    if (hash_file(path, md5))
+        return -1;
+    return nandroid_md5_check(path, md5);
+}
@@ -0,0 +1,33 @@
+#ifndef NANDROID_MD5_H
+#define NANDROID_MD5_H
+
+// Digests of the files in a backup directory, kept in memory while a
+// backup is written or restored and stored as nandroid.md5 in the format
+// `md5sum -c` reads.
+
+#define NANDROID_MD5_FILE "nandroid.md5"
+
+// Forgets every recorded digest and stops checking restores.
+void nandroid_md5_reset();
+
+// Records the digest of a backup file as it was written. Returns 0 on
+// success.
+int nandroid_md5_add(const char* path, const unsigned char* md5);
+
+// Hashes the files in backup_path that have no recorded digest and writes
+// nandroid.md5. Returns 0 on success.
+int nandroid_md5_write(const char* backup_path);
+
+// Reads backup_path/nandroid.md5; restored files are checked against it
+// until nandroid_md5_reset. Returns 0 on success.
+int nandroid_md5_load(const char* backup_path);
+
+// Checks a digest computed while reading a backup file. Passes if no
+// nandroid.md5 is loaded. Returns 0 if the digest matches.
+int nandroid_md5_check(const char* path, const unsigned char* md5);
+
+// Hashes a backup file and checks it, for files restored by tools that
+// read them directly. Returns 0 if the digest matches.
+int nandroid_md5_verify_file(const char* path);
+
+#endif
@@ -0,0 +1,1393 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include <signal.h>
+#include <stdint.h>
+
+#include <openssl/md5.h>
+#include <zlib.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include "common.h"
+#include "libcrecovery/common.h"
+#include "nandroid_lz4.h"
+#include "nandroid_tar.h"
+
+// Archives are produced in a single pass: the directory walk appends tar
+// records to fixed size blocks, full blocks are compressed in parallel by
+// a pool of workers and the compressed blocks are written out in order,
+// split across volumes.
+//
+// gzip blocks are deflated with the tail of the previous block as their
+// dictionary, as pigz does, and are joined into a single gzip member. lz4
+// blocks are independent blocks of one lz4 frame. zstd blocks are each
+// their own zstd frame; concatenated frames decompress as one stream.
+
+#define TAR_RECORD_SIZE 512
+// GNU tar pads archives to its default blocking factor of 20 records
+#define TAR_ARCHIVE_BLOCKING (20 * TAR_RECORD_SIZE)
+#define TAR_BLOCK_SIZE (128 * 1024)
+#define TAR_DICT_SIZE 32768
+#define TAR_GZIP_LEVEL 6
+// frame descriptor block size id for 256K blocks, the smallest that
+// holds a TAR_BLOCK_SIZE block
+#define TAR_LZ4_BLOCK_ID 5
+// zstd gains more from larger blocks than the other formats
+#define TAR_ZSTD_BLOCK_SIZE (1024 * 1024)
+#define TAR_ZSTD_LEVEL 3
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+enum {
+    BLOCK_FREE,
+    BLOCK_FILLED,
+    BLOCK_COMPRESSING,
+    BLOCK_DONE,
+};
+
+struct tar_block {
+    unsigned char* in;
+    size_t in_len;
+    // tail of the previous block, used as the deflate dictionary
+    unsigned char* dict;
+    size_t dict_len;
+    unsigned char* out;
+    size_t out_len;
+    size_t out_capacity;
+    uLong crc;
+    int last;
+    int error;
+    int state;
+};
+
+// per thread compression state
+struct tar_codec {
+    z_stream strm;
+    uint32_t* lz4_table;
+#ifdef HAVE_LIBZSTD
+    ZSTD_CCtx* zstd;
+#endif
+};
+
+struct tar_output {
+    const char* base;
+    int fd;
+    int volume;
+    long long volume_bytes;
+    char name[PATH_MAX];
+    MD5_CTX md5;
+    tar_volume_callback volume_callback;
+};
+
+// hard linked files already archived, by device and inode
+struct tar_link {
+    dev_t dev;
+    ino_t ino;
+    char* name;
+};
+
+struct tar_context {
+    int compression;
+    const char** excludes;
+    int exclude_count;
+    tar_progress_callback callback;
+    unsigned long long total_bytes;
+    unsigned long long done_bytes;
+
+    struct tar_output output;
+    int error;
+
+    // ring of blocks; the block with sequence number n lives in
+    // blocks[n % block_count]
+    struct tar_block* blocks;
+    int block_count;
+    size_t block_size;
+    // sequence numbers of the block being filled, the next block to be
+    // compressed and the next block to be written
+    unsigned long fill_seq;
+    unsigned long compress_seq;
+    unsigned long write_seq;
+    pthread_t* threads;
+    int thread_count;
+    // used when no workers could be started
+    struct tar_codec codec;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    int shutdown;
+
+    uLong crc;
+    unsigned long long uncompressed_bytes;
+
+    struct tar_link* links;
+    int link_count;
+    int link_capacity;
+};
+
+static int output_close(struct tar_output* out);
+
+static int output_write(struct tar_output* out, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        if (out->fd < 0 || out->volume_bytes == TAR_VOLUME_SIZE) {
+            if (output_close(out))
+                return -1;
+            if (out->volume == 26) {
+                LOGE("Backup is too large.\n");
+                return -1;
+            }
+            sprintf(out->name, "%s.%c", out->base, 'a' + out->volume);
+            out->fd = open(out->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (out->fd < 0) {
+                LOGE("Unable to create %s: %s\n", out->name, strerror(errno));
+                return -1;
+            }
+            MD5_Init(&out->md5);
+            out->volume++;
+            out->volume_bytes = 0;
+        }
+
+        size_t chunk = len;
+        if ((long long)chunk > TAR_VOLUME_SIZE - out->volume_bytes)
+            chunk = TAR_VOLUME_SIZE - out->volume_bytes;
+        ssize_t written = write(out->fd, p, chunk);
+        if (written <= 0) {
+            if (written < 0 && errno == EINTR)
+                continue;
+            LOGE("Error writing backup volume: %s\n", strerror(errno));
+            return -1;
+        }
+        // hash what is written rather than reading the volume back
+        MD5_Update(&out->md5, p, written);
+        p += written;
+        len -= written;
+        out->volume_bytes += written;
+    }
+    return 0;
+}
+
+static int output_close(struct tar_output* out) {
+    if (out->fd < 0)
+        return 0;
+    int ret = 0;
+    if (close(out->fd)) {
+        LOGE("Error writing backup volume: %s\n", strerror(errno));
+        ret = -1;
+    }
+    out->fd = -1;
+
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    MD5_Final(md5, &out->md5);
+    if (ret == 0 && out->volume_callback != NULL && out->volume_callback(out->name, md5))
+        ret = -1;
+    return ret;
+}
+
+static int codec_init(struct tar_codec* codec, int compression) {
+    memset(codec, 0, sizeof(*codec));
+    switch (compression) {
+        case TAR_COMPRESS_GZIP:
+            if (deflateInit2(&codec->strm, TAR_GZIP_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return -1;
+            break;
+        case TAR_COMPRESS_LZ4:
+            codec->lz4_table = malloc(sizeof(uint32_t) * LZ4_HASH_TABLE_SIZE);
+            if (codec->lz4_table == NULL)
+                return -1;
+            break;
+#ifdef HAVE_LIBZSTD
+        case TAR_COMPRESS_ZSTD:
+            codec->zstd = ZSTD_createCCtx();
+            if (codec->zstd == NULL)
+                return -1;
+            break;
+#endif
+    }
+    return 0;
+}
+
+static void codec_free(struct tar_codec* codec, int compression) {
+    switch (compression) {
+        case TAR_COMPRESS_GZIP:
+            deflateEnd(&codec->strm);
+            break;
+        case TAR_COMPRESS_LZ4:
+            free(codec->lz4_table);
+            break;
+#ifdef HAVE_LIBZSTD
+        case TAR_COMPRESS_ZSTD:
+            ZSTD_freeCCtx(codec->zstd);
+            break;
+#endif
+    }
+}
+
+static void write_le32(unsigned char* p, uLong value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+static void compress_block(struct tar_codec* codec, int compression, struct tar_block* block) {
+    block->out_len = 0;
+    switch (compression) {
+        case TAR_COMPRESS_GZIP: {
+            z_stream* strm = &codec->strm;
+            block->crc = crc32(crc32(0L, Z_NULL, 0), block->in, block->in_len);
+            deflateReset(strm);
+            if (block->dict_len > 0)
+                deflateSetDictionary(strm, block->dict, block->dict_len);
+            strm->next_in = block->in;
+            strm->avail_in = block->in_len;
+            strm->next_out = block->out;
+            strm->avail_out = block->out_capacity;
+            // a sync flush ends each block on a byte boundary so the
+            // compressed blocks can simply be concatenated
+            deflate(strm, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+            block->out_len = block->out_capacity - strm->avail_out;
+            break;
+        }
+        case TAR_COMPRESS_LZ4: {
+            // an empty block would read as the end mark
+            if (block->in_len == 0)
+                break;
+            size_t len = lz4_compress_block(block->in, block->in_len, block->out + 4,
+                                            block->out_capacity - 4, codec->lz4_table);
+            if (len == 0 || len >= block->in_len) {
+                write_le32(block->out, block->in_len | LZ4_BLOCK_UNCOMPRESSED);
+                memcpy(block->out + 4, block->in, block->in_len);
+                len = block->in_len;
+            } else {
+                write_le32(block->out, len);
+            }
+            block->out_len = 4 + len;
+            break;
+        }
+#ifdef HAVE_LIBZSTD
+        case TAR_COMPRESS_ZSTD: {
+            if (block->in_len == 0)
+                break;
+            size_t len = ZSTD_compressCCtx(codec->zstd, block->out, block->out_capacity,
+                                           block->in, block->in_len, TAR_ZSTD_LEVEL);
+            if (ZSTD_isError(len))
+                block->error = 1;
+            else
+                block->out_len = len;
+            break;
+        }
+#endif
+    }
+}
+
+static void* compress_worker(void* cookie) {
+    struct tar_context* ctx = (struct tar_context*)cookie;
+    struct tar_codec codec;
+    if (codec_init(&codec, ctx->compression))
+        return NULL;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (ctx->compress_seq == ctx->fill_seq && !ctx->shutdown)
+            pthread_cond_wait(&ctx->work_cond, &ctx->lock);
+        if (ctx->compress_seq == ctx->fill_seq)
+            break;
+
+        struct tar_block* block = &ctx->blocks[ctx->compress_seq % ctx->block_count];
+        ctx->compress_seq++;
+        block->state = BLOCK_COMPRESSING;
+        pthread_mutex_unlock(&ctx->lock);
+
+        compress_block(&codec, ctx->compression, block);
+
+        pthread_mutex_lock(&ctx->lock);
+        block->state = BLOCK_DONE;
+        pthread_cond_broadcast(&ctx->done_cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    codec_free(&codec, ctx->compression);
+    return NULL;
+}
+
+static int write_block(struct tar_context* ctx, struct tar_block* block) {
+    if (ctx->compression == TAR_COMPRESS_NONE)
+        return output_write(&ctx->output, block->in, block->in_len);
+    if (block->error) {
+        LOGE("Error compressing backup.\n");
+        return -1;
+    }
+
+    if (ctx->compression == TAR_COMPRESS_GZIP)
+        ctx->crc = crc32_combine(ctx->crc, block->crc, block->in_len);
+    return output_write(&ctx->output, block->out, block->out_len);
+}
+
+// Writes out compressed blocks in order. If wait is set, blocks until
+// every submitted block has been written. Called with the lock held.
+static void flush_blocks_locked(struct tar_context* ctx, int wait) {
+    while (ctx->write_seq < ctx->fill_seq) {
+        struct tar_block* block = &ctx->blocks[ctx->write_seq % ctx->block_count];
+        if (block->state != BLOCK_DONE) {
+            if (!wait)
+                break;
+            pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+            continue;
+        }
+        if (!ctx->error && write_block(ctx, block))
+            ctx->error = 1;
+        block->state = BLOCK_FREE;
+        ctx->write_seq++;
+    }
+}
+
+static struct tar_block* current_block(struct tar_context* ctx) {
+    return &ctx->blocks[ctx->fill_seq % ctx->block_count];
+}
+
+// Keeps the tail of block as the deflate dictionary for next.
+static void save_dict(struct tar_context* ctx, struct tar_block* block, struct tar_block* next) {
+    if (ctx->compression != TAR_COMPRESS_GZIP)
+        return;
+    size_t dict_len = block->in_len < TAR_DICT_SIZE ? block->in_len : TAR_DICT_SIZE;
+    memcpy(next->dict, block->in + block->in_len - dict_len, dict_len);
+    next->dict_len = dict_len;
+}
+
+// Hands the current block off for compression and writing, and makes the
+// next block in the ring current.
+static void submit_block(struct tar_context* ctx, int last) {
+    struct tar_block* block = current_block(ctx);
+    block->last = last;
+    ctx->uncompressed_bytes += block->in_len;
+
+    if (ctx->compression == TAR_COMPRESS_NONE || ctx->thread_count == 0) {
+        // nothing to hand off to, process the block on this thread and
+        // keep filling the same one
+        if (ctx->compression != TAR_COMPRESS_NONE) {
+            compress_block(&ctx->codec, ctx->compression, block);
+            save_dict(ctx, block, block);
+        }
+        if (!ctx->error && write_block(ctx, block))
+            ctx->error = 1;
+        block->in_len = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    block->state = BLOCK_FILLED;
+    ctx->fill_seq++;
+    pthread_cond_signal(&ctx->work_cond);
+
+    struct tar_block* next = current_block(ctx);
+    // the next slot is free once the block that last used it is written
+    while (next->state != BLOCK_FREE) {
+        flush_blocks_locked(ctx, 0);
+        if (next->state != BLOCK_FREE)
+            pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+    }
+    flush_blocks_locked(ctx, 0);
+    pthread_mutex_unlock(&ctx->lock);
+
+    // block is not modified by its worker, so its tail can be read
+    // while it is being compressed
+    save_dict(ctx, block, next);
+    next->in_len = 0;
+}
+
+static void tar_write(struct tar_context* ctx, const void* data, size_t len) {
+    const unsigned char* p = data;
+    while (len > 0) {
+        struct tar_block* block = current_block(ctx);
+        size_t chunk = ctx->block_size - block->in_len;
+        if (chunk > len)
+            chunk = len;
+        memcpy(block->in + block->in_len, p, chunk);
+        block->in_len += chunk;
+        p += chunk;
+        len -= chunk;
+        if (block->in_len == ctx->block_size)
+            submit_block(ctx, 0);
+    }
+}
+
+static void tar_zeros(struct tar_context* ctx, unsigned long long len) {
+    static const char zeros[TAR_RECORD_SIZE];
+    while (len > 0) {
+        size_t chunk = len > sizeof(zeros) ? sizeof(zeros) : len;
+        tar_write(ctx, zeros, chunk);
+        len -= chunk;
+    }
+}
+
+// Pads data of length len out to a multiple of multiple bytes.
+static void tar_pad(struct tar_context* ctx, unsigned long long len, unsigned long long multiple) {
+    tar_zeros(ctx, (multiple - len % multiple) % multiple);
+}
+
+// Writes a numeric header field as octal, or in the GNU base-256 form if
+// the value does not fit.
+static void format_number(char* field, size_t size, unsigned long long value) {
+    if (size == 12 ? value < 077777777777ULL : value < (1ULL << (3 * (size - 1)))) {
+        snprintf(field, size, "%0*llo", (int)size - 1, value);
+        return;
+    }
+    memset(field, 0, size);
+    field[0] = (char)0x80;
+    size_t i;
+    for (i = size - 1; i > 0 && value != 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static void write_header(struct tar_context* ctx, struct tar_header* header) {
+    unsigned int sum = 0;
+    size_t i;
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    for (i = 0; i < sizeof(*header); i++)
+        sum += ((unsigned char*)header)[i];
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+    tar_write(ctx, header, sizeof(*header));
+}
+
+// Emits a GNU long name ('L') or long link ('K') record carrying a string
+// that does not fit in the ustar header.
+static void write_long_record(struct tar_context* ctx, char type, const char* value) {
+    struct tar_header header;
+    size_t len = strlen(value) + 1;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.name, "././@LongLink");
+    format_number(header.mode, sizeof(header.mode), 0);
+    format_number(header.uid, sizeof(header.uid), 0);
+    format_number(header.gid, sizeof(header.gid), 0);
+    format_number(header.size, sizeof(header.size), len);
+    format_number(header.mtime, sizeof(header.mtime), 0);
+    header.typeflag = type;
+    write_header(ctx, &header);
+    tar_write(ctx, value, len);
+    tar_pad(ctx, len, TAR_RECORD_SIZE);
+}
+
+static void write_entry_header(struct tar_context* ctx, const char* name, const struct stat* st, char type, const char* link, unsigned long long size) {
+    struct tar_header header;
+    size_t len = strlen(name);
+    memset(&header, 0, sizeof(header));
+
+    if (len <= sizeof(header.name)) {
+        memcpy(header.name, name, len);
+    } else {
+        // try a ustar prefix/name split before falling back to a long name
+        const char* split = NULL;
+        const char* p;
+        for (p = name + len - sizeof(header.name) - 1; *p; p++) {
+            if (*p == '/' && p > name) {
+                split = p;
+                break;
+            }
+        }
+        if (split != NULL && (size_t)(split - name) <= sizeof(header.prefix)) {
+            memcpy(header.prefix, name, split - name);
+            memcpy(header.name, split + 1, len - (split - name) - 1);
+        } else {
+            write_long_record(ctx, 'L', name);
+            memcpy(header.name, name, sizeof(header.name));
+        }
+    }
+
+    if (link != NULL) {
+        if (strlen(link) > sizeof(header.linkname))
+            write_long_record(ctx, 'K', link);
+        strncpy(header.linkname, link, sizeof(header.linkname));
+    }
+
+    format_number(header.mode, sizeof(header.mode), st->st_mode & 07777);
+    format_number(header.uid, sizeof(header.uid), st->st_uid);
+    format_number(header.gid, sizeof(header.gid), st->st_gid);
+    format_number(header.size, sizeof(header.size), size);
+    format_number(header.mtime, sizeof(header.mtime), st->st_mtime);
+    header.typeflag = type;
+    if (type == '3' || type == '4') {
+        format_number(header.devmajor, sizeof(header.devmajor), major(st->st_rdev));
+        format_number(header.devminor, sizeof(header.devminor), minor(st->st_rdev));
+    }
+    write_header(ctx, &header);
+}
+
+static const char* find_link(struct tar_context* ctx, const struct stat* st) {
+    int i;
+    for (i = 0; i < ctx->link_count; i++) {
+        if (ctx->links[i].dev == st->st_dev && ctx->links[i].ino == st->st_ino)
+            return ctx->links[i].name;
+    }
+    return NULL;
+}
+
+static void add_link(struct tar_context* ctx, const struct stat* st, const char* name) {
+    if (ctx->link_count == ctx->link_capacity) {
+        ctx->link_capacity = ctx->link_capacity ? ctx->link_capacity * 2 : 16;
+        ctx->links = realloc(ctx->links, sizeof(struct tar_link) * ctx->link_capacity);
+        if (ctx->links == NULL) {
+            ctx->link_count = ctx->link_capacity = 0;
+            return;
+        }
+    }
+    ctx->links[ctx->link_count].dev = st->st_dev;
+    ctx->links[ctx->link_count].ino = st->st_ino;
+    ctx->links[ctx->link_count].name = strdup(name);
+    ctx->link_count++;
+}
+
+static int is_excluded(struct tar_context* ctx, const char* name) {
+    int i;
+    for (i = 0; i < ctx->exclude_count; i++) {
+        if (fnmatch(ctx->excludes[i], name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void report_progress(struct tar_context* ctx, const char* name) {
+    if (ctx->callback != NULL)
+        ctx->callback(name, ctx->done_bytes, ctx->total_bytes);
+}
+
+static void archive_file_data(struct tar_context* ctx, const char* path, const char* name, unsigned long long size) {
+    unsigned long long remaining = size;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        LOGW("Unable to read %s: %s\n", path, strerror(errno));
+
+    // read straight into the block being filled
+    while (remaining > 0 && fd >= 0) {
+        struct tar_block* block = current_block(ctx);
+        size_t chunk = ctx->block_size - block->in_len;
+        if (chunk > remaining)
+            chunk = remaining;
+        ssize_t n = read(fd, block->in + block->in_len, chunk);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                LOGW("Error reading %s: %s\n", path, strerror(errno));
+            else
+                LOGW("%s shrank while being archived\n", path);
+            break;
+        }
+        block->in_len += n;
+        remaining -= n;
+        ctx->done_bytes += n;
+        if (block->in_len == ctx->block_size) {
+            submit_block(ctx, 0);
+            // keep large files from stalling the progress bar
+            report_progress(ctx, name);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+
+    // the header already promised size bytes; pad out a short read
+    ctx->done_bytes += remaining;
+    tar_zeros(ctx, remaining);
+    tar_pad(ctx, size, TAR_RECORD_SIZE);
+}
+
+static void archive_tree(struct tar_context* ctx, const char* path, const char* name);
+
+static void archive_entry(struct tar_context* ctx, const char* path, const char* name) {
+    struct stat st;
+    if (lstat(path, &st)) {
+        LOGW("Unable to stat %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_nlink > 1) {
+            const char* target = find_link(ctx, &st);
+            if (target != NULL) {
+                write_entry_header(ctx, name, &st, '1', target, 0);
+                report_progress(ctx, name);
+                return;
+            }
+            add_link(ctx, &st, name);
+        }
+        write_entry_header(ctx, name, &st, '0', NULL, st.st_size);
+        archive_file_data(ctx, path, name, st.st_size);
+        report_progress(ctx, name);
+    } else if (S_ISDIR(st.st_mode)) {
+        char dir_name[PATH_MAX];
+        snprintf(dir_name, sizeof(dir_name), "%s/", name);
+        write_entry_header(ctx, dir_name, &st, '5', NULL, 0);
+        report_progress(ctx, dir_name);
+        archive_tree(ctx, path, name);
+    } else if (S_ISLNK(st.st_mode)) {
+        char link[PATH_MAX];
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        if (len < 0) {
+            LOGW("Unable to read link %s: %s\n", path, strerror(errno));
+            return;
+        }
+        link[len] = '\0';
+        write_entry_header(ctx, name, &st, '2', link, 0);
+        report_progress(ctx, name);
+    } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)) {
+        write_entry_header(ctx, name, &st, S_ISCHR(st.st_mode) ? '3' : S_ISBLK(st.st_mode) ? '4' : '6', NULL, 0);
+        report_progress(ctx, name);
+    } else {
+        // sockets can not be archived
+        LOGI("Skipping %s\n", path);
+    }
+}
+
+static void archive_tree(struct tar_context* ctx, const char* path, const char* name) {
+    DIR* dp = opendir(path);
+    if (dp == NULL) {
+        LOGW("Unable to open %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    struct dirent* ep;
+    while (!ctx->error && (ep = readdir(dp)) != NULL) {
+        if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+            continue;
+        char child_path[PATH_MAX];
+        char child_name[PATH_MAX];
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, ep->d_name);
+        snprintf(child_name, sizeof(child_name), "%s/%s", name, ep->d_name);
+        if (is_excluded(ctx, child_name))
+            continue;
+        archive_entry(ctx, child_path, child_name);
+    }
+    closedir(dp);
+}
+
+// Adds up the size of the regular files that will be archived, for
+// byte accurate progress.
+static void count_tree(struct tar_context* ctx, const char* path, const char* name) {
+    DIR* dp = opendir(path);
+    if (dp == NULL)
+        return;
+
+    struct dirent* ep;
+    while ((ep = readdir(dp)) != NULL) {
+        if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+            continue;
+        char child_path[PATH_MAX];
+        char child_name[PATH_MAX];
+        struct stat st;
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, ep->d_name);
+        snprintf(child_name, sizeof(child_name), "%s/%s", name, ep->d_name);
+        if (is_excluded(ctx, child_name) || lstat(child_path, &st))
+            continue;
+        if (S_ISREG(st.st_mode))
+            ctx->total_bytes += st.st_size;
+        else if (S_ISDIR(st.st_mode))
+            count_tree(ctx, child_path, child_name);
+    }
+    closedir(dp);
+}
+
+static size_t block_bound(int compression, size_t len) {
+    switch (compression) {
+        case TAR_COMPRESS_GZIP:
+            // room for incompressible data plus the flush markers
+            return deflateBound(NULL, len) + 64;
+        case TAR_COMPRESS_LZ4:
+            // block size prefix
+            return 4 + lz4_compress_bound(len);
+#ifdef HAVE_LIBZSTD
+        case TAR_COMPRESS_ZSTD:
+            return ZSTD_compressBound(len);
+#endif
+    }
+    return 0;
+}
+
+static int start_workers(struct tar_context* ctx) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus > 0 ? (int)cpus : 1;
+
+    ctx->block_size = ctx->compression == TAR_COMPRESS_ZSTD ? TAR_ZSTD_BLOCK_SIZE : TAR_BLOCK_SIZE;
+    // enough blocks for every worker to have one in flight while the
+    // walk fills the next ones
+    ctx->block_count = ctx->compression == TAR_COMPRESS_NONE ? 1 : wanted * 2 + 2;
+    ctx->blocks = calloc(ctx->block_count, sizeof(struct tar_block));
+    if (ctx->blocks == NULL)
+        return -1;
+
+    int i;
+    for (i = 0; i < ctx->block_count; i++) {
+        struct tar_block* block = &ctx->blocks[i];
+        block->in = malloc(ctx->block_size);
+        if (block->in == NULL)
+            return -1;
+        if (ctx->compression == TAR_COMPRESS_NONE)
+            continue;
+        if (ctx->compression == TAR_COMPRESS_GZIP) {
+            block->dict = malloc(TAR_DICT_SIZE);
+            if (block->dict == NULL)
+                return -1;
+        }
+        block->out_capacity = block_bound(ctx->compression, ctx->block_size);
+        block->out = malloc(block->out_capacity);
+        if (block->out == NULL)
+            return -1;
+    }
+
+    if (ctx->compression == TAR_COMPRESS_NONE)
+        return 0;
+
+    ctx->threads = malloc(sizeof(pthread_t) * wanted);
+    if (ctx->threads != NULL) {
+        for (i = 0; i < wanted; i++) {
+            if (pthread_create(&ctx->threads[i], NULL, compress_worker, ctx))
+                break;
+            ctx->thread_count++;
+        }
+    }
+    if (ctx->thread_count == 0 && codec_init(&ctx->codec, ctx->compression))
+        return -1;
+    return 0;
+}
+
+static void stop_workers(struct tar_context* ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->shutdown = 1;
+    pthread_cond_broadcast(&ctx->work_cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    int i;
+    for (i = 0; i < ctx->thread_count; i++)
+        pthread_join(ctx->threads[i], NULL);
+    free(ctx->threads);
+    if (ctx->thread_count == 0 && ctx->compression != TAR_COMPRESS_NONE)
+        codec_free(&ctx->codec, ctx->compression);
+
+    if (ctx->blocks != NULL) {
+        for (i = 0; i < ctx->block_count; i++) {
+            free(ctx->blocks[i].in);
+            free(ctx->blocks[i].dict);
+            free(ctx->blocks[i].out);
+        }
+        free(ctx->blocks);
+    }
+    for (i = 0; i < ctx->link_count; i++)
+        free(ctx->links[i].name);
+    free(ctx->links);
+}
+
+static int write_stream_header(struct tar_context* ctx) {
+    if (ctx->compression == TAR_COMPRESS_GZIP) {
+        // gzip member header: deflate, no name, no mtime, unix
+        static const unsigned char gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+        return output_write(&ctx->output, gzip_header, sizeof(gzip_header));
+    }
+    if (ctx->compression == TAR_COMPRESS_LZ4) {
+        unsigned char frame_header[7];
+        write_le32(frame_header, LZ4_FRAME_MAGIC);
+        frame_header[4] = LZ4_FLG_VERSION | LZ4_FLG_BLOCK_INDEPENDENT;
+        frame_header[5] = TAR_LZ4_BLOCK_ID << 4;
+        frame_header[6] = (lz4_xxh32(frame_header + 4, 2, 0) >> 8) & 0xff;
+        return output_write(&ctx->output, frame_header, sizeof(frame_header));
+    }
+    return 0;
+}
+
+static int write_stream_trailer(struct tar_context* ctx) {
+    unsigned char trailer[8];
+    if (ctx->compression == TAR_COMPRESS_GZIP) {
+        write_le32(trailer, ctx->crc);
+        write_le32(trailer + 4, (uLong)(ctx->uncompressed_bytes & 0xffffffff));
+        return output_write(&ctx->output, trailer, 8);
+    }
+    if (ctx->compression == TAR_COMPRESS_LZ4) {
+        // end mark
+        write_le32(trailer, 0);
+        return output_write(&ctx->output, trailer, 4);
+    }
+    return 0;
+}
+
+int tar_compression_supported(int compression) {
+#ifndef HAVE_LIBZSTD
+    if (compression == TAR_COMPRESS_ZSTD)
+        return 0;
+#endif
+    return compression >= TAR_COMPRESS_NONE && compression <= TAR_COMPRESS_ZSTD;
+}
+
+int tar_create(const char* path, const char* output, int compression,
+               const char** excludes, int exclude_count,
+               tar_progress_callback callback, tar_volume_callback volume_callback) {
+    char parent[PATH_MAX];
+    const char* name;
+    struct stat st;
+
+    if (!tar_compression_supported(compression)) {
+        LOGE("Compression format not supported.\n");
+        return -1;
+    }
+    if (lstat(path, &st) || !S_ISDIR(st.st_mode)) {
+        LOGE("Unable to open %s\n", path);
+        return -1;
+    }
+
+    // member names are relative to the parent of path
+    strcpy(parent, path);
+    char* slash = strrchr(parent, '/');
+    if (slash == NULL) {
+        name = path;
+    } else {
+        name = path + (slash - parent) + 1;
+        if (slash == parent)
+            slash[1] = '\0';
+        else
+            *slash = '\0';
+    }
+
+    struct tar_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.compression = compression;
+    ctx.excludes = excludes;
+    ctx.exclude_count = exclude_count;
+    ctx.callback = callback;
+    ctx.output.base = output;
+    ctx.output.fd = -1;
+    ctx.output.volume_callback = volume_callback;
+    ctx.crc = crc32(0L, Z_NULL, 0);
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.work_cond, NULL);
+    pthread_cond_init(&ctx.done_cond, NULL);
+
+    int ret = 0;
+    if (start_workers(&ctx)) {
+        LOGE("Out of memory.\n");
+        ret = -1;
+        goto out;
+    }
+
+    count_tree(&ctx, path, name);
+
+    if (write_stream_header(&ctx))
+        ctx.error = 1;
+
+    char root_name[PATH_MAX];
+    snprintf(root_name, sizeof(root_name), "%s/", name);
+    write_entry_header(&ctx, root_name, &st, '5', NULL, 0);
+    report_progress(&ctx, root_name);
+    archive_tree(&ctx, path, name);
+
+    // end of archive: two zero records, padded out to the blocking factor
+    unsigned long long archive_bytes = ctx.uncompressed_bytes + current_block(&ctx)->in_len + 2 * TAR_RECORD_SIZE;
+    tar_zeros(&ctx, 2 * TAR_RECORD_SIZE);
+    tar_pad(&ctx, archive_bytes, TAR_ARCHIVE_BLOCKING);
+    submit_block(&ctx, 1);
+
+    if (ctx.thread_count > 0) {
+        pthread_mutex_lock(&ctx.lock);
+        flush_blocks_locked(&ctx, 1);
+        pthread_mutex_unlock(&ctx.lock);
+    }
+
+    if (!ctx.error && write_stream_trailer(&ctx))
+        ctx.error = 1;
+
+    if (ctx.error)
+        ret = -1;
+
+out:
+    stop_workers(&ctx);
+    if (output_close(&ctx.output))
+        ret = -1;
+    pthread_cond_destroy(&ctx.done_cond);
+    pthread_cond_destroy(&ctx.work_cond);
+    pthread_mutex_destroy(&ctx.lock);
+    return ret;
+}
+
+// Restores read the volumes back in order, decompress them in-process and
+// feed the tar stream to tar(1) running in the parent of the destination.
+
+#define TAR_READ_SIZE (128 * 1024)
+
+struct tar_input {
+    const char* base;
+    int fd;
+    // -1 while reading the base file itself, then the volume suffix index
+    int volume;
+    char name[PATH_MAX];
+    int eof;
+    MD5_CTX md5;
+    tar_volume_callback volume_callback;
+    unsigned long long total_bytes;
+    unsigned long long done_bytes;
+};
+
+struct tar_extract_context {
+    int compression;
+    tar_progress_callback callback;
+    struct tar_input input;
+    FILE* tar;
+    int error;
+};
+
+static void input_name(struct tar_input* in, int volume, char* name) {
+    if (volume < 0)
+        strcpy(name, in->base);
+    else
+        sprintf(name, "%s.%c", in->base, 'a' + volume);
+}
+
+// Adds up the size of the base file and every volume after it.
+static void input_stat(struct tar_input* in) {
+    int volume;
+    for (volume = -1; volume < 26; volume++) {
+        char name[PATH_MAX];
+        struct stat st;
+        input_name(in, volume, name);
+        if (stat(name, &st)) {
+            if (volume >= 0)
+                break;
+            continue;
+        }
+        in->total_bytes += st.st_size;
+    }
+}
+
+// Reads the next chunk of the concatenated volumes. Returns the number of
+// bytes read, 0 after the last volume and -1 on errors.
+static ssize_t input_read(struct tar_input* in, void* data, size_t len) {
+    while (!in->eof) {
+        if (in->fd < 0) {
+            if (in->volume == 25) {
+                in->eof = 1;
+                break;
+            }
+            in->volume++;
+            input_name(in, in->volume, in->name);
+            in->fd = open(in->name, O_RDONLY);
+            if (in->fd < 0) {
+                // the base file is optional for split archives
+                if (errno == ENOENT && in->volume >= 0) {
+                    in->eof = 1;
+                    break;
+                }
+                if (errno != ENOENT) {
+                    LOGE("Unable to open %s: %s\n", in->name, strerror(errno));
+                    return -1;
+                }
+                continue;
+            }
+            MD5_Init(&in->md5);
+        }
+
+        ssize_t n = read(in->fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            LOGE("Error reading %s: %s\n", in->name, strerror(errno));
+            return -1;
+        }
+        if (n > 0) {
+            MD5_Update(&in->md5, data, n);
+            in->done_bytes += n;
+            return n;
+        }
+        close(in->fd);
+        in->fd = -1;
+
+        // each volume is checked as soon as it has been read
+        unsigned char md5[MD5_DIGEST_LENGTH];
+        MD5_Final(md5, &in->md5);
+        if (in->volume_callback != NULL && in->volume_callback(in->name, md5)) {
+            in->eof = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static ssize_t extract_read(struct tar_extract_context* ctx, void* data, size_t len) {
+    ssize_t n = input_read(&ctx->input, data, len);
+    if (n < 0)
+        ctx->error = 1;
+    else if (n > 0 && ctx->callback != NULL)
+        ctx->callback(ctx->input.name, ctx->input.done_bytes, ctx->input.total_bytes);
+    return n;
+}
+
+// Reads exactly len bytes. Returns 0 on success, 1 if the input ended
+// before the first byte and -1 on errors or a truncated read.
+static int extract_read_full(struct tar_extract_context* ctx, void* data, size_t len) {
+    unsigned char* p = data;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = extract_read(ctx, p + done, len - done);
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            if (done == 0)
+                return 1;
+            LOGE("Backup is truncated.\n");
+            ctx->error = 1;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int extract_write(struct tar_extract_context* ctx, const void* data, size_t len) {
+    if (len > 0 && fwrite(data, 1, len, ctx->tar) != len) {
+        LOGE("Error writing to tar: %s\n", strerror(errno));
+        ctx->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void extract_none(struct tar_extract_context* ctx, unsigned char* buf) {
+    ssize_t n;
+    while ((n = extract_read(ctx, buf, TAR_READ_SIZE)) > 0) {
+        if (extract_write(ctx, buf, n))
+            return;
+    }
+}
+
+static void extract_gzip(struct tar_extract_context* ctx, unsigned char* buf) {
+    unsigned char* out = malloc(TAR_READ_SIZE);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // detect the gzip header
+    if (out == NULL || inflateInit2(&strm, MAX_WBITS + 32) != Z_OK) {
+        LOGE("Out of memory.\n");
+        free(out);
+        ctx->error = 1;
+        return;
+    }
+
+    int ret = Z_OK;
+    int eof = 0;
+    while (!ctx->error) {
+        if (strm.avail_in == 0 && !eof) {
+            ssize_t n = extract_read(ctx, buf, TAR_READ_SIZE);
+            if (n < 0)
+                break;
+            eof = n == 0;
+            strm.next_in = buf;
+            strm.avail_in = n;
+        }
+        if (ret == Z_STREAM_END) {
+            // pigz and gzip may write several members back to back
+            if (strm.avail_in == 0 && eof)
+                break;
+            inflateReset(&strm);
+        }
+
+        strm.next_out = out;
+        strm.avail_out = TAR_READ_SIZE;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && !eof)) {
+            LOGE("Backup is corrupt or truncated.\n");
+            ctx->error = 1;
+            break;
+        }
+        if (extract_write(ctx, out, TAR_READ_SIZE - strm.avail_out))
+            break;
+    }
+
+    inflateEnd(&strm);
+    free(out);
+}
+
+static uint32_t read_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int extract_skip(struct tar_extract_context* ctx, unsigned char* buf, size_t len) {
+    while (len > 0) {
+        size_t chunk = len > TAR_READ_SIZE ? TAR_READ_SIZE : len;
+        if (extract_read_full(ctx, buf, chunk))
+            return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Decodes one lz4 frame after its magic number.
+static int extract_lz4_frame(struct tar_extract_context* ctx, unsigned char* buf) {
+    unsigned char descriptor[15];
+    if (extract_read_full(ctx, descriptor, 2))
+        return -1;
+    int flags = descriptor[0];
+    size_t max_size = lz4_block_max_size((descriptor[1] >> 4) & 7);
+    if ((flags & 0xc0) != LZ4_FLG_VERSION || max_size == 0) {
+        LOGE("Unsupported lz4 frame.\n");
+        return -1;
+    }
+    size_t descriptor_len = 2 + (flags & LZ4_FLG_CONTENT_SIZE ? 8 : 0) + (flags & LZ4_FLG_DICT_ID ? 4 : 0);
+    if (extract_read_full(ctx, descriptor + 2, descriptor_len - 2 + 1))
+        return -1;
+    if (descriptor[descriptor_len] != ((lz4_xxh32(descriptor, descriptor_len, 0) >> 8) & 0xff)) {
+        LOGE("Corrupt lz4 frame header.\n");
+        return -1;
+    }
+
+    // linked blocks may refer back into the previous 64K of output, so
+    // decode after a window holding it
+    unsigned char* in = malloc(max_size);
+    unsigned char* window = malloc(LZ4_WINDOW_SIZE + max_size);
+    unsigned char* out = window + LZ4_WINDOW_SIZE;
+    size_t prefix_len = 0;
+    int ret = -1;
+    if (in == NULL || window == NULL) {
+        LOGE("Out of memory.\n");
+        goto out;
+    }
+
+    for (;;) {
+        unsigned char size_field[4];
+        if (extract_read_full(ctx, size_field, 4))
+            goto out;
+        uint32_t size = read_le32(size_field);
+        if (size == 0)
+            break;
+
+        size_t len = size & ~LZ4_BLOCK_UNCOMPRESSED;
+        if (len > max_size) {
+            LOGE("Corrupt lz4 block.\n");
+            goto out;
+        }
+        if (extract_read_full(ctx, in, len))
+            goto out;
+        if ((flags & LZ4_FLG_BLOCK_CHECKSUM) && extract_skip(ctx, buf, 4))
+            goto out;
+
+        long decoded;
+        if (size & LZ4_BLOCK_UNCOMPRESSED) {
+            memcpy(out, in, len);
+            decoded = len;
+        } else {
+            decoded = lz4_decompress_block(in, len, out, max_size, prefix_len);
+            if (decoded < 0) {
+                LOGE("Corrupt lz4 block.\n");
+                goto out;
+            }
+        }
+        if (extract_write(ctx, out, decoded))
+            goto out;
+
+        if (!(flags & LZ4_FLG_BLOCK_INDEPENDENT)) {
+            size_t keep = prefix_len + decoded;
+            if (keep > LZ4_WINDOW_SIZE)
+                keep = LZ4_WINDOW_SIZE;
+            memmove(window + LZ4_WINDOW_SIZE - keep, out + decoded - keep, keep);
+            prefix_len = keep;
+        }
+    }
+
+    if ((flags & LZ4_FLG_CONTENT_CHECKSUM) && extract_skip(ctx, buf, 4))
+        goto out;
+    ret = 0;
+
+out:
+    free(in);
+    free(window);
+    return ret;
+}
+
+static void extract_lz4(struct tar_extract_context* ctx, unsigned char* buf) {
+    int frames = 0;
+    for (;;) {
+        unsigned char magic_field[4];
+        int ret = extract_read_full(ctx, magic_field, 4);
+        if (ret == 1 && frames > 0)
+            return;
+        if (ret) {
+            ctx->error = 1;
+            return;
+        }
+
+        uint32_t magic = read_le32(magic_field);
+        if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+            if (extract_read_full(ctx, magic_field, 4) || extract_skip(ctx, buf, read_le32(magic_field))) {
+                ctx->error = 1;
+                return;
+            }
+            continue;
+        }
+        if (magic != LZ4_FRAME_MAGIC) {
+            LOGE("Backup is not an lz4 archive.\n");
+            ctx->error = 1;
+            return;
+        }
+        if (extract_lz4_frame(ctx, buf)) {
+            ctx->error = 1;
+            return;
+        }
+        frames++;
+    }
+}
+
+#ifdef HAVE_LIBZSTD
+static void extract_zstd(struct tar_extract_context* ctx, unsigned char* buf) {
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    size_t out_size = ZSTD_DStreamOutSize();
+    unsigned char* out = malloc(out_size);
+    if (dctx == NULL || out == NULL) {
+        LOGE("Out of memory.\n");
+        ctx->error = 1;
+        goto out;
+    }
+
+    ZSTD_inBuffer input = { buf, 0, 0 };
+    size_t remaining = 0;
+    for (;;) {
+        if (input.pos == input.size) {
+            ssize_t n = extract_read(ctx, buf, TAR_READ_SIZE);
+            if (n < 0)
+                break;
+            if (n == 0) {
+                // remaining is 0 only between frames
+                if (remaining != 0) {
+                    LOGE("Backup is truncated.\n");
+                    ctx->error = 1;
+                }
+                break;
+            }
+            input.size = n;
+            input.pos = 0;
+        }
+
+        ZSTD_outBuffer output = { out, out_size, 0 };
+        remaining = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(remaining)) {
+            LOGE("Backup is corrupt: %s\n", ZSTD_getErrorName(remaining));
+            ctx->error = 1;
+            break;
+        }
+        if (extract_write(ctx, out, output.pos))
+            break;
+    }
+
+out:
+    free(out);
+    ZSTD_freeDCtx(dctx);
+}
+#endif
+
+int tar_extract(const char* input, const char* path, int compression,
+                tar_progress_callback callback, tar_volume_callback volume_callback) {
+    if (!tar_compression_supported(compression)) {
+        LOGE("Compression format not supported.\n");
+        return -1;
+    }
+
+    struct tar_extract_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.compression = compression;
+    ctx.callback = callback;
+    ctx.input.base = input;
+    ctx.input.fd = -1;
+    ctx.input.volume = -2;
+    ctx.input.volume_callback = volume_callback;
+    strcpy(ctx.input.name, input);
+    input_stat(&ctx.input);
+
+    unsigned char* buf = malloc(TAR_READ_SIZE);
+    if (buf == NULL) {
+        LOGE("Out of memory.\n");
+        return -1;
+    }
+
+    // members are named relative to the parent of path
+    char parent[PATH_MAX];
+    strcpy(parent, path);
+    char* slash = strrchr(parent, '/');
+    if (slash == NULL)
+        strcpy(parent, ".");
+    else if (slash == parent)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+
+    char command[PATH_MAX + 32];
+    sprintf(command, "cd '%s' ; tar x ; exit $?", parent);
+
+    // an early exit of tar shows up as a write error rather than a signal
+    struct sigaction ignore, saved;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &saved);
+
+    ctx.tar = __popen(command, "w");
+    if (ctx.tar == NULL) {
+        LOGE("Unable to execute tar.\n");
+        sigaction(SIGPIPE, &saved, NULL);
+        free(buf);
+        return -1;
+    }
+
+    switch (compression) {
+        case TAR_COMPRESS_NONE:
+            extract_none(&ctx, buf);
+            break;
+        case TAR_COMPRESS_GZIP:
+            extract_gzip(&ctx, buf);
+            break;
+        case TAR_COMPRESS_LZ4:
+            extract_lz4(&ctx, buf);
+            break;
+#ifdef HAVE_LIBZSTD
+        case TAR_COMPRESS_ZSTD:
+            extract_zstd(&ctx, buf);
+            break;
+#endif
+    }
+
+    if (fflush(ctx.tar))
+        ctx.error = 1;
+    int status = __pclose(ctx.tar);
+    sigaction(SIGPIPE, &saved, NULL);
+    if (ctx.input.fd >= 0)
+        close(ctx.input.fd);
+    free(buf);
+
+    if (status != 0) {
+        LOGE("tar exited with status %d\n", status);
+        return status;
+    }
+    return ctx.error ? -1 : 0;
+}
@@ -0,0 +1,47 @@
+#ifndef NANDROID_TAR_H
+#define NANDROID_TAR_H
+
+// In-process tar archiver used by nandroid backups.
+
+// Archives are split into volumes of this many bytes, named
+// <output>.a, <output>.b, ... as `split -a 1 -b 1000000000` would.
+#define TAR_VOLUME_SIZE 1000000000LL
+
+enum {
+    TAR_COMPRESS_NONE,
+    TAR_COMPRESS_GZIP,
+    TAR_COMPRESS_LZ4,
+    // only available when built with libzstd
+    TAR_COMPRESS_ZSTD,
+};
+
+// Called for each archived entry with its name in the archive, and with
+// the number of file bytes archived so far out of the total expected.
+// While extracting, called with the volume being read and the number of
+// archive bytes read so far.
+typedef void (*tar_progress_callback)(const char* name, unsigned long long done, unsigned long long total);
+
+// Called with the path and MD5 digest of each volume once it has been
+// completely written or read. A non-zero return fails the operation.
+typedef int (*tar_volume_callback)(const char* path, const unsigned char* md5);
+
+// Archives the directory tree at path, with member names relative to its
+// parent directory, as `cd $(dirname path) ; tar c $(basename path)`.
+// Entries whose archive name matches one of the fnmatch(3) patterns in
+// excludes are skipped along with their contents.
+// Returns 0 on success.
+int tar_create(const char* path, const char* output, int compression,
+               const char** excludes, int exclude_count,
+               tar_progress_callback callback, tar_volume_callback volume_callback);
+
+// Returns 1 if this build can read and write the given compression.
+int tar_compression_supported(int compression);
+
+// Extracts the archive at input, and any volumes split off after it,
+// into the parent directory of path, as
+// `cd $(dirname path) ; cat input* | tar x` would.
+// Returns 0 on success.
+int tar_extract(const char* input, const char* path, int compression,
+                tar_progress_callback callback, tar_volume_callback volume_callback);
+
+#endif
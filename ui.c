@@ -75,6 +75,15 @@ UIParameters ui_parameters = {
 };
 
 static pthread_mutex_t gUpdateMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Screen updates requested by ui_print(), drawn by render_thread.
+static pthread_cond_t gRenderCond = PTHREAD_COND_INITIALIZER;
+static int gScreenDirty = 0;
+static int gRenderThreadRunning = 0;
+static double gLastFrameTime = 0;
+
+// Signalled when something progress_thread animates may have started.
+static pthread_cond_t gProgressCond = PTHREAD_COND_INITIALIZER;
 static gr_surface gBackgroundIcon[NUM_BACKGROUND_ICONS];
 static gr_surface *gInstallationOverlay;
 static gr_surface *gProgressBarIndeterminate;
@@ -397,6 +406,22 @@ static void update_screen_locked(void)
         draw_spec_menu();
 #endif
     gr_flip();
+    gScreenDirty = 0;
+    gLastFrameTime = now();
+}
+
+// Have the screen redrawn at the next frame, so that many changes in
+// quick succession cost one redraw.  Draws right away if the render
+// thread hasn't been started yet.
+// Should only be called with gUpdateMutex locked.
+static void request_update_locked(void)
+{
+    if (!gRenderThreadRunning) {
+        update_screen_locked();
+    } else if (!gScreenDirty) {
+        gScreenDirty = 1;
+        pthread_cond_signal(&gRenderCond);
+    }
 }
 
 // Updates only the progress bar, if possible, otherwise redraws the screen.
@@ -407,51 +432,117 @@ static void update_progress_locked(void)
     if (show_text || !gPagesIdentical) {
         draw_screen_locked();    // Must redraw the whole screen
         gPagesIdentical = 1;
+        gr_flip();
+        gScreenDirty = 0;
+        gLastFrameTime = now();
     } else {
         draw_progress_locked();  // Draw only the progress bar and overlays
+        gr_flip();
     }
-    gr_flip();
+}
+
+// Wait on cond, with gUpdateMutex locked, until it is signalled or
+// until the time given in seconds (as returned by now()).
+static void cond_wait_until(pthread_cond_t *cond, double deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) deadline;
+    ts.tv_nsec = (long) ((deadline - ts.tv_sec) * 1000000000.0);
+    pthread_cond_timedwait(cond, &gUpdateMutex, &ts);
+}
+
+// Draws the updates requested with request_update_locked(), at most
+// once per frame interval.
+static void *render_thread(void *cookie)
+{
+    double interval = 1.0 / ui_parameters.update_fps;
+    pthread_mutex_lock(&gUpdateMutex);
+    for (;;) {
+        while (!gScreenDirty)
+            pthread_cond_wait(&gRenderCond, &gUpdateMutex);
+
+        // Let more changes pile up if the last frame was recent.
+        double next = gLastFrameTime + interval;
+        if (now() < next) {
+            cond_wait_until(&gRenderCond, next);
+            continue;
+        }
+        update_screen_locked();
+    }
+    pthread_mutex_unlock(&gUpdateMutex);
+    return NULL;
+}
+
+// The installation animation is skipped under a text overlay (too
+// expensive to update), unless CWM_INST_ANIM is set.
+// Should only be called with gUpdateMutex locked.
+static int install_animating_locked(void)
+{
+#ifndef CWM_INST_ANIM
+    if (show_text) return 0;
+#endif
+    return gCurrentIcon == BACKGROUND_ICON_INSTALLING &&
+           ui_parameters.installing_frames > 0;
+}
+
+// As is the indeterminate progress bar.
+// Should only be called with gUpdateMutex locked.
+static int indeterminate_animating_locked(void)
+{
+#ifndef CWM_INST_ANIM
+    if (show_text) return 0;
+#endif
+    return gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE;
+}
+
+// True while a ui_show_progress() scope with a duration is still filling.
+// Should only be called with gUpdateMutex locked.
+static int timed_progress_locked(void)
+{
+    return gProgressBarType == PROGRESSBAR_TYPE_NORMAL &&
+           gProgressScopeDuration > 0 && gProgress < 1.0;
 }
 
 // Keeps the progress bar updated, even when the process is otherwise busy.
+// Sleeps on gProgressCond while nothing is animating; otherwise draws a
+// frame at every 1/update_fps deadline, leaving the lock free for at
+// least 20ms between frames.
 static void *progress_thread(void *cookie)
 {
     double interval = 1.0 / ui_parameters.update_fps;
+    double next = 0;
+    pthread_mutex_lock(&gUpdateMutex);
     for (;;) {
-        double start = now();
-        pthread_mutex_lock(&gUpdateMutex);
+        if (!install_animating_locked() && !indeterminate_animating_locked() &&
+            !timed_progress_locked()) {
+            pthread_cond_wait(&gProgressCond, &gUpdateMutex);
+            // whoever woke us has just drawn the first frame
+            next = now() + interval;
+            continue;
+        }
+        if (now() < next) {
+            cond_wait_until(&gProgressCond, next);
+            continue;
+        }
 
         int redraw = 0;
 
         // update the installation animation, if active
-        // skip this if we have a text overlay (too expensive to update)
-        if (gCurrentIcon == BACKGROUND_ICON_INSTALLING &&
-#ifndef CWM_INST_ANIM
-            ui_parameters.installing_frames > 0 &&
-            !show_text) {
-#else
-            ui_parameters.installing_frames > 0) {
-#endif
+        if (install_animating_locked()) {
             gInstallingFrame =
                 (gInstallingFrame + 1) % ui_parameters.installing_frames;
             redraw = 1;
         }
 
         // update the progress bar animation, if active
-        // skip this if we have a text overlay (too expensive to update)
-#ifndef CWM_INST_ANIM
-        if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
-#else
-        if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) {
-#endif
+        if (indeterminate_animating_locked()) {
             redraw = 1;
         }
 
         // move the progress bar forward on timed intervals, if configured
-        int duration = gProgressScopeDuration;
-        if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0) {
+        if (timed_progress_locked()) {
             double elapsed = now() - gProgressScopeTime;
-            float progress = 1.0 * elapsed / duration;
+            float progress = 1.0 * elapsed / gProgressScopeDuration;
             if (progress > 1.0) progress = 1.0;
             if (progress > gProgress) {
                 gProgress = progress;
@@ -461,13 +552,13 @@ static void *progress_thread(void *cookie)
 
         if (redraw) update_progress_locked();
 
-        pthread_mutex_unlock(&gUpdateMutex);
+        // Schedule from the deadline rather than from now, so frames
+        // don't drift; if drawing overran, start again from here.
         double end = now();
-        // minimum of 20ms delay between frames
-        double delay = interval - (end-start);
-        if (delay < 0.02) delay = 0.02;
-        usleep((long)(delay * 1000000));
+        next += interval;
+        if (next < end + 0.02) next = end + 0.02;
     }
+    pthread_mutex_unlock(&gUpdateMutex);
     return NULL;
 }
 
@@ -670,6 +761,7 @@ static int input_callback(int fd, short revents, void *data)
         show_text = !show_text;
         if (show_text) show_text_ever = 1;
         update_screen_locked();
+        pthread_cond_signal(&gProgressCond);
         pthread_mutex_unlock(&gUpdateMutex);
     }
 
@@ -1043,6 +1135,9 @@ void ui_init(void)
     }
 
     pthread_t t;
+    pthread_mutex_lock(&gUpdateMutex);
+    gRenderThreadRunning = pthread_create(&t, NULL, render_thread, NULL) == 0;
+    pthread_mutex_unlock(&gUpdateMutex);
     pthread_create(&t, NULL, progress_thread, NULL);
     pthread_create(&t, NULL, input_thread, NULL);
     pthread_create(&t, NULL, leds_thread, NULL);
@@ -1112,6 +1207,7 @@ void ui_set_background(int icon)
     pthread_mutex_lock(&gUpdateMutex);
     gCurrentIcon = icon;
     update_screen_locked();
+    pthread_cond_signal(&gProgressCond);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -1121,6 +1217,7 @@ void ui_show_indeterminate_progress()
     if (gProgressBarType != PROGRESSBAR_TYPE_INDETERMINATE) {
         gProgressBarType = PROGRESSBAR_TYPE_INDETERMINATE;
         update_progress_locked();
+        pthread_cond_signal(&gProgressCond);
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -1135,6 +1232,7 @@ void ui_show_progress(float portion, int seconds)
     gProgressScopeDuration = seconds;
     gProgress = 0;
     update_progress_locked();
+    pthread_cond_signal(&gProgressCond);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -1225,7 +1323,7 @@ void ui_print(const char *fmt, ...)
             if (*ptr != '\n') text[text_row][text_col++] = *ptr;
         }
         text[text_row][text_col] = '\0';
-        update_screen_locked();
+        request_update_locked();
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -1350,6 +1448,7 @@ void ui_show_text(int visible)
     show_text = visible;
     if (show_text) show_text_ever = 1;
     update_screen_locked();
+    pthread_cond_signal(&gProgressCond);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -1548,7 +1647,10 @@ int ui_should_log_stdout()
 }
 
 void ui_set_show_text(int value) {
+    pthread_mutex_lock(&gUpdateMutex);
     show_text = value;
+    pthread_cond_signal(&gProgressCond);
+    pthread_mutex_unlock(&gUpdateMutex);
 }
 
 void ui_set_showing_back_button(int showBackButton) {
@@ -1577,6 +1679,9 @@ int ui_handle_key(int key, int visible) {
 
 void ui_delete_line() {
     pthread_mutex_lock(&gUpdateMutex);
+    // Show the line before it goes: callers print a transient line and
+    // delete it straight away, before render_thread would get to it.
+    if (gScreenDirty) update_screen_locked();
     text[text_row][0] = '\0';
     text_row = (text_row - 1 + text_rows) % text_rows;
     text_col = 0;